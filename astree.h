@@ -27,6 +27,7 @@ struct astree {
    const string* lexinfo;    // pointer to lexical information
    vector<astree*> children; // children of this n-way node
    symbol symbl;
+   string simd_pragma;       // a while the simd pass marked: its pragma
 
    // Functions.
    astree (int _symbol, const location&, const char* lexinfo);
@@ -0,0 +1,249 @@
+// ocbench.cpp
+// End-to-end compile benchmark.  For each requested size, generates
+// a program with ocgen, compiles it with oc -t and appends one CSV
+// row: throughput, per-phase time (from oc -t) and peak RSS, then
+// the size of the oil and, with -C, the time cc takes to compile it.
+
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+struct bench_options {
+   string oc = "./oc";
+   string ocgen = "bench/ocgen";
+   string workdir = "bench/work";
+   string csvfile = "bench/compile.csv";
+   string genflags;
+   string ocflags;
+   string cc;                  // compiles the oil if not empty
+   string incdir = ".";        // where cc finds oclib.h
+   bool keep = false;
+};
+
+struct run_result {
+   int status = 0;
+   double wall = 0;
+   long maxrss_kb = 0;
+};
+
+double now() {
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs argv with stdout and stderr redirected, returning the exit
+// status, wall time and the peak RSS of the child.
+run_result run (const vector<string>& args, const string& outfile,
+                const string& errfile) {
+   vector<char*> argv;
+   for (const string& arg: args) argv.push_back (const_cast<char*> (
+                                                  arg.c_str()));
+   argv.push_back (nullptr);
+
+   run_result result;
+   double start = now();
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror ("fork");
+      exit (EXIT_FAILURE);
+   }
+   if (pid == 0) {
+      int out = open (outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                      0644);
+      int err = open (errfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                      0644);
+      if (out >= 0) dup2 (out, STDOUT_FILENO);
+      if (err >= 0) dup2 (err, STDERR_FILENO);
+      execvp (argv[0], argv.data());
+      perror (argv[0]);
+      _exit (127);
+   }
+   struct rusage usage;
+   int status = 0;
+   while (wait4 (pid, &status, 0, &usage) < 0) {
+      if (errno != EINTR) {
+         perror ("wait4");
+         exit (EXIT_FAILURE);
+      }
+   }
+   result.wall = now() - start;
+   result.maxrss_kb = usage.ru_maxrss;
+   if (WIFEXITED (status)) result.status = WEXITSTATUS (status);
+   else if (WIFSIGNALED (status)) result.status = 128 + WTERMSIG (status);
+   return result;
+}
+
+size_t count_lines (const string& filename, size_t* bytes = nullptr) {
+   FILE* file = fopen (filename.c_str(), "r");
+   if (file == nullptr) return 0;
+   static char buffer[1 << 16];
+   size_t lines = 0;
+   size_t total = 0;
+   for (;;) {
+      size_t got = fread (buffer, 1, sizeof buffer, file);
+      if (got == 0) break;
+      total += got;
+      for (size_t i = 0; i < got; ++i) if (buffer[i] == '\n') ++lines;
+   }
+   fclose (file);
+   if (bytes != nullptr) *bytes = total;
+   return lines;
+}
+
+// Reads the "time <phase> <seconds>" lines written by oc -t.
+double phase_time (const string& errfile, const char* phase) {
+   FILE* file = fopen (errfile.c_str(), "r");
+   if (file == nullptr) return 0;
+   char name[64];
+   double seconds = 0;
+   double found = 0;
+   char line[256];
+   while (fgets (line, sizeof line, file) != nullptr) {
+      if (sscanf (line, "time %63s %lf", name, &seconds) == 2
+          and strcmp (name, phase) == 0) found = seconds;
+   }
+   fclose (file);
+   return found;
+}
+
+vector<string> split (const string& words) {
+   vector<string> result;
+   size_t pos = 0;
+   for (;;) {
+      size_t start = words.find_first_not_of (' ', pos);
+      if (start == string::npos) break;
+      pos = words.find (' ', start);
+      result.push_back (words.substr (start, pos - start));
+      if (pos == string::npos) break;
+   }
+   return result;
+}
+
+void usage (const char* execname) {
+   fprintf (stderr, "Usage: %s [-c oc] [-g ocgen] [-w workdir]"
+            " [-o csvfile] [-G ocgen-flags] [-F ocflags] [-C cc]"
+            " [-I incdir] [-k] lines...\n", execname);
+   exit (EXIT_FAILURE);
+}
+
+static const char* phases[] = {"parse", "str", "ast", "check",
+                               "opt", "emit", "free"};
+
+int main (int argc, char** argv) {
+   bench_options opts;
+   for (;;) {
+      int opt = getopt (argc, argv, "c:g:w:o:G:F:C:I:k");
+      if (opt == EOF) break;
+      switch (opt) {
+         case 'c': opts.oc = optarg;       break;
+         case 'g': opts.ocgen = optarg;    break;
+         case 'w': opts.workdir = optarg;  break;
+         case 'o': opts.csvfile = optarg;  break;
+         case 'G': opts.genflags = optarg; break;
+         case 'F': opts.ocflags = optarg;  break;
+         case 'C': opts.cc = optarg;       break;
+         case 'I': opts.incdir = optarg;   break;
+         case 'k': opts.keep = true;       break;
+         default:  usage (argv[0]);
+      }
+   }
+   if (optind == argc) usage (argv[0]);
+   mkdir (opts.workdir.c_str(), 0755);
+
+   FILE* csv = fopen (opts.csvfile.c_str(), "w");
+   if (csv == nullptr) {
+      perror (opts.csvfile.c_str());
+      return EXIT_FAILURE;
+   }
+   fprintf (csv, "lines,bytes,tokens,status,wall_s");
+   for (const char* phase: phases) fprintf (csv, ",%s_s", phase);
+   fprintf (csv, ",lines_per_s,tokens_per_s,maxrss_kb");
+   fprintf (csv, ",oil_lines,oil_bytes,cc_status,cc_s\n");
+
+   int exit_status = EXIT_SUCCESS;
+   for (int argi = optind; argi < argc; ++argi) {
+      string size = argv[argi];
+      string base = opts.workdir + "/gen_" + size;
+      string source = base + ".oc";
+
+      vector<string> gen_args {opts.ocgen, "-l", size};
+      for (const string& flag: split (opts.genflags)) {
+         gen_args.push_back (flag);
+      }
+      gen_args.push_back (source);
+      run_result gen = run (gen_args, "/dev/null", base + ".generr");
+      if (gen.status != 0) {
+         fprintf (stderr, "%s: ocgen failed for %s lines\n",
+                  argv[0], size.c_str());
+         exit_status = EXIT_FAILURE;
+         continue;
+      }
+
+      size_t bytes = 0;
+      size_t lines = count_lines (source, &bytes);
+      string errfile = base + ".time";
+      vector<string> oc_args {opts.oc, "-t"};
+      for (const string& flag: split (opts.ocflags)) {
+         oc_args.push_back (flag);
+      }
+      oc_args.push_back (source);
+      run_result oc = run (oc_args, "/dev/null", errfile);
+      size_t tokens = count_lines (base + ".tok");
+      if (oc.status != 0) exit_status = EXIT_FAILURE;
+
+      fprintf (csv, "%zu,%zu,%zu,%d,%.6f", lines, bytes, tokens,
+               oc.status, oc.wall);
+      for (const char* phase: phases) {
+         fprintf (csv, ",%.6f", phase_time (errfile, phase));
+      }
+      fprintf (csv, ",%.0f,%.0f,%ld", lines / oc.wall,
+               tokens / oc.wall, oc.maxrss_kb);
+
+      // what the oil costs downstream: its size, and cc's time
+      size_t oil_bytes = 0;
+      size_t oil_lines = count_lines (base + ".oil", &oil_bytes);
+      fprintf (csv, ",%zu,%zu", oil_lines, oil_bytes);
+      if (not opts.cc.empty() and oc.status == 0) {
+         vector<string> cc_args = split (opts.cc);
+         for (const string& arg: {"-I" + opts.incdir, string ("-c"),
+                                  string ("-x"), string ("c"),
+                                  base + ".oil", string ("-o"),
+                                  base + ".o"}) {
+            cc_args.push_back (arg);
+         }
+         run_result cc = run (cc_args, "/dev/null", base + ".ccerr");
+         if (cc.status != 0) exit_status = EXIT_FAILURE;
+         fprintf (csv, ",%d,%.6f\n", cc.status, cc.wall);
+      }else {
+         fprintf (csv, ",,\n");
+      }
+      fflush (csv);
+      printf ("%9zu lines %10zu tokens  status %d  %8.3f s"
+              "  %10.0f lines/s  %8ld KB  %10zu oil bytes\n", lines,
+              tokens, oc.status, oc.wall, lines / oc.wall,
+              oc.maxrss_kb, oil_bytes);
+      fflush (stdout);
+
+      if (not opts.keep) {
+         for (const char* suffix: {".oc", ".tok", ".str", ".ast",
+                                   ".sym", ".opt", ".oil", ".time",
+                                   ".generr", ".o", ".ccerr"}) {
+            unlink ((base + suffix).c_str());
+         }
+      }
+   }
+   fclose (csv);
+   return exit_status;
+}
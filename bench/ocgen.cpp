@@ -0,0 +1,196 @@
+// ocgen.cpp
+// Generates synthetic oc programs for the compile benchmark.
+// Every program is valid for oc's grammar: structs, globals and
+// functions using locals, fields, arrays, calls, string literals,
+// loops and conditionals.
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct gen_options {
+   size_t lines = 1000;      // approximate number of lines
+   size_t functions = 0;     // 0: derived from lines
+   size_t depth = 3;         // expression depth
+   size_t structs = 4;       // number of struct types
+   size_t strings = 10;      // string literals per 100 statements
+   size_t nesting = 2;       // while/if nesting inside functions
+   unsigned seed = 1;
+};
+
+struct generator {
+   gen_options opts;
+   FILE* out;
+   size_t lines = 0;
+   size_t literal = 0;
+
+   generator (const gen_options& opts_, FILE* out_)
+   : opts (opts_), out (out_) {}
+
+   size_t pick (size_t n) { return n == 0 ? 0 : rand() % n; }
+
+   void line (int indent, const string& text) {
+      fprintf (out, "%*s%s\n", indent * 4, "", text.c_str());
+      ++lines;
+   }
+
+   string structname (size_t nr) { return "rec" + to_string (nr); }
+
+   // int expression over the function's int locals and params
+   string expr (size_t depth) {
+      if (depth == 0) {
+         switch (pick (4)) {
+            case 0:  return to_string (pick (100));
+            case 1:  return "arg";
+            case 2:  return "p.count";
+            default: return "v" + to_string (pick (4));
+         }
+      }
+      static const char* ops[] = {"+", "-", "*"};
+      return "(" + expr (depth - 1) + " " + ops[pick (3)] + " "
+           + expr (depth - 1) + ")";
+   }
+
+   string condition() {
+      static const char* ops[] = {"<", "<=", ">", ">=", "==", "!="};
+      return "v" + to_string (pick (4)) + " " + ops[pick (6)]
+           + " " + expr (opts.depth > 0 ? 1 : 0);
+   }
+
+   string literal_text() {
+      return "\"literal number " + to_string (literal++) + "\\n\"";
+   }
+
+   void emit_struct (size_t nr) {
+      string name = structname (nr);
+      line (0, "struct " + name + " {");
+      line (1, "int count;");
+      line (1, "string label;");
+      line (1, "int[] data;");
+      line (1, structname ((nr + 1) % opts.structs) + " link;");
+      line (0, "}");
+      line (0, "");
+   }
+
+   void emit_statement (int indent, size_t nest, size_t callee) {
+      size_t kind = pick (100);
+      if (nest > 0 and kind < 15) {
+         line (indent, "while (" + condition() + ") {");
+         emit_statement (indent + 1, nest - 1, callee);
+         line (indent + 1, "v0 = v0 + 1;");
+         line (indent, "}");
+      }else if (nest > 0 and kind < 30) {
+         line (indent, "if (" + condition() + ") {");
+         emit_statement (indent + 1, nest - 1, callee);
+         line (indent, "}");
+         line (indent, "else {");
+         emit_statement (indent + 1, nest - 1, callee);
+         line (indent, "}");
+      }else if (kind < 30 + opts.strings) {
+         line (indent, "putstr (" + literal_text() + ");");
+      }else if (kind < 50 and callee > 0) {
+         line (indent, "v" + to_string (pick (4)) + " = fn"
+               + to_string (callee - 1 - pick (callee))
+               + " (" + expr (1) + ", p);");
+      }else if (kind < 60) {
+         line (indent, "p.count = " + expr (opts.depth) + ";");
+      }else if (kind < 65) {
+         line (indent, "p.link.count = p.data[v1] + arg;");
+      }else {
+         line (indent, "v" + to_string (pick (4)) + " = "
+               + expr (opts.depth) + ";");
+      }
+   }
+
+   void emit_function (size_t nr, size_t statements) {
+      line (0, "int fn" + to_string (nr) + " (int arg, "
+            + structname (0) + " p) {");
+      for (size_t var = 0; var < 4; ++var) {
+         line (1, "int v" + to_string (var) + " = arg + "
+               + to_string (var) + ";");
+      }
+      line (1, "string name = " + literal_text() + ";");
+      for (size_t stmt = 0; stmt < statements; ++stmt) {
+         emit_statement (1, opts.nesting, nr);
+      }
+      line (1, "return " + expr (opts.depth) + ";");
+      line (0, "}");
+      line (0, "");
+   }
+
+   void generate() {
+      srand (opts.seed);
+      if (opts.structs == 0) opts.structs = 1;
+      line (0, "// generated by ocgen");
+      line (0, "");
+      for (size_t nr = 0; nr < opts.structs; ++nr) emit_struct (nr);
+      line (0, "int counter = 0;");
+      line (0, "string banner = \"ocgen\";");
+      line (0, "");
+
+      // with -f, spread the lines over that many functions,
+      // else emit functions of 20 statements until the size is hit
+      size_t statements = 20;
+      if (opts.functions > 0) {
+         size_t budget = opts.lines > lines ? opts.lines - lines : 0;
+         size_t per_function = budget / opts.functions;
+         statements = per_function > 10 ? per_function - 8 : 2;
+         // compound statements take several lines each
+         statements = statements * 10 / (10 + 9 * opts.nesting) + 1;
+      }
+      size_t functions = 0;
+      while (opts.functions > 0 ? functions < opts.functions
+                                : lines + 6 < opts.lines or functions == 0) {
+         emit_function (functions++, statements);
+      }
+      line (0, "int main () {");
+      line (1, structname (0) + " p = new " + structname (0) + ";");
+      line (1, "p.data = new int[4];");
+      line (1, "p.link = new " + structname (1 % opts.structs) + ";");
+      line (1, "return fn" + to_string (functions - 1) + " (0, p);");
+      line (0, "}");
+   }
+};
+
+void usage (const char* execname) {
+   fprintf (stderr, "Usage: %s [-l lines] [-f functions] [-d depth]"
+            " [-s structs] [-S strings%%] [-n nesting] [-r seed]"
+            " [outfile]\n", execname);
+   exit (EXIT_FAILURE);
+}
+
+int main (int argc, char** argv) {
+   gen_options opts;
+   for (;;) {
+      int opt = getopt (argc, argv, "l:f:d:s:S:n:r:");
+      if (opt == EOF) break;
+      switch (opt) {
+         case 'l': opts.lines = strtoul (optarg, nullptr, 10); break;
+         case 'f': opts.functions = strtoul (optarg, nullptr, 10); break;
+         case 'd': opts.depth = strtoul (optarg, nullptr, 10); break;
+         case 's': opts.structs = strtoul (optarg, nullptr, 10); break;
+         case 'S': opts.strings = strtoul (optarg, nullptr, 10); break;
+         case 'n': opts.nesting = strtoul (optarg, nullptr, 10); break;
+         case 'r': opts.seed = strtoul (optarg, nullptr, 10); break;
+         default:  usage (argv[0]);
+      }
+   }
+   if (optind + 1 < argc) usage (argv[0]);
+
+   FILE* out = stdout;
+   if (optind < argc) {
+      out = fopen (argv[optind], "w");
+      if (out == nullptr) {
+         perror (argv[optind]);
+         return EXIT_FAILURE;
+      }
+   }
+   generator gen (opts, out);
+   gen.generate();
+   if (out != stdout) fclose (out);
+   return EXIT_SUCCESS;
+}
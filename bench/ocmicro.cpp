@@ -0,0 +1,451 @@
+// ocmicro.cpp
+// Microbenchmarks for oc's hot primitives: string_set::intern,
+// astree construction and adopt, typeCheck per node kind, emit_expr
+// and astree::dump_tree.  Each benchmark runs warmup repetitions,
+// then timed repetitions, and reports the median, p95 and median
+// absolute deviation of the time per operation.  Results can be
+// saved and later compared against as a baseline.
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "astree.h"
+#include "lyutils.h"
+#include "string_set.h"
+
+using namespace std;
+
+// Globals normally defined by main.cpp.
+FILE* tokenFile;
+FILE* symfile;
+FILE* oilfile;
+
+// Checker and emitter internals.
+extern symbol_table global_symbol_table;
+extern symbol_table local_symbol_table;
+extern symbol_table type_symbol_table;
+extern bool in_function;
+attr typeCheck (astree* node);
+bool emit_expr (astree* node, string& toPrint);
+
+struct micro_options {
+   size_t warmup = 3;
+   size_t reps = 15;
+   size_t size = 10000;
+   string filter;
+   string savefile;
+   string baselinefile;
+};
+
+struct summary {
+   double median = 0;
+   double p95 = 0;
+   double mad = 0;
+};
+
+micro_options opts;
+map<string, summary> results;
+
+double now() {
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double percentile (vector<double> samples, double fraction) {
+   sort (samples.begin(), samples.end());
+   size_t index = static_cast<size_t> (ceil (fraction * samples.size()));
+   if (index > 0) --index;
+   return samples[min (index, samples.size() - 1)];
+}
+
+summary summarize (const vector<double>& samples) {
+   summary sum;
+   sum.median = percentile (samples, 0.5);
+   sum.p95 = percentile (samples, 0.95);
+   vector<double> deviations;
+   for (double sample: samples) {
+      deviations.push_back (fabs (sample - sum.median));
+   }
+   sum.mad = percentile (deviations, 0.5);
+   return sum;
+}
+
+// Runs setup (untimed), then body, which performs ops operations.
+// Records nanoseconds per operation for each timed repetition.
+void bench (const string& name, size_t ops,
+            const function<void()>& setup,
+            const function<void()>& body,
+            const function<void()>& teardown = []{}) {
+   if (not opts.filter.empty()
+       and name.find (opts.filter) == string::npos) return;
+   vector<double> samples;
+   for (size_t rep = 0; rep < opts.warmup + opts.reps; ++rep) {
+      setup();
+      double start = now();
+      body();
+      double elapsed = now() - start;
+      teardown();
+      if (rep >= opts.warmup) samples.push_back (elapsed * 1e9 / ops);
+   }
+   summary sum = summarize (samples);
+   results[name] = sum;
+   printf ("%-28s %12.1f %12.1f %10.1f  ns/op\n", name.c_str(),
+           sum.median, sum.p95, sum.mad);
+   fflush (stdout);
+}
+
+/***************** string_set::intern ******************/
+
+vector<string> make_words (size_t count, const string& prefix) {
+   vector<string> words;
+   for (size_t i = 0; i < count; ++i) {
+      words.push_back (prefix + to_string (i * 2654435761u % 1000003));
+   }
+   return words;
+}
+
+void bench_intern() {
+   vector<string> words = make_words (opts.size, "ident_");
+   for (const string& word: words) string_set::intern (word.c_str());
+
+   bench ("intern_hit", words.size(), []{}, [&]{
+      for (const string& word: words) string_set::intern (word.c_str());
+   });
+
+   size_t round = 0;
+   vector<string> fresh;
+   bench ("intern_miss", words.size(), [&]{
+      fresh = make_words (opts.size, "miss" + to_string (round++) + "_");
+   }, [&]{
+      for (const string& word: fresh) string_set::intern (word.c_str());
+   });
+
+   // half hits, half misses
+   bench ("intern_mixed", words.size(), [&]{
+      fresh = make_words (opts.size / 2, "mix" + to_string (round++) + "_");
+   }, [&]{
+      for (size_t i = 0; i < fresh.size(); ++i) {
+         string_set::intern (fresh[i].c_str());
+         string_set::intern (words[i].c_str());
+      }
+   });
+}
+
+/***************** astree construction ******************/
+
+void bench_adopt() {
+   location lloc {0, 1, 0, 0};
+   astree* root = nullptr;
+
+   bench ("astree_new", opts.size, []{}, [&]{
+      root = new astree (TOK_BLOCK, lloc, "{");
+      for (size_t i = 0; i < opts.size; ++i) {
+         root->adopt (new astree (TOK_IDENT, lloc, "x"));
+      }
+   }, [&]{ delete root; });
+
+   // binary expression trees: three nodes adopted per operation
+   vector<astree*> leaves;
+   bench ("astree_adopt_binop", opts.size, [&]{
+      leaves.clear();
+      for (size_t i = 0; i < 2 * opts.size; ++i) {
+         leaves.push_back (new astree (TOK_INTCON, lloc, "1"));
+      }
+      root = new astree (TOK_BLOCK, lloc, "{");
+   }, [&]{
+      for (size_t i = 0; i < opts.size; ++i) {
+         astree* op = new astree ('+', lloc, "+");
+         root->adopt (op->adopt (leaves[2 * i], leaves[2 * i + 1]));
+      }
+   }, [&]{ delete root; });
+
+   bench ("astree_delete", opts.size, [&]{
+      root = new astree (TOK_BLOCK, lloc, "{");
+      for (size_t i = 0; i < opts.size; ++i) {
+         root->adopt (new astree (TOK_IDENT, lloc, "x"));
+      }
+   }, [&]{ delete root; });
+}
+
+/***************** typeCheck ******************/
+
+// A program whose functions use every kind of expression node.
+string make_program (size_t functions) {
+   string text = "struct node {\n   int value;\n   node link;\n"
+                 "   int[] data;\n}\nint total = 0;\n";
+   for (size_t fn = 0; fn < functions; ++fn) {
+      string name = "f" + to_string (fn);
+      text += "int " + name + " (int a, node n, int[] v) {\n"
+              "   int b = a + 1;\n"
+              "   string s = \"text\";\n"
+              "   while (b < a * 2) {\n"
+              "      n.value = n.link.value + v[b] - a;\n"
+              "      if (b == 3) total = total + b;\n"
+              "      b = b + 1;\n"
+              "   }\n";
+      if (fn > 0) {
+         text += "   b = f" + to_string (fn - 1) + " (b, n.link, v);\n";
+      }
+      text += "   return b;\n}\n";
+   }
+   return text;
+}
+
+astree* parse_program (const string& text) {
+   char filename[] = "/tmp/ocmicroXXXXXX";
+   int fd = mkstemp (filename);
+   if (fd < 0 or write (fd, text.data(), text.size())
+                  != static_cast<ssize_t> (text.size())) {
+      perror (filename);
+      exit (EXIT_FAILURE);
+   }
+   close (fd);
+   yyin = fopen (filename, "r");
+   lexer::lloc = {0, 1, 0, 0};
+   lexer::newfilename (filename);
+   int parse_rc = yyparse();
+   fclose (yyin);
+   yylex_destroy();
+   unlink (filename);
+   if (parse_rc != 0) {
+      fprintf (stderr, "ocmicro: parse failed\n");
+      exit (EXIT_FAILURE);
+   }
+   return parser::root;
+}
+
+void reset_checker() {
+   global_symbol_table.clear();
+   local_symbol_table.clear();
+   type_symbol_table.clear();
+}
+
+void collect (astree* node, map<int, vector<astree*>>& kinds) {
+   kinds[node->tokenCode].push_back (node);
+   for (astree* child: node->children) collect (child, kinds);
+}
+
+size_t count_nodes (astree* node) {
+   size_t count = 1;
+   for (astree* child: node->children) count += count_nodes (child);
+   return count;
+}
+
+void bench_typecheck() {
+   string text = make_program (opts.size / 50 + 1);
+   astree* root = parse_program (text);
+   size_t nodes = count_nodes (root);
+   delete root;
+
+   bench ("type_check_full", nodes, [&]{
+      root = parse_program (text);
+   }, [&]{
+      type_check (root);
+   }, [&]{
+      reset_checker();
+      delete root;
+   });
+
+   // per node kind, on a checked tree with the global tables live,
+   // as if inside a function body
+   root = parse_program (text);
+   type_check (root);
+   map<int, vector<astree*>> kinds;
+   collect (root, kinds);
+   in_function = true;
+   for (int kind: vector<int> {TOK_IDENT, '.', '[', TOK_CALL, '+',
+                               TOK_INTCON}) {
+      vector<astree*>& nodes_of_kind = kinds[kind];
+      if (nodes_of_kind.empty()) continue;
+      const char* tname = parser::get_tname (kind);
+      bench (string ("typecheck_") + tname, nodes_of_kind.size(), []{},
+             [&]{
+         for (astree* node: nodes_of_kind) typeCheck (node);
+      });
+   }
+   in_function = false;
+   reset_checker();
+   delete root;
+}
+
+/***************** emit_expr ******************/
+
+astree* leaf (int kind, const char* text) {
+   return new astree (kind, {0, 1, 0, 0}, text);
+}
+
+astree* binop (astree* left, astree* right) {
+   return leaf ('+', "+")->adopt (left, right);
+}
+
+astree* left_chain (size_t length) {
+   astree* tree = leaf (TOK_IDENT, "x");
+   for (size_t i = 0; i < length; ++i) {
+      tree = binop (tree, leaf (TOK_INTCON, "1"));
+   }
+   return tree;
+}
+
+astree* balanced (size_t depth) {
+   if (depth == 0) return leaf (TOK_IDENT, "x");
+   return binop (balanced (depth - 1), balanced (depth - 1));
+}
+
+astree* field_chain (size_t length) {
+   astree* tree = leaf (TOK_IDENT, "p");
+   for (size_t i = 0; i < length; ++i) {
+      tree = leaf ('.', ".")->adopt (tree, leaf (TOK_FIELD, "link"));
+   }
+   return tree;
+}
+
+astree* wide_call (size_t args) {
+   astree* call = leaf (TOK_CALL, "(")->adopt (leaf (TOK_IDENT, "f"));
+   for (size_t i = 0; i < args; ++i) {
+      call->adopt (leaf ('[', "[")->adopt (leaf (TOK_IDENT, "a"),
+                                           leaf (TOK_INTCON, "0")));
+   }
+   return call;
+}
+
+void bench_emit() {
+   struct shape {
+      const char* name;
+      astree* tree;
+   };
+   vector<shape> shapes {
+      {"emit_left_chain_64", left_chain (64)},
+      {"emit_balanced_d6", balanced (6)},
+      {"emit_field_chain_16", field_chain (16)},
+      {"emit_call_32_args", wide_call (32)},
+   };
+   size_t batch = max<size_t> (opts.size / 100, 1);
+   for (shape& sh: shapes) {
+      size_t nodes = count_nodes (sh.tree);
+      bench (sh.name, batch * nodes, []{}, [&]{
+         for (size_t i = 0; i < batch; ++i) {
+            string text;
+            emit_expr (sh.tree, text);
+         }
+      });
+      delete sh.tree;
+   }
+}
+
+/***************** dump_tree ******************/
+
+void bench_dump() {
+   string text = make_program (opts.size / 50 + 1);
+   astree* root = parse_program (text);
+   size_t nodes = count_nodes (root);
+   FILE* devnull = fopen ("/dev/null", "w");
+   bench ("dump_tree", nodes, []{}, [&]{ root->dump_tree (devnull); });
+   fclose (devnull);
+   delete root;
+}
+
+/***************** baseline ******************/
+
+void save_results (const string& filename) {
+   FILE* file = fopen (filename.c_str(), "w");
+   if (file == nullptr) {
+      perror (filename.c_str());
+      return;
+   }
+   for (auto& result: results) {
+      fprintf (file, "%s %.3f %.3f %.3f\n", result.first.c_str(),
+               result.second.median, result.second.p95,
+               result.second.mad);
+   }
+   fclose (file);
+}
+
+// Compares medians; a change is flagged when it exceeds both 5%
+// and three times the larger MAD.
+int compare_baseline (const string& filename) {
+   FILE* file = fopen (filename.c_str(), "r");
+   if (file == nullptr) {
+      perror (filename.c_str());
+      return EXIT_FAILURE;
+   }
+   printf ("\n%-28s %12s %12s %8s\n", "baseline comparison",
+           "baseline", "current", "change");
+   char name[128];
+   summary base;
+   int regressions = 0;
+   while (fscanf (file, "%127s %lf %lf %lf", name, &base.median,
+                  &base.p95, &base.mad) == 4) {
+      auto found = results.find (name);
+      if (found == results.end()) continue;
+      const summary& cur = found->second;
+      double change = (cur.median - base.median) / base.median * 100;
+      double noise = 3 * max (cur.mad, base.mad);
+      bool significant = fabs (change) > 5
+                     and fabs (cur.median - base.median) > noise;
+      const char* verdict = not significant ? ""
+                          : change > 0 ? "  slower" : "  faster";
+      if (significant and change > 0) ++regressions;
+      printf ("%-28s %12.1f %12.1f %+7.1f%%%s\n", name, base.median,
+              cur.median, change, verdict);
+   }
+   fclose (file);
+   return regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void usage (const char* execname) {
+   fprintf (stderr, "Usage: %s [-w warmup] [-r reps] [-n size]"
+            " [-f filter] [-s savefile] [-b baselinefile]\n", execname);
+   exit (EXIT_FAILURE);
+}
+
+int main (int argc, char** argv) {
+   exec::execname = "ocmicro";
+   for (;;) {
+      int opt = getopt (argc, argv, "w:r:n:f:s:b:");
+      if (opt == EOF) break;
+      switch (opt) {
+         case 'w': opts.warmup = strtoul (optarg, nullptr, 10); break;
+         case 'r': opts.reps = strtoul (optarg, nullptr, 10);   break;
+         case 'n': opts.size = strtoul (optarg, nullptr, 10);   break;
+         case 'f': opts.filter = optarg;                        break;
+         case 's': opts.savefile = optarg;                      break;
+         case 'b': opts.baselinefile = optarg;                  break;
+         default:  usage (argv[0]);
+      }
+   }
+   if (opts.reps == 0 or opts.size == 0) usage (argv[0]);
+
+   tokenFile = fopen ("/dev/null", "w");
+   symfile = fopen ("/dev/null", "w");
+   oilfile = fopen ("/dev/null", "w");
+   yydebug = 0;
+   yy_flex_debug = 0;
+
+   printf ("%-28s %12s %12s %10s\n", "benchmark", "median", "p95",
+           "mad");
+   bench_intern();
+   bench_adopt();
+   bench_typecheck();
+   bench_emit();
+   bench_dump();
+
+   int status = EXIT_SUCCESS;
+   if (not opts.savefile.empty()) save_results (opts.savefile);
+   if (not opts.baselinefile.empty()) {
+      status = compare_baseline (opts.baselinefile);
+   }
+   fclose (tokenFile);
+   fclose (symfile);
+   fclose (oilfile);
+   return status;
+}
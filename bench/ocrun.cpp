@@ -0,0 +1,308 @@
+// ocrun.cpp
+// Generated-code benchmark.  Compiles each oc program through the
+// oil with oc and cc, links it with the oclib.c runtime, runs it,
+// checks its output against NAME.golden next to the source (the
+// text itself, or a digest of it for large outputs), and
+// appends one CSV row with run time and instructions retired.
+//
+// A program's scaled-up input is given by a comment on its first
+// line, passed to oc as cpp definitions:
+//    // bench: -DSIZE=5000000
+//
+// A program that imports modules, #include "modules/NAME.oi", is
+// built with them by oc --build, the modules' sources being next to
+// its own, and linked with their oil.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+struct run_options {
+   string oc = "./oc";
+   string runtime = "oclib.c";
+   // -fopenmp-simd honors the pragmas of -fsimd without OpenMP
+   string cc = "cc -O2 -std=gnu11 -fopenmp-simd";
+   string ocflags;
+   string workdir = "bench/work";
+   string csvfile = "bench/runtime.csv";
+   size_t reps = 3;
+};
+
+struct run_result {
+   int status = 0;
+   double wall = 0;
+   long long instructions = -1;
+   long maxrss_kb = 0;
+};
+
+double now() {
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int shell (const string& command) {
+   int status = system (command.c_str());
+   if (status == -1) return 127;
+   return WIFEXITED (status) ? WEXITSTATUS (status) : 128;
+}
+
+// Counts user-mode instructions retired by pid and its children,
+// starting when it calls exec.  Returns -1 if perf is unavailable.
+int open_counter (pid_t pid) {
+   struct perf_event_attr attr;
+   memset (&attr, 0, sizeof attr);
+   attr.size = sizeof attr;
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+   attr.disabled = 1;
+   attr.enable_on_exec = 1;
+   attr.inherit = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   return syscall (SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+// Runs program with stdout to outfile.  The child waits on a pipe
+// until the counter is attached, so only its exec is measured.
+run_result run (const string& program, const string& outfile) {
+   int gate[2];
+   if (pipe (gate) < 0) {
+      perror ("pipe");
+      exit (EXIT_FAILURE);
+   }
+   run_result result;
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror ("fork");
+      exit (EXIT_FAILURE);
+   }
+   if (pid == 0) {
+      close (gate[1]);
+      char go;
+      if (read (gate[0], &go, 1) != 1) _exit (127);
+      int out = open (outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                      0644);
+      if (out >= 0) dup2 (out, STDOUT_FILENO);
+      execl (program.c_str(), program.c_str(), nullptr);
+      perror (program.c_str());
+      _exit (127);
+   }
+   close (gate[0]);
+   int counter = open_counter (pid);
+   double start = now();
+   if (write (gate[1], "x", 1) != 1) perror ("write");
+   close (gate[1]);
+
+   struct rusage usage;
+   int status = 0;
+   while (wait4 (pid, &status, 0, &usage) < 0) {
+      if (errno != EINTR) {
+         perror ("wait4");
+         exit (EXIT_FAILURE);
+      }
+   }
+   result.wall = now() - start;
+   result.maxrss_kb = usage.ru_maxrss;
+   if (WIFEXITED (status)) result.status = WEXITSTATUS (status);
+   else if (WIFSIGNALED (status)) result.status = 128 + WTERMSIG (status);
+   if (counter >= 0) {
+      long long count = 0;
+      if (read (counter, &count, sizeof count) == sizeof count) {
+         result.instructions = count;
+      }
+      close (counter);
+   }
+   return result;
+}
+
+string read_file (const string& filename) {
+   FILE* file = fopen (filename.c_str(), "r");
+   if (file == nullptr) return "";
+   string text;
+   char buffer[4096];
+   size_t got;
+   while ((got = fread (buffer, 1, sizeof buffer, file)) > 0) {
+      text.append (buffer, got);
+   }
+   fclose (file);
+   return text;
+}
+
+// Output-heavy programs keep a digest as their golden file,
+// "fnv1a64 <hex> <bytes>", instead of the full text.
+string digest (const string& text) {
+   unsigned long long hash = 0xcbf29ce484222325ULL;
+   for (unsigned char c: text) {
+      hash ^= c;
+      hash *= 0x100000001b3ULL;
+   }
+   char buffer[64];
+   snprintf (buffer, sizeof buffer, "fnv1a64 %016llx %zu\n", hash,
+             text.size());
+   return buffer;
+}
+
+bool output_matches (const string& outfile, const string& golden) {
+   string expected = read_file (golden);
+   string output = read_file (outfile);
+   if (expected.compare (0, 8, "fnv1a64 ") == 0) {
+      return digest (output) == expected;
+   }
+   return output == expected;
+}
+
+// The cpp definitions from the "// bench:" comment.
+string bench_defines (const string& source) {
+   string text = read_file (source);
+   string tag = "// bench:";
+   if (text.compare (0, tag.size(), tag) != 0) return "";
+   size_t end = text.find ('\n');
+   return text.substr (tag.size(), end - tag.size());
+}
+
+// The modules source imports, as paths relative to it, less ".oi".
+vector<string> bench_imports (const string& source) {
+   vector<string> found;
+   string text = read_file (source);
+   for (size_t at = 0; at < text.size(); ) {
+      size_t end = text.find ('\n', at);
+      if (end == string::npos) end = text.size();
+      char name[4096];
+      if (sscanf (text.substr (at, end - at).c_str(),
+                  " # include \"%4095[^\"]\"", name) == 1) {
+         string import = name;
+         if (import.size() > 3
+             and import.compare (import.size() - 3, 3, ".oi") == 0) {
+            found.push_back (import.substr (0, import.size() - 3));
+         }
+      }
+      at = end + 1;
+   }
+   return found;
+}
+
+void usage (const char* execname) {
+   fprintf (stderr, "Usage: %s [-c oc] [-r runtime] [-C cc]"
+            " [-F ocflags] [-w workdir] [-o csvfile] [-n reps]"
+            " program.oc...\n", execname);
+   exit (EXIT_FAILURE);
+}
+
+int main (int argc, char** argv) {
+   run_options opts;
+   for (;;) {
+      int opt = getopt (argc, argv, "c:r:C:F:w:o:n:");
+      if (opt == EOF) break;
+      switch (opt) {
+         case 'c': opts.oc = optarg;       break;
+         case 'r': opts.runtime = optarg;  break;
+         case 'C': opts.cc = optarg;       break;
+         case 'F': opts.ocflags = optarg;  break;
+         case 'w': opts.workdir = optarg;  break;
+         case 'o': opts.csvfile = optarg;  break;
+         case 'n': opts.reps = strtoul (optarg, nullptr, 10); break;
+         default:  usage (argv[0]);
+      }
+   }
+   if (optind == argc or opts.reps == 0) usage (argv[0]);
+   mkdir (opts.workdir.c_str(), 0755);
+
+   // oclib.h lives with the runtime
+   string runtime_copy = opts.runtime;
+   string incdir = dirname (&runtime_copy[0]);
+
+   FILE* csv = fopen (opts.csvfile.c_str(), "w");
+   if (csv == nullptr) {
+      perror (opts.csvfile.c_str());
+      return EXIT_FAILURE;
+   }
+   fprintf (csv, "program,status,output_ok,wall_s,instructions,"
+            "maxrss_kb,oil_bytes\n");
+
+   int exit_status = EXIT_SUCCESS;
+   for (int argi = optind; argi < argc; ++argi) {
+      string source = argv[argi];
+      string source_copy = source;
+      string name = basename (&source_copy[0]);
+      name = name.substr (0, name.find_last_of ('.'));
+      string base = opts.workdir + "/" + name;
+      string golden = source.substr (0, source.find_last_of ('.'))
+                    + ".golden";
+
+      // oc writes its outputs next to its input
+      shell ("cp " + source + " " + base + ".oc");
+      size_t slash = source.find_last_of ('/');
+      string srcdir = slash == string::npos ? ""
+                    : source.substr (0, slash + 1);
+      string modules;
+      string oils = base + ".oil";
+      for (const auto& import: bench_imports (source)) {
+         string module = opts.workdir + "/" + import;
+         shell ("mkdir -p " + module.substr (0, module.find_last_of ('/'))
+                + " && cp " + srcdir + import + ".oc " + module + ".oc");
+         modules += " " + module + ".oc";
+         oils = module + ".oil " + oils;
+      }
+      string build = modules.empty() ? "" : " --build";
+      int status = shell (opts.oc + build + " " + opts.ocflags
+                          + bench_defines (source) + modules + " "
+                          + base + ".oc >/dev/null 2>" + base + ".ocerr");
+      if (status == 0) {
+         status = shell (opts.cc + " -I" + incdir + " -o " + base
+                         + " -x c " + oils + " -x none "
+                         + opts.runtime + " 2>" + base + ".ccerr");
+      }
+      if (status != 0) {
+         fprintf (stderr, "%s: %s failed to compile\n", argv[0],
+                  name.c_str());
+         fprintf (csv, "%s,%d,0,,,,\n", name.c_str(), status);
+         exit_status = EXIT_FAILURE;
+         continue;
+      }
+
+      vector<run_result> runs;
+      for (size_t rep = 0; rep < opts.reps; ++rep) {
+         runs.push_back (run (base, base + ".out"));
+      }
+      sort (runs.begin(), runs.end(),
+            [](const run_result& a, const run_result& b) {
+               return a.wall < b.wall; });
+      const run_result& median = runs[runs.size() / 2];
+      bool output_ok = output_matches (base + ".out", golden);
+      if (median.status != 0 or not output_ok) {
+         exit_status = EXIT_FAILURE;
+      }
+      size_t oil_bytes = read_file (base + ".oil").size();
+
+      // instructions are left empty where perf is not permitted
+      string instructions = median.instructions < 0 ? ""
+                          : to_string (median.instructions);
+      fprintf (csv, "%s,%d,%d,%.6f,%s,%ld,%zu\n", name.c_str(),
+               median.status, output_ok, median.wall,
+               instructions.c_str(), median.maxrss_kb, oil_bytes);
+      fflush (csv);
+      printf ("%-16s %s  %9.3f s  %15s instr  %8ld KB  %8zu oil bytes\n",
+              name.c_str(), output_ok ? "ok  " : "FAIL", median.wall,
+              instructions.empty() ? "n/a" : instructions.c_str(),
+              median.maxrss_kb, oil_bytes);
+      fflush (stdout);
+   }
+   fclose (csv);
+   return exit_status;
+}
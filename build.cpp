@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "auxlib.h"
+#include "build.h"
+#include "module.h"
+
+struct module {
+   string source;
+   string program;          // the source less its suffix
+   vector<size_t> users;    // the modules that include its interface
+   size_t waiting = 0;      // imports not yet built
+   bool failed = false;     // or an import of it failed
+   bool done = false;
+};
+
+static vector<module> modules;
+
+// The interfaces source includes, as paths from where oc runs.
+static vector<string> includes (const string& source) {
+   vector<string> found;
+   FILE* file = fopen (source.c_str(), "r");
+   if (file == nullptr) return found;
+   size_t slash = source.find_last_of ('/');
+   string dir = slash == string::npos ? "" : source.substr (0, slash + 1);
+   char line[4096];
+   while (fgets (line, sizeof line, file) != nullptr) {
+      char name[4096];
+      if (sscanf (line, " # include \"%4095[^\"]\"", name) != 1) continue;
+      size_t length = strlen (name);
+      if (length < 3 or strcmp (name + length - 3, ".oi") != 0) continue;
+      found.push_back (name[0] == '/' ? name : dir + name);
+   }
+   fclose (file);
+   return found;
+}
+
+// Links each module to the modules whose interfaces it includes.
+static void link_imports() {
+   unordered_map<string, size_t> interfaces;
+   for (size_t index = 0; index < modules.size(); ++index) {
+      interfaces[modules[index].program + ".oi"] = index;
+   }
+   for (size_t index = 0; index < modules.size(); ++index) {
+      for (auto& import: includes (modules[index].source)) {
+         if (import.compare (0, 2, "./") == 0) import = import.substr (2);
+         auto found = interfaces.find (import);
+         if (found == interfaces.end() or found->second == index) continue;
+         modules[found->second].users.push_back (index);
+         ++modules[index].waiting;
+      }
+   }
+}
+
+static pid_t start (const char* oc, const module& mod,
+                    const vector<string>& flags) {
+   vector<const char*> argv {oc};
+   string command = oc;
+   for (auto& flag: flags) {
+      argv.push_back (flag.c_str());
+      command += " " + flag;
+   }
+   argv.push_back ("--module");
+   argv.push_back (mod.source.c_str());
+   argv.push_back (nullptr);
+   fprintf (stderr, "%s --module %s\n", command.c_str(),
+            mod.source.c_str());
+
+   pid_t pid = fork();
+   if (pid == 0) {
+      execvp (oc, const_cast<char* const*> (argv.data()));
+      syserrprintf (oc);
+      _exit (EXIT_FAILURE);
+   }
+   if (pid < 0) syserrprintf ("fork");
+   return pid;
+}
+
+// Marks the module built, or not, and readies the modules waiting
+// on it.
+static void finish (size_t index, bool built, vector<size_t>& ready) {
+   module& mod = modules[index];
+   mod.done = true;
+   mod.failed = not built;
+   for (auto user: mod.users) {
+      modules[user].failed = modules[user].failed or not built;
+      if (--modules[user].waiting == 0) ready.push_back (user);
+   }
+}
+
+int build_modules (const char* oc, const vector<string>& sources,
+                   const vector<string>& flags, int jobs) {
+   for (auto& source: sources) {
+      module mod;
+      mod.source = source;
+      mod.program = source.substr (0, source.find_last_of ('.'));
+      modules.push_back (mod);
+   }
+   link_imports();
+
+   string flag_text;
+   for (auto& flag: flags) {
+      flag_text += (flag_text.empty() ? "" : " ") + flag;
+   }
+   if (jobs < 1) jobs = sysconf (_SC_NPROCESSORS_ONLN);
+   if (jobs < 1) jobs = 1;
+
+   vector<size_t> ready;
+   for (size_t index = 0; index < modules.size(); ++index) {
+      if (modules[index].waiting == 0) ready.push_back (index);
+   }
+   unordered_map<pid_t, size_t> running;
+   for (;;) {
+      while (not ready.empty()
+             and running.size() < static_cast<size_t> (jobs)) {
+         size_t index = ready.back();
+         ready.pop_back();
+         module& mod = modules[index];
+         if (mod.failed) {
+            errprintf ("%s: not built, an import failed\n",
+                       mod.source.c_str());
+            finish (index, false, ready);
+         }else if (module_current (mod.program, flag_text)) {
+            finish (index, true, ready);
+         }else {
+            pid_t pid = start (oc, mod, flags);
+            if (pid < 0) finish (index, false, ready);
+            else running[pid] = index;
+         }
+      }
+      if (running.empty()) break;
+      int status;
+      pid_t pid = wait (&status);
+      if (pid < 0) {
+         syserrprintf ("wait");
+         break;
+      }
+      auto child = running.find (pid);
+      if (child == running.end()) continue;
+      size_t index = child->second;
+      running.erase (child);
+      bool built = WIFEXITED (status) and WEXITSTATUS (status) == 0;
+      if (not built) exec::exit_status = EXIT_FAILURE;
+      finish (index, built, ready);
+   }
+
+   for (auto& mod: modules) {
+      if (not mod.done) {
+         errprintf ("%s: not built, its imports form a cycle\n",
+                    mod.source.c_str());
+      }
+   }
+   return exec::exit_status;
+}
@@ -0,0 +1,15 @@
+#ifndef __BUILD_H__
+#define __BUILD_H__
+
+#include <string>
+#include <vector>
+using namespace std;
+
+int build_modules (const char* oc, const vector<string>& sources,
+                   const vector<string>& flags, int jobs);
+// oc --build: compiles each of sources as a module (oc --module with
+// flags) unless its manifest says it is current.  A module waits for
+// the modules whose interfaces it includes, and up to jobs compiles
+// run at once.  Returns the exit status for oc.
+
+#endif
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <unordered_set>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "cse.h"
+#include "opt.h"
+
+static size_t cse_counter = 0;
+static size_t values_kept = 0;
+
+// Where an expression sits: parent->children[index].
+struct slot {
+    astree* parent;
+    size_t index;
+};
+
+// A value, the statement computing it first and its later uses.
+struct value {
+    astree* stmt;
+    astree* holder;        // the block or statement holding stmt
+    slot first;
+    vector<slot> uses;
+};
+
+// What the walk of one function has numbered so far.
+struct numbering {
+    vector<value> values;
+    vector<size_t> available;  // computed on every path to here
+};
+
+// A candidate in a statement, and the nodes it is an operand of.
+struct occurrence {
+    slot at;
+    vector<astree*> path;
+};
+
+/********************* helpers **********************/
+
+static astree* at(const slot& where){
+    return where.parent->children[where.index];
+}
+
+static size_t tree_size(astree* node){
+    size_t size = 1;
+    for(auto child : node->children)
+        size += tree_size(child);
+    return size;
+}
+
+// Loads and the dearer arithmetic are worth a temporary; a sum of
+// locals is not.
+static bool worth_keeping(astree* node){
+    switch(node->tokenCode){
+    case '.':
+    case '[':
+    case '*':
+    case '/':
+    case '%':
+        return true;
+    }
+    for(auto child : node->children){
+        if(worth_keeping(child))
+            return true;
+    }
+    return false;
+}
+
+static bool candidate(astree* node){
+    switch(node->tokenCode){
+    case '.':
+    case '[':
+    case '+': case '-': case '*': case '/': case '%':
+    case TOK_EQ: case TOK_NE: case TOK_LT:
+    case TOK_LE: case TOK_GT: case TOK_GE:
+    case TOK_NEG: case TOK_POS: case TOK_NOT:
+        return worth_keeping(node) && pure(node);
+    default:
+        return false;
+    }
+}
+
+// Whether a store among by may change what expr computes.
+static bool overwritten(astree* expr, const effects& by){
+    switch(expr->tokenCode){
+    case TOK_IDENT:
+        if(expr->symbl.decl == nullptr || var_stored(expr->symbl.decl, by))
+            return true;
+        break;
+    case '.':
+        if(expr->symbl.decl == nullptr
+        || field_stored(expr->symbl.decl, by))
+            return true;
+        break;
+    case '[':
+        if(loads_stored(expr, by))
+            return true;
+        break;
+    }
+    for(auto child : expr->children){
+        if(overwritten(child, by))
+            return true;
+    }
+    return false;
+}
+
+static void forget(numbering& state, const effects& by){
+    vector<size_t> kept;
+    for(auto known : state.available){
+        if(!overwritten(at(state.values[known].first), by))
+            kept.push_back(known);
+    }
+    state.available = kept;
+}
+
+static void mark(astree* node, unordered_set<astree*>& touched){
+    touched.insert(node);
+    for(auto child : node->children)
+        mark(child, touched);
+}
+
+static bool overlaps(astree* node, const unordered_set<astree*>& touched){
+    if(touched.count(node))
+        return true;
+    for(auto child : node->children){
+        if(overlaps(child, touched))
+            return true;
+    }
+    return false;
+}
+
+/********************* numbering **********************/
+
+// The candidates under parent->children[index], innermost first, as
+// they are computed.  The target of a store is not loaded.
+static void collect(astree* parent, size_t index, bool target,
+                    vector<astree*>& path, vector<occurrence>& found){
+    astree* node = parent->children[index];
+    path.push_back(node);
+    for(size_t child = 0; child < node->children.size(); ++child){
+        collect(node, child, node->tokenCode == '=' && child == 0,
+                path, found);
+    }
+    path.pop_back();
+    if(!target && candidate(node))
+        found.push_back({{parent, index}, path});
+}
+
+// What may run ahead of an occurrence in its expression: every node
+// but those it is an operand of, which wait for it.
+static void run_ahead(astree* node, const unordered_set<astree*>& path,
+                      effects& into, bool& any){
+    if(!path.count(node)){
+        node_effects(node, into);
+        any = any || node->tokenCode == TOK_CALL || node->tokenCode == '='
+            || node->tokenCode == TOK_NEW || node->tokenCode == TOK_NEWSTR
+            || node->tokenCode == TOK_NEWARRAY
+            || node->tokenCode == TOK_NEWARRAY2;
+    }
+    for(auto child : node->children)
+        run_ahead(child, path, into, any);
+}
+
+// Numbers the candidates in the expression at parent->children[index]
+// of stmt, which sits in holder.  Each reuses an available value if
+// nothing ahead of it in the expression overwrites that.  Otherwise
+// it becomes a new value, computed ahead of stmt, if define allows
+// and nothing with an effect would run before it.
+static void number(astree* stmt, astree* holder, astree* parent,
+                   size_t index, bool define, numbering& state){
+    astree* root = parent->children[index];
+    vector<astree*> path;
+    vector<occurrence> found;
+    collect(parent, index, false, path, found);
+    for(auto& occ : found){
+        astree* node = at(occ.at);
+        if(node == stmt)
+            continue;
+        unordered_set<astree*> after(occ.path.begin(), occ.path.end());
+        effects ahead;
+        bool any = false;
+        run_ahead(root, after, ahead, any);
+        bool reused = false;
+        for(auto known : state.available){
+            value& prior = state.values[known];
+            if(same_expr(at(prior.first), node)
+            && !overwritten(node, ahead)){
+                prior.uses.push_back(occ.at);
+                reused = true;
+                break;
+            }
+        }
+        if(!reused && define && !any){
+            state.values.push_back({stmt, holder, occ.at, {}});
+            state.available.push_back(state.values.size() - 1);
+        }
+    }
+    effects all;
+    effects_of(root, all);
+    forget(state, all);
+}
+
+// Numbers the statement at holder->children[index].  Values computed
+// ahead of an if or a loop stay available after it unless one of its
+// paths overwrites them; those computed inside do not.
+static void walk(astree* holder, size_t index, numbering& state){
+    astree* stmt = holder->children[index];
+    switch(stmt->tokenCode){
+    case TOK_BLOCK:
+        for(size_t child = 0; child < stmt->children.size(); ++child)
+            walk(stmt, child, state);
+        return;
+    case TOK_IF: {
+        number(stmt, holder, stmt, 0, true, state);
+        vector<size_t> entry = state.available;
+        effects branches;
+        for(size_t branch = 1; branch < stmt->children.size(); ++branch){
+            state.available = entry;
+            walk(stmt, branch, state);
+            effects_of(stmt->children[branch], branches);
+        }
+        state.available = entry;
+        forget(state, branches);
+        return;
+    }
+    case TOK_WHILE: {
+        // the test runs again after the body, so nothing may be
+        // computed ahead of it, and only what the loop leaves alone
+        // is available in it
+        effects loop;
+        effects_of(stmt, loop);
+        forget(state, loop);
+        number(stmt, holder, stmt, 0, false, state);
+        vector<size_t> entry = state.available;
+        walk(stmt, 1, state);
+        state.available = entry;
+        return;
+    }
+    case TOK_VARDECL:
+        number(stmt, holder, stmt, 1, true, state);
+        return;
+    case TOK_RETURN:
+        if(!stmt->children.empty())
+            number(stmt, holder, stmt, 0, true, state);
+        return;
+    default:
+        number(stmt, holder, holder, index, true, state);
+        return;
+    }
+}
+
+/********************* keeping **********************/
+
+static astree* store(astree* temp, astree* value){
+    astree* node = new astree('=', value->lloc, "=");
+    return node->adopt(temp_use(temp, value->lloc), value);
+}
+
+// Computes v into a new temporary just ahead of its first statement
+// and replaces each of its occurrences by the temporary.
+static void keep(value& v, astree* body, const string& name,
+                 unordered_map<astree*, astree*>& holders){
+    astree* first = at(v.first);
+    string temp_name = "__cse" + to_string(++cse_counter);
+    astree*& holder = holders.emplace(v.stmt, v.holder).first->second;
+    if(holder->tokenCode != TOK_BLOCK){
+        astree* wrapper = new astree(TOK_BLOCK, v.stmt->lloc, "{");
+        auto place = find(holder->children.begin(), holder->children.end(),
+                          v.stmt);
+        *place = wrapper->adopt(v.stmt);
+        holder = wrapper;
+    }
+    auto& stmts = holder->children;
+    auto place = find(stmts.begin(), stmts.end(), v.stmt);
+    astree* temp;
+    if(v.stmt->tokenCode == TOK_VARDECL){
+        // among the declarations, the temporary is one more
+        temp = make_temp(temp_name, first);
+        stmts.insert(place, temp);
+    }
+    else{
+        temp = make_temp(temp_name, make_zero(first->symbl, first->lloc));
+        stmts.insert(place, store(temp, first));
+        body->children.insert(body->children.begin(), temp);
+    }
+    v.first.parent->children[v.first.index] = temp_use(temp, first->lloc);
+    for(auto& use : v.uses){
+        astree* node = at(use);
+        use.parent->children[use.index] = temp_use(temp, node->lloc);
+        delete node;
+    }
+    ++values_kept;
+    optprintf(first->lloc, "%s: value kept in %s for %zu more uses",
+              name.c_str(), temp_name.c_str(), v.uses.size());
+}
+
+// Numbers the function once and keeps the values used again.  Values
+// overlapping one kept already wait for the next round.
+static bool number_function(astree* function){
+    astree* body = function->children[2];
+    const string& name = *function->children[0]->children.back()->lexinfo;
+    numbering state;
+    for(size_t index = 0; index < body->children.size(); ++index)
+        walk(body, index, state);
+
+    vector<value*> reused;
+    for(auto& v : state.values){
+        if(!v.uses.empty())
+            reused.push_back(&v);
+    }
+    stable_sort(reused.begin(), reused.end(), [](value* a, value* b){
+        return tree_size(at(a->first)) > tree_size(at(b->first));
+    });
+    unordered_set<astree*> touched;
+    unordered_map<astree*, astree*> holders;
+    bool kept = false;
+    for(auto v : reused){
+        bool overlap = overlaps(at(v->first), touched);
+        for(auto& use : v->uses)
+            overlap = overlap || overlaps(at(use), touched);
+        if(overlap)
+            continue;
+        mark(at(v->first), touched);
+        for(auto& use : v->uses)
+            mark(at(use), touched);
+        keep(*v, body, name, holders);
+        kept = true;
+    }
+    return kept;
+}
+
+/********************* the pass *********************/
+
+void value_numbering(astree* root){
+    summarize_functions(root);
+    size_t before = values_kept;
+    for(auto function : root->children){
+        if(function->tokenCode != TOK_FUNCTION
+        || function->children.size() != 3) continue;
+        while(number_function(function))
+            continue;
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "cse: %zu values reused\n", values_kept - before);
+    }
+}
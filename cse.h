@@ -0,0 +1,12 @@
+#ifndef __CSE_H__
+#define __CSE_H__
+
+#include "astree.h"
+
+// Numbers the pure values each function computes, and computes a
+// value again only if something it loads may have been stored to
+// since.  A value computed on every path to a later use, and not
+// overwritten in between, is kept in a temporary for that use.
+void value_numbering (astree* root);
+
+#endif
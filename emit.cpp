@@ -1,38 +1,101 @@
+#include <unordered_map>
+#include <unordered_set>
+
 #include "lyutils.h"
 #include "astree.h"
+#include "module.h"
+#include "profile.h"
 
 #include "emit.h"
 
 extern FILE* oilfile;
+extern FILE* protofile;
+
+// A distinct string literal, as written, and the chars it holds.
+struct string_constant {
+    const string* text;
+    string oil_name;
+    size_t length;
+    size_t chars;        // up to the first NUL, what strlen says
+};
 
-vector<string> stringcon_queue;
-unordered_set<string> global_map;
-unordered_map<string, string> paramMap;
-unordered_map<string, string> localMap;
-unordered_map<string, string> typeMap;
-
-static size_t stringcon_queue_index = 1;
-static size_t branch_counter = 1;
+// the pool, in the order the literals were first seen
+static vector<string_constant> string_pool;
+static unordered_map<const string*, size_t> string_slots;
+static size_t strings_emitted = 0;
+
+bool oil_gc = false;
+string oil_profile;
+bool oil_sized_strings = false;
+bool oil_module = false;
+bool oil_stream = false;
+
+// --gc: whether the function being emitted links a root frame,
+// its return type, and the pointer globals main adds to its roots
+static bool gc_frame = false;
+static string gc_return_type;
+static vector<string> gc_global_roots;
+static unordered_set<string> gc_mapped_structs;
+static unordered_set<string> gc_allocating;
+static unordered_set<string> gc_defined;
+
+// structs the layout pass split, and the link to the cold part of
+// each field moved there
+static unordered_set<string> split_structs;
+static unordered_map<symbol*, string> cold_links;
+
+// --instrument: the sites counted, "kind key", by their index in
+// the oil's __oc_counts
+static unordered_map<string, size_t> site_index;
+static vector<string> sites;
+
+// statements inside ifs and loops are indented a level deeper
+static size_t nesting = 0;
+static bool line_start = true;
 
 void printOilFile(const string& str){
-    fprintf(oilfile,"%s",str.c_str());
+    if(nesting == 0){
+        fprintf(oilfile,"%s",str.c_str());
+        if(!str.empty())
+            line_start = str.back() == '\n';
+        return;
+    }
+    string indent(4 * nesting, ' ');
+    for(char c : str){
+        if(line_start && c != '\n')
+            fputs(indent.c_str(), oilfile);
+        fputc(c, oilfile);
+        line_start = c == '\n';
+    }
 }
 
 /***************** six types of decl ******************/
 
+// name of a declared symbol in the oil, as chosen by the checker
+string oil_name(astree* declid){
+    if(declid->symbl.oil_name.empty())
+        return *(declid->lexinfo);
+    return declid->symbl.oil_name;
+}
+
+bool is_pointer_type(const string& type){
+    return !type.empty() && type.back() == '*';
+}
+
 void emit_decl(astree* node, string& type, string& ident){
     if(!node) return;
 
     if(node->tokenCode == TOK_ARRAY){
         if(node->children.size() != 2) return;
 
-        ident = *(node->children[1]->lexinfo);
+        ident = oil_name(node->children[1]);
         if(node->children[0]->tokenCode == TOK_STRING){
             type = "char**";
         }
         else if(node->children[0]->tokenCode == TOK_TYPEID){
-            type = "struct " + *(node->children[0]->lexinfo) + "**";
-            typeMap[ident] = *(node->children[0]->lexinfo);
+            // a flattened array points at the structs themselves
+            type = "struct " + *(node->children[0]->lexinfo) 
+                + (node->children[1]->symbl.flat ? "*" : "**");
         }
         else{
             type = *(node->children[0]->lexinfo) + "*";
@@ -41,13 +104,12 @@ void emit_decl(astree* node, string& type, string& ident){
     else{
         if(node->children.size() != 1) return;
 
-        ident = *(node->children[0]->lexinfo);
+        ident = oil_name(node->children[0]);
         if(node->tokenCode == TOK_STRING){
             type = "char*";
         }
         else if(node->tokenCode == TOK_TYPEID){
             type = "struct " + *(node->lexinfo) + "*";
-            typeMap[ident] = *(node->lexinfo);
         }
         else{
             type = *(node->lexinfo);
@@ -57,29 +119,88 @@ void emit_decl(astree* node, string& type, string& ident){
 
 /***************** struct and fields ******************/
 
-void emit_field(astree* node, const string& structName){
+void emit_field(astree* node){
     if(!node) return;
 
+    // the field symbol carries its "structname_field" oil name
     string type, ident;
     emit_decl(node, type, ident);
     printOilFile("        " 
-    + type + " " + structName + "_" + ident + ";\n");
+    + type + " " + ident + ";\n");
 }
 
-void emit_struct(astree* node){
-    if(!node || node->children.size() != 2) return;
-
-    string structName = *(node->children[0]->lexinfo);
+string alloc_call(const string& count, const string& size,
+                  const string& map);
 
+// a struct and its pointer map; link, if not empty, is the pointer
+// to the cold part, ahead of the fields
+void emit_struct_fields(const string& structName, astree* fields,
+                        const string& link){
     printOilFile("struct ");
     printOilFile(structName);
     printOilFile(" {\n");
 
-    for (auto child : node->children[1]->children){
-        emit_field(child, structName);
+    vector<string> pointerFields;
+    if(!link.empty()){
+        printOilFile("        struct " + link + "* " + link + ";\n");
+        pointerFields.push_back(link);
+    }
+    for (auto child : fields->children){
+        emit_field(child);
+
+        string type, ident;
+        emit_decl(child, type, ident);
+        if(is_pointer_type(type))
+            pointerFields.push_back(ident);
     }
 
     printOilFile("};\n\n");
+
+    // the collector's pointer map: count, then field offsets
+    if(oil_gc && !pointerFields.empty()){
+        string map = "static const int __gcmap_" + structName
+            + "[] = {" + to_string(pointerFields.size());
+        for(auto& field : pointerFields){
+            map += ", offsetof (struct " + structName 
+                + ", " + field + ")";
+        }
+        printOilFile(map + "};\n\n");
+        gc_mapped_structs.insert(structName);
+    }
+}
+
+string gc_map(const string& structName){
+    return gc_mapped_structs.count(structName)
+        ? "__gcmap_" + structName : "0";
+}
+
+void emit_struct(astree* node){
+    if(!node || node->children.size() < 2) return;
+
+    string structName = *(node->children[0]->lexinfo);
+    if(node->children.size() == 2){
+        emit_struct_fields(structName, node->children[1], "");
+        return;
+    }
+
+    // split by the layout pass: the two parts are made together
+    string cold = structName + "__cold";
+    emit_struct_fields(structName, node->children[1], cold);
+    emit_struct_fields(cold, node->children[2], "");
+    for(auto field : node->children[2]->children){
+        astree* declid = field->tokenCode == TOK_ARRAY
+            ? field->children[1] : field->children[0];
+        cold_links[&declid->symbl] = cold;
+    }
+    split_structs.insert(structName);
+    printOilFile("static struct " + structName + "* __split_" + structName
+        + " (void) {\n"
+        "        struct " + structName + "* object = " + alloc_call("1",
+        "sizeof (struct " + structName + ")", gc_map(structName)) + ";\n"
+        "        object->" + cold + " = " + alloc_call("1",
+        "sizeof (struct " + cold + ")", gc_map(cold)) + ";\n"
+        "        return object;\n"
+        "}\n\n");
 }
 
 void emit_find_struct(astree* node){
@@ -94,11 +215,45 @@ void emit_find_struct(astree* node){
 
 /******************* string const *********************/
 
+// chars between the quotes, an escape counting one; chars stops
+// at a \0
+static size_t literal_length(const string& text, size_t& chars){
+    size_t length = 0;
+    chars = string::npos;
+    for(size_t i = 1; i + 1 < text.size(); ++i){
+        if(text[i] == '\\' && text[++i] == '0' && chars == string::npos)
+            chars = length;
+        ++length;
+    }
+    if(chars == string::npos)
+        chars = length;
+    return length;
+}
+
+const string& pool_string(const string* literal){
+    auto found = string_slots.emplace(literal, string_pool.size());
+    if(found.second){
+        string name = "s" + to_string(string_pool.size() + 1);
+        size_t chars;
+        size_t length = literal_length(*literal, chars);
+        string_pool.push_back({literal, name, length, chars});
+    }
+    return string_pool[found.first->second].oil_name;
+}
+
+// each literal once, an array of known length; oc strings are
+// char*, so uses cast the const away
 void emit_stringcon(){
-    size_t i = 1;
-    for(auto s : stringcon_queue){
-        printOilFile("char* s" + to_string(i++) + " = " 
-            + s + ";\n");
+    for(; strings_emitted < string_pool.size(); ++strings_emitted){
+        auto& constant = string_pool[strings_emitted];
+        string size = to_string(constant.length + 1);
+        if(oil_sized_strings)
+            printOilFile("OC_SIZED_STRING (" + constant.oil_name + ", "
+                + to_string(constant.chars) + ", " + size + ", "
+                + *constant.text + ");\n");
+        else
+            printOilFile("OC_STRING (" + constant.oil_name + ", "
+                + size + ", " + *constant.text + ");\n");
     }
     printOilFile("\n");
 }
@@ -118,6 +273,7 @@ unordered_map<int, string> tokenToString{
     {'-', "-"},
     {'*', "*"},
     {'/', "/"},
+    {'%', "%"},
     {'=', "="},
 
     {TOK_POS, "+"},
@@ -125,9 +281,56 @@ unordered_map<int, string> tokenToString{
     {TOK_NOT, "!"},
 };
 
+// Under --sized-strings, whether node stores to a char of a string,
+// which has to keep the string's length in step.
+bool stores_char(astree* node){
+    if(!oil_sized_strings || node->tokenCode != '='
+    || node->children.size() != 2)
+        return false;
+    astree* target = node->children[0];
+    if(target->tokenCode != '[' || target->children.size() != 2)
+        return false;
+    const attr_bitset& base = target->children[0]->symbl.attributes;
+    return base[static_cast<size_t>(attr::STRING)]
+        && !base[static_cast<size_t>(attr::ARRAY)];
+}
+
+// an element of an array the flatten pass stores as a block
+bool flat_element(astree* node){
+    if(node->tokenCode != '[' || node->children.size() != 2)
+        return false;
+    symbol* base = node->children[0]->symbl.decl;
+    return node->children[0]->tokenCode == TOK_IDENT && base != nullptr
+        && base->flat;
+}
+
 bool emit_binop(astree* node, string& toPrint){
     if(!node) return false;
 
+    // a new struct in a flattened array is the old one zeroed
+    if(node->tokenCode == '=' && node->children.size() == 2
+    && flat_element(node->children[0])){
+        astree* target = node->children[0];
+        string name, index;
+        emit_expr(target->children[0], name);
+        emit_expr(target->children[1], index);
+        toPrint += "__builtin_memset (&" + name + "[" + index + "], 0, "
+            "sizeof (struct " + *target->children[0]->symbl.decl->type_name
+            + ")) ";
+        return false;
+    }
+
+    if(stores_char(node)){
+        astree* target = node->children[0];
+        string name, index, value;
+        emit_expr(target->children[0], name);
+        emit_expr(target->children[1], index);
+        emit_expr(node->children[1], value);
+        toPrint += "oc_str_store (" + name + ", " + index + ", " 
+            + value + ") ";
+        return false;
+    }
+
     if(node->tokenCode == TOK_EQ
     ||node->tokenCode == TOK_NE
     ||node->tokenCode == TOK_LT
@@ -138,6 +341,7 @@ bool emit_binop(astree* node, string& toPrint){
     ||node->tokenCode == '-'
     ||node->tokenCode == '*'
     ||node->tokenCode == '/'
+    ||node->tokenCode == '%'
     ||node->tokenCode == '='
     ){
         if(node->children.size() != 2) return false;
@@ -188,43 +392,86 @@ void emit_unop(astree* node, string& toPrint){
     }
 }
 
+// with --gc, allocations carry the collector's pointer map:
+// "0" for no pointers, OC_GC_REFS for arrays of pointers
+string alloc_call(const string& count, const string& size,
+                  const string& map){
+    if(!oil_gc)
+        return "xcalloc (" + count + ", " + size + ") ";
+    return "oc_gc_alloc (" + count + ", " + size + ", " + map + ") ";
+}
+
 bool emit_alloc(astree* node, string& toPrint){
     if(!node) return false;
 
+    // kept on the stack by escape analysis, zeroed like xcalloc
+    const string& slot = node->symbl.stack_slot;
+    if(!slot.empty() && oil_sized_strings
+    && node->tokenCode == TOK_NEWSTR){
+        toPrint += "(__builtin_memset (&" + slot + ", 0, sizeof " + slot
+            + "), " + slot + ".head.capacity = sizeof " + slot 
+            + ".chars, " + slot + ".chars) ";
+        return true;
+    }
+    if(!slot.empty() && node->tokenCode == TOK_NEW
+    && split_structs.count(*node->children[0]->lexinfo)){
+        string cold = slot + "_cold";
+        toPrint += "(__builtin_memset (" + slot + ", 0, sizeof " + slot
+            + "), __builtin_memset (" + cold + ", 0, sizeof " + cold 
+            + "), " + slot + "->" + *node->children[0]->lexinfo 
+            + "__cold = " + cold + ", " + slot + ") ";
+        return true;
+    }
+    if(!slot.empty()){
+        toPrint += "(__builtin_memset (" + slot + ", 0, sizeof " 
+            + slot + "), " + slot + ") ";
+        return true;
+    }
+
     if(node->tokenCode == TOK_NEW){
         if(node->children.size() != 1) return false;
 
-        toPrint += "xcalloc (1, sizeof (struct " 
-            + *(node->children[0]->lexinfo) + ")) ";
+        string structName = *(node->children[0]->lexinfo);
+        if(split_structs.count(structName)){
+            toPrint += "__split_" + structName + " () ";
+            return false;
+        }
+        toPrint += alloc_call("1", "sizeof (struct " 
+            + structName + ")", gc_map(structName));
         return true;
     }
     else if(node->tokenCode == TOK_NEWSTR){
         if(node->children.size() != 1) return false;
 
-        toPrint += "xcalloc (" 
-            + *(node->children[0]->lexinfo) 
-            + ", sizeof (char)) ";
+        string size;
+        emit_expr(node->children[0], size);
+        if(oil_sized_strings)
+            toPrint += string(oil_gc ? "oc_gc_str_new" : "oc_str_new") 
+                + " (" + size + ") ";
+        else
+            toPrint += alloc_call(size, "sizeof (char)", "0");
         return true;
     }
     else if(node->tokenCode == TOK_NEWARRAY){
         if(node->children.size() != 2) return false;
 
         string basetype = *(node->children[0]->lexinfo);
+        string size;
+        emit_expr(node->children[1], size);
 
         if(basetype == "string"){
-            toPrint += "xcalloc (" 
-            + *(node->children[1]->lexinfo) 
-            + ", sizeof (char)) ";
+            toPrint += alloc_call(size, "sizeof (char*)", "OC_GC_REFS");
         }
         else if(basetype == "int"){
-            toPrint += "xcalloc (" 
-            + *(node->children[1]->lexinfo) 
-            + ", sizeof (int)) ";
+            toPrint += alloc_call(size, "sizeof (int)", "0");
+        }
+        else if(node->symbl.flat){
+            toPrint += alloc_call(size, "sizeof (struct " + basetype 
+                + ")", gc_map(basetype));
         }
         else{
-            toPrint += "xcalloc (" 
-            + *(node->children[1]->lexinfo) 
-            + ", sizeof (struct " + basetype + "*)) ";
+            toPrint += alloc_call(size, "sizeof (struct " 
+                + basetype + "*)", "OC_GC_REFS");
         }
         return true;
     }
@@ -232,11 +479,11 @@ bool emit_alloc(astree* node, string& toPrint){
         if(node->children.size() != 2) return false;
 
         string basetype = *(node->children[0]->lexinfo);
+        string size;
+        emit_expr(node->children[1], size);
 
         if(basetype == "string"){
-            toPrint += "xcalloc (" 
-            + *(node->children[1]->lexinfo) 
-            + ", sizeof (char*)) ";
+            toPrint += alloc_call(size, "sizeof (char*)", "OC_GC_REFS");
         }
         
         return true;
@@ -252,8 +499,11 @@ void emit_call(astree* node, string& toPrint){
         bool need_erase = false;
         for(auto child : node->children){
             if(first){
-                string funcName = *(child->lexinfo);
-                toPrint += "__" + funcName + " (";
+                // undeclared (library) functions keep the "__" prefix
+                symbol* decl = child->symbl.decl;
+                string funcName = decl != nullptr 
+                    ? decl->oil_name : "__" + *(child->lexinfo);
+                toPrint += funcName + " (";
                 first = false;
             }
             else{
@@ -269,51 +519,52 @@ void emit_call(astree* node, string& toPrint){
     }
 }
 
-void substituteVariable(string& va){
-    if(localMap.find(va) 
-        != localMap.end()){
-        va = localMap[va];
-    }
-    else if(paramMap.find(va) 
-        != paramMap.end()){
-        va = paramMap[va];
-    }
-    else if(global_map.find(va) 
-        != global_map.end()){
-        // do nothing?
-    }
-}
-
 void emit_variable(astree* node, string& toPrint){
     if(!node) return;
 
     if(node->tokenCode == TOK_IDENT){
-        string name = *(node->lexinfo);
-        substituteVariable(name);
-        toPrint += name + " ";
+        // bound to its declaration by the checker
+        symbol* decl = node->symbl.decl;
+        if(decl != nullptr)
+            toPrint += decl->oil_name + " ";
+        else
+            toPrint += *(node->lexinfo) + " ";
     }
     else if(node->tokenCode == '['){
         if(node->children.size() != 2) return;
 
-        string name = *(node->children[0]->lexinfo);
-        string field = *(node->children[1]->lexinfo);
-
-        substituteVariable(name);
-        substituteVariable(field);
+        string name, index;
+        if(emit_expr(node->children[0], name))
+            name = "( " + name + ") ";
+        emit_expr(node->children[1], index);
         
-        toPrint += name + "[" + field + "] ";
+        // as a value, the element of a flattened array is its address
+        if(flat_element(node))
+            toPrint += "&";
+        toPrint += name + "[" + index + "] ";
     }
     else if(node->tokenCode == '.'){
         if(node->children.size() != 2) return;
 
-        string name = *(node->children[0]->lexinfo);
-        string field = *(node->children[1]->lexinfo);
-
-        field = typeMap[name] + "_" + field;
-
-        substituteVariable(name);
+        string name;
+        string select = "->";
+        if(flat_element(node->children[0])){
+            emit_variable(node->children[0], name);
+            name = name.substr(1);
+            select = ".";
+        }
+        else if(emit_expr(node->children[0], name))
+            name = "( " + name + ") ";
+
+        // resolved by the checker through the struct's field table
+        symbol* field = node->symbl.decl;
+        string fieldName = field != nullptr
+            ? field->oil_name : *(node->children[1]->lexinfo);
+        auto cold = cold_links.find(field);
+        if(cold != cold_links.end())
+            fieldName = cold->second + "->" + fieldName;
  
-        toPrint += name + "->" + field + " ";
+        toPrint += name + select + fieldName + " ";
     }
 }
 
@@ -326,7 +577,8 @@ void emit_constant(astree* node, string& toPrint){
         toPrint += *(node->lexinfo) + " ";
     }
     else if(node->tokenCode == TOK_STRINGCON){
-        toPrint += "s" + to_string(stringcon_queue_index++) + " ";
+        toPrint += "(char*) " + node->symbl.oil_name 
+            + (oil_sized_strings ? ".chars " : " ");
     }
     else if(node->tokenCode == TOK_NULL){
         toPrint += "0 ";
@@ -344,6 +596,10 @@ bool emit_expr(astree* node, string& toPrint){
     emit_call(node, toPrint);
     emit_variable(node, toPrint);
     emit_constant(node, toPrint);
+    // the cast of a string constant binds looser than [, and so
+    // does the & of a flattened element
+    needParenthes |= node->tokenCode == TOK_STRINGCON
+        || flat_element(node);
 
     return needParenthes;
 }
@@ -352,71 +608,239 @@ bool emit_expr(astree* node, string& toPrint){
 
 void emit_statement(astree* node);
 
-/****************** while ifelse ********************/
+/********************* profile **********************/
+
+// Under --instrument, the increment counting a run of the site kind
+// at node, else empty.
+string count_site(const char* kind, astree* node){
+    if(oil_profile.empty()) return "";
+    string site = string(kind) + " " + profile_key(node->lloc);
+    auto found = site_index.emplace(site, sites.size());
+    if(found.second)
+        sites.push_back(site);
+    return "++__oc_counts[" + to_string(found.first->second) + "]";
+}
 
-void emit_while(astree* node){
-    if(!node || node->children.size() != 2) return;
+void emit_count(const char* kind, astree* node){
+    string count = count_site(kind, node);
+    if(!count.empty())
+        printOilFile("        " + count + ";\n");
+}
 
-    string loc = "_" + to_string(node->lloc.filenr) 
-    + "_" + to_string(node->lloc.linenr) 
-    + "_" + to_string(node->lloc.offset);
+// the test, with the way the profile saw it go given to cc
+string expect_test(const string& test, const char* taken,
+                   const char* other, astree* node){
+    int expect = profile_expect(taken, other, node->lloc);
+    if(expect < 0) return test;
+    return "__builtin_expect (( " + test + ") != 0, " 
+        + to_string(expect) + ")";
+}
 
-    string branchName = "b" + to_string(branch_counter++);
+// the counts and the names of their sites, handed to the runtime
+// before __main runs
+void emit_profile_table(){
+    if(oil_profile.empty() || sites.empty()) return;
 
-    printOilFile("while" + loc + ":;\n");
+    string file;
+    for(char c : oil_profile){
+        if(c == '"' || c == '\\')
+            file += '\\';
+        file += c;
+    }
+    string count = to_string(sites.size());
+    printOilFile("unsigned long __oc_counts[" + count + "];\n"
+        "static const char* const __oc_sites[] = {\n");
+    for(auto& site : sites)
+        printOilFile("        \"" + site + "\",\n");
+    printOilFile("};\n"
+        "static struct oc_profile __oc_profile = {\n"
+        "        \"" + file + "\", __oc_sites, __oc_counts, " 
+        + count + "};\n\n"
+        "__attribute__ ((constructor))\n"
+        "static void __oc_profile_init (void) {\n"
+        "        oc_profile_register (&__oc_profile);\n"
+        "}\n");
+}
 
-    string expr;
-    emit_expr(node->children[0], expr);
-    printOilFile("        char " + branchName + " = " + expr 
-        + ";\n        if (!" + branchName 
-        + ") goto break" + loc + ";\n");
+/****************** while ifelse ********************/
 
-    emit_statement(node->children[1]);
+// loop invariants declared ahead of the loop by licm
+void emit_hoisted(astree* block){
+    for(auto temp : block->children){
+        string type, ident, expr;
+        emit_decl(temp->children[0], type, ident);
+        emit_expr(temp->children[1], expr);
+        printOilFile("        " + type + " " + ident 
+            + " = " + expr + ";\n");
+    }
+}
 
-    printOilFile("        goto while" 
-        + loc + ";\nbreak" + loc + ":;\n");
+// a branch, a level deeper, its runs counted under --instrument
+void emit_branch(astree* node, const char* kind, astree* site){
+    ++nesting;
+    emit_count(kind, site);
+    if(node)
+        emit_statement(node);
+    --nesting;
 }
 
-void emit_ifelse(astree* node){
-    if(!node) return;
-    if(node->children.size() <= 0) return;
+void emit_loop_body(astree* node){
+    ++nesting;
+    emit_count("iterate", node);
+    emit_statement(node->children[1]);
+    // temporaries of earlier iterations are dead at the back edge
+    if(gc_frame)
+        printOilFile("        oc_gc_recent = __frame.mark;\n");
+    --nesting;
+}
 
-    string loc = "_" + to_string(node->lloc.filenr) 
-    + "_" + to_string(node->lloc.linenr) 
-    + "_" + to_string(node->lloc.offset);
-    string branchName = "b" + to_string(branch_counter++);
-    string expr;
+// whether anything under node stores to a char of a string
+bool stores_chars(astree* node){
+    if(stores_char(node))
+        return true;
+    for(auto child : node->children){
+        if(stores_chars(child))
+            return true;
+    }
+    return false;
+}
 
-    emit_expr(node->children[0], expr);
-    printOilFile("        char " + branchName 
-        + " = " + expr + ";\n");
+// A loop the simd pass found free of dependences between its
+// iterations, in the for form cc's vectorizer expects.  The counter
+// starts from the copy the pass declared last among the invariants,
+// and the step ending the body moves into the header.  Nothing in
+// the body allocates, so there are no gc temporaries to drop.
+void emit_simd_loop(astree* node, const string& test){
+    astree* body = node->children[1];
+    astree* step = body->children.back();
+    string type, start, counter, next;
+    emit_decl(node->children[2]->children.back()->children[0], type, start);
+    emit_expr(step->children[0], counter);
+    emit_expr(step, next);
+    printOilFile("        #pragma " + node->simd_pragma + "\n");
+    printOilFile("        for (" + counter + "= " + start + "; " + test
+        + "; " + next + ") {\n");
+    ++nesting;
+    for(size_t index = 0; index + 1 < body->children.size(); ++index)
+        emit_statement(body->children[index]);
+    --nesting;
+    printOilFile("        }\n");
+}
 
-    if(node->children.size() == 2){//no else
-        printOilFile("        if (!" 
-        + branchName + " ) goto fi" + loc + ";\n");
-        emit_statement(node->children[1]);
-        printOilFile("fi" + loc + ":;\n");
+void emit_while(astree* node){
+    if(!node || node->children.size() < 2) return;
+
+    // after licm, children[2] holds invariants safe to compute
+    // before the first test, children[3] those that may trap and
+    // wait until the first test has passed
+    bool guarded = node->children.size() == 4
+        && !node->children[3]->children.empty();
+    // lanes would lose each other's counts, or lengths
+    bool simd = !node->simd_pragma.empty() && oil_profile.empty()
+        && !stores_chars(node->children[1]);
+    if(node->children.size() >= 3)
+        emit_hoisted(node->children[2]);
+    emit_count("enter", node);
+
+    string test;
+    emit_expr(node->children[0], test);
+    string again = expect_test(test, "iterate", "enter", node);
+    if(guarded){
+        // the first test goes ahead of them, the rest at the bottom
+        printOilFile("        if (" + test + ") {\n");
+        ++nesting;
+        emit_hoisted(node->children[3]);
+        if(simd){
+            emit_simd_loop(node, test);
+        }
+        else{
+            printOilFile("        do {\n");
+            emit_loop_body(node);
+            printOilFile("        } while (" + again + ");\n");
+        }
+        --nesting;
+        printOilFile("        }\n");
+        return;
+    }
+    if(simd){
+        emit_simd_loop(node, test);
+        return;
     }
-    else if(node->children.size() == 3){//with else
-        printOilFile("        if (!" 
-        + branchName + " ) goto else" + loc + ";\n");
-        emit_statement(node->children[1]);
-        printOilFile("        goto fi" + loc + ":;\n");
-        printOilFile("else" + loc + ":;\n");
-        emit_statement(node->children[2]);
-        printOilFile("fi" + loc + ":;\n");
+    printOilFile("        while (" + again + ") {\n");
+    emit_loop_body(node);
+    printOilFile("        }\n");
+}
+
+void emit_ifelse(astree* node){
+    if(!node || node->children.size() < 2) return;
+
+    string test;
+    emit_expr(node->children[0], test);
+    printOilFile("        if (" + expect_test(test, "then", "else", node)
+        + ") {\n");
+    for(;;){
+        emit_branch(node->children[1], "then", node);
+        if(node->children.size() < 3){
+            // the runs that skip the branch are counted too
+            if(!oil_profile.empty()){
+                printOilFile("        } else {\n");
+                emit_branch(nullptr, "else", node);
+            }
+            break;
+        }
+
+        // else if chains stay at one level
+        astree* other = node->children[2];
+        if(other->tokenCode == TOK_BLOCK && other->children.size() == 1)
+            other = other->children[0];
+        if(other->tokenCode != TOK_IF || other->children.size() < 2){
+            printOilFile("        } else {\n");
+            emit_branch(node->children[2], "else", node);
+            break;
+        }
+        // with no statement between them, the else is counted
+        // in the test of the if it holds
+        string count = count_site("else", node);
+        node = other;
+        test.clear();
+        emit_expr(node->children[0], test);
+        test = expect_test(test, "then", "else", node);
+        if(!count.empty())
+            test = "(" + count + ", " + test + ")";
+        printOilFile("        } else if (" + test + ") {\n");
     }
+    printOilFile("        }\n");
 }
 
 void emit_return(astree* node){
     if(!node) return;
 
-    if(node->children.empty()){
+    if(gc_frame){
+        // unlink the frame only after the value is computed, and
+        // keep a returned pointer alive in the caller's temporaries
+        if(node->children.empty()){
+            printOilFile("        oc_gc_leave (&__frame);\n"
+                "        return ;\n");
+            return;
+        }
+        string expr;
+        emit_expr(node->children[0], expr);
+        string result = is_pointer_type(gc_return_type)
+            ? "oc_gc_keep (__result)" : "__result";
+        printOilFile("        {\n        " + gc_return_type 
+            + " __result = " + expr + ";\n"
+            + "        oc_gc_leave (&__frame);\n"
+            + "        return " + result + ";\n        }\n");
+    }
+    else if(node->children.empty()){
         printOilFile("        return ;\n");
     }
     else{
+        // a pointer may have been unlinked from the heap on the way
         string expr;
         emit_expr(node->children[0], expr);
+        if(oil_gc && is_pointer_type(gc_return_type))
+            expr = "oc_gc_keep (" + expr + ")";
         printOilFile("        return " + expr + ";\n");
     }
 }
@@ -448,40 +872,214 @@ void emit_statement(astree* node){
 
 /*************** func, param and block ****************/
 
-string get_blocknr(astree* node){
-    if(!node) return "";
-
-    if(node->tokenCode == TOK_ARRAY
-    || node->children.size() == 2)
-        return to_string(node->children[1]->lloc.blocknr);
-    else if(node->children.size() == 1)
-        return to_string(node->children[0]->lloc.blocknr);
-    return "";
-}
-
 void emit_local_decl(astree* node){
     if(!node || node->children.size() != 2) return;
 
     string type, ident, expr;
-    string newName;
     emit_decl(node->children[0], type, ident);
     emit_expr(node->children[1], expr);
 
-    if(type == "int") newName += 'i';
-    if(type.back() == '*') newName += 'p';
+    // pointer locals are declared up front, when the frame is made
+    if(gc_frame && is_pointer_type(type))
+        printOilFile("        " + ident + " = " + expr + ";\n");
+    else
+        printOilFile("        " + type + " " 
+        + ident + " = " + expr + ";\n");
+}
+
+/******************* gc root frames *********************/
+
+// true if a collection may happen while node runs: it allocates or
+// calls an oc function that might.  Library calls never do.
+bool may_collect(astree* node){
+    if(node->tokenCode == TOK_NEW
+    ||node->tokenCode == TOK_NEWSTR
+    ||node->tokenCode == TOK_NEWARRAY
+    ||node->tokenCode == TOK_NEWARRAY2)
+        return true;
+    if(node->tokenCode == TOK_CALL
+    &&!node->children.empty()
+    &&node->children[0]->symbl.decl != nullptr
+    &&gc_allocating.count(node->children[0]->symbl.decl->oil_name))
+        return true;
+    for(auto child : node->children){
+        if(may_collect(child))
+            return true;
+    }
+    return false;
+}
+
+// The functions that may allocate, directly or through calls,
+// iterated over the call graph until nothing changes.  One only
+// declared here, as another module's, is taken to allocate.
+void find_gc_allocating(astree* root){
+    unordered_set<string> defined;
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_FUNCTION && child->children.size() == 3)
+            defined.insert(oil_name(child->children[0]->children.back()));
+    }
+    for(auto child : root->children){
+        if(child->tokenCode != TOK_PROTO || child->children.empty())
+            continue;
+        string name = oil_name(child->children[0]->children.back());
+        if(!defined.count(name))
+            gc_allocating.insert(name);
+    }
+
+    bool changed = true;
+    while(changed){
+        changed = false;
+        for(auto child : root->children){
+            if(child->tokenCode != TOK_FUNCTION
+            ||child->children.size() != 3) continue;
+            string name = oil_name(child->children[0]->children.back());
+            if(gc_allocating.count(name)) continue;
+            if(may_collect(child->children[2])){
+                gc_allocating.insert(name);
+                changed = true;
+            }
+        }
+    }
+}
 
-    newName += ident;
+// --stream: what find_gc_allocating works out, a declaration at a
+// time.  A function only declared so far is taken to allocate, and
+// one calling itself to allocate if anything else in it does.
+void note_gc_allocating(astree* node){
+    if(node->children.empty() || node->children[0]->children.empty())
+        return;
+    string name = oil_name(node->children[0]->children.back());
+    if(node->tokenCode == TOK_PROTO){
+        if(!gc_defined.count(name))
+            gc_allocating.insert(name);
+        return;
+    }
+    if(node->children.size() != 3) return;
+    gc_defined.insert(name);
+    gc_allocating.erase(name);
+    if(may_collect(node->children[2]))
+        gc_allocating.insert(name);
+}
 
-    printOilFile("        " + type + " " 
-    + newName + " = " + expr + ";\n");
+// true if node may leave a collectable pointer in an expression
+// temporary: an allocation or a call returning one
+bool makes_gc_temps(astree* node){
+    if(node->tokenCode == TOK_NEW
+    ||node->tokenCode == TOK_NEWSTR
+    ||node->tokenCode == TOK_NEWARRAY
+    ||node->tokenCode == TOK_NEWARRAY2)
+        return true;
+    if(node->tokenCode == TOK_CALL){
+        const attr_bitset& attrs = node->symbl.attributes;
+        if(attrs[static_cast<size_t>(attr::ARRAY)]
+        ||attrs[static_cast<size_t>(attr::STRING)]
+        ||attrs[static_cast<size_t>(attr::STRUCT)])
+            return true;
+    }
+    for(auto child : node->children){
+        if(makes_gc_temps(child))
+            return true;
+    }
+    return false;
+}
 
-    localMap[ident] = newName;
+// The roots of a function are its pointer params and locals; main
+// also holds the pointer globals.  A function needs a frame only if
+// a collection may happen while it has pointers to show.
+vector<string> gc_function_roots(astree* node){
+    vector<string> roots;
+    string type, ident;
+    for(auto param : node->children[1]->children){
+        emit_decl(param, type, ident);
+        if(is_pointer_type(type))
+            roots.push_back(ident);
+    }
+    for(auto child : node->children[2]->children){
+        if(child->tokenCode != TOK_VARDECL) continue;
+        emit_decl(child->children[0], type, ident);
+        if(is_pointer_type(type))
+            roots.push_back(ident);
+    }
+    if(oil_name(node->children[0]->children.back()) == "__main"
+    && !oil_stream){
+        roots.insert(roots.end(), 
+            gc_global_roots.begin(), gc_global_roots.end());
+    }
+    astree* block = node->children[2];
+    gc_frame = oil_gc && may_collect(block)
+        && (!roots.empty() || makes_gc_temps(block));
+    return roots;
 }
 
-void emit_function_block(astree* node){
+void emit_gc_enter(astree* block, const vector<string>& roots){
+    string type, ident;
+    for(auto child : block->children){
+        if(child->tokenCode != TOK_VARDECL) continue;
+        emit_decl(child->children[0], type, ident);
+        if(is_pointer_type(type))
+            printOilFile("        " + type + " " + ident + " = 0;\n");
+    }
+
+    string rootArray = "0";
+    if(!roots.empty()){
+        string list;
+        for(auto& root : roots){
+            if(!list.empty())
+                list += ", ";
+            list += "(void**) &" + root;
+        }
+        printOilFile("        void** const __roots[] = {" 
+            + list + "};\n");
+        rootArray = "__roots";
+    }
+    printOilFile("        struct oc_gc_frame __frame;\n"
+        "        oc_gc_enter (&__frame, " + rootArray + ", " 
+        + to_string(roots.size()) + ");\n");
+}
+
+// declares the stack slots given to allocations under node
+void emit_stack_slots(astree* node){
+    for(auto child : node->children)
+        emit_stack_slots(child);
+
+    const string& slot = node->symbl.stack_slot;
+    if(slot.empty()) return;
+
+    string basetype = *(node->children[0]->lexinfo);
+    if(node->tokenCode == TOK_NEW){
+        printOilFile("        struct " + basetype + " " + slot 
+            + "[1];\n");
+        if(split_structs.count(basetype))
+            printOilFile("        struct " + basetype + "__cold " + slot
+                + "_cold[1];\n");
+    }
+    else if(node->tokenCode == TOK_NEWSTR){
+        string length = basetype;
+        if(oil_sized_strings)
+            printOilFile("        OC_STACK_STRING (" + slot + ", " 
+                + length + ");\n");
+        else
+            printOilFile("        char " + slot + "[" + length + "];\n");
+    }
+    else if(node->tokenCode == TOK_NEWARRAY){
+        string count = *(node->children[1]->lexinfo);
+        string type = basetype == "string" ? "char*"
+            : basetype == "int" ? "int" : "struct " + basetype 
+            + (node->symbl.flat ? "" : "*");
+        printOilFile("        " + type + " " + slot 
+            + "[" + count + "];\n");
+    }
+}
+
+void emit_function_block(astree* node, const vector<string>& roots,
+                         astree* function){
     if(!node) return;
 
     printOilFile("{\n");
+    emit_stack_slots(node);
+    if(gc_frame)
+        emit_gc_enter(node, roots);
+    emit_count("fn", function);
     for(auto child : node->children){
 
         if(child->tokenCode == TOK_VARDECL)
@@ -489,6 +1087,8 @@ void emit_function_block(astree* node){
         else
             emit_statement(child);
     }
+    if(gc_frame)
+        printOilFile("        oc_gc_leave (&__frame);\n");
     printOilFile("}\n\n");
 }
 
@@ -508,10 +1108,7 @@ void emit_function_params(astree* node){
                 printOilFile(",");
             string type, ident;
             emit_decl(child, type, ident);
-            string res = "_" + get_blocknr(child) 
-                + "_" + ident;
-            paramMap[ident] = res;
-            printOilFile("\n        " + type + " " + res);
+            printOilFile("\n        " + type + " " + ident);
         }
     }
     printOilFile(")\n");
@@ -528,17 +1125,57 @@ void emit_function_name(astree* node){
 void emit_function(astree* node){
     if(!node || node->children.size() != 3) return;
 
-    paramMap.clear();
-    localMap.clear();
+    vector<string> roots = gc_function_roots(node);
+    string ident;
+    emit_decl(node->children[0], gc_return_type, ident);
 
     emit_function_name(node->children[0]);
     emit_function_params(node->children[1]);
-    emit_function_block(node->children[2]);
+    emit_function_block(node->children[2], roots, node);
+    gc_frame = false;
+}
+
+void emit_prototype(astree* node){
+    if(!node || node->children.size() < 2) return;
+
+    string type, ident;
+    emit_decl(node->children[0], type, ident);
+    string proto = type + " " + ident + " (";
+    if(node->children[1]->children.empty())
+        proto += "void";
+    for(auto param : node->children[1]->children){
+        emit_decl(param, type, ident);
+        if(proto.back() != '(')
+            proto += ", ";
+        proto += type + " " + ident;
+    }
+    proto += ")";
+    // cc lays out hot and cold functions apart from the rest
+    int heat = node->tokenCode == TOK_FUNCTION ? profile_heat(node) : 0;
+    if(heat > 0)
+        proto += " __attribute__ ((hot))";
+    else if(heat < 0)
+        proto += " __attribute__ ((cold))";
+    printOilFile(proto + ";\n");
 }
 
 void emit_find_function(astree* node){
     if(!node) return;
 
+    // prototypes first, so calls may precede definitions
+    bool any = false;
+    for(auto child : node->children){
+        if(child->tokenCode == TOK_FUNCTION
+        ||child->tokenCode == TOK_PROTO){
+            emit_prototype(child);
+            any = true;
+        }
+    }
+    if(any)
+        printOilFile("\n");
+
+    if(oil_gc)
+        find_gc_allocating(node);
     for(auto child : node->children){
         if(child->tokenCode == TOK_FUNCTION){
             emit_function(child);
@@ -546,33 +1183,134 @@ void emit_find_function(astree* node){
     }
 }
 
+// Pointer globals main does not hold, in a root frame of their own
+// below the frames of whatever main calls.
+void emit_root_frame(){
+    string list;
+    for(auto& ident : gc_global_roots){
+        if(!list.empty())
+            list += ", ";
+        list += "(void**) &" + ident;
+    }
+    printOilFile("static void** const __oc_global_roots[] = {" + list 
+        + "};\n"
+        "static struct oc_gc_frame __oc_global_frame;\n\n"
+        "__attribute__ ((constructor))\n"
+        "static void __oc_global_init (void) {\n"
+        "        oc_gc_enter (&__oc_global_frame, __oc_global_roots, " 
+        + to_string(gc_global_roots.size()) + ");\n"
+        "}\n\n");
+}
+
+// A module without main keeps them so.
+void emit_global_frame(astree* root){
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_FUNCTION && child->children.size() == 3
+        && oil_name(child->children[0]->children.back()) == "__main")
+            return;
+    }
+    emit_root_frame();
+}
+
+void emit_global_decl(astree* node){
+    string type, ident;
+    emit_decl(node->children[0], type, ident);
+
+    // the module whose interface it came from defines it
+    if(from_interface(node->lloc)){
+        printOilFile("extern " + type + " " + ident + ";\n");
+        return;
+    }
+    if(is_pointer_type(type))
+        gc_global_roots.push_back(ident);
+
+    // file scope initializers must be constant expressions
+    string init;
+    if(node->children.size() == 2)
+        emit_constant(node->children[1], init);
+    if(init.empty())
+        printOilFile(type + " " + ident + ";\n");
+    else
+        printOilFile(type + " " + ident + " = " + init + ";\n");
+}
+
 void emit_global(astree* node){
     if(!node) return;
 
     for(auto child : node->children){
         if(child->tokenCode == TOK_VARDECL
-        ||child->children.size() > 0){
-            string type, ident;
-            emit_decl(child->children[0], type, ident);
-            printOilFile(type + " " + ident + ";\n");
-            global_map.insert(ident);
-        }
+        &&child->children.size() > 0)
+            emit_global_decl(child);
     }
     printOilFile("\n");
+    if(oil_gc && oil_module && !gc_global_roots.empty())
+        emit_global_frame(node);
+}
+
+void emit_begin(const string& header){
+    if(oil_gc)
+        printOilFile("#include <stddef.h>\n");
+    printOilFile("#include \"oclib.h\"\n");
+    if(!header.empty())
+        printOilFile("#include \"" + header + "\"\n");
+    printOilFile("\n");
+    if(!oil_profile.empty())
+        printOilFile("extern unsigned long __oc_counts[];\n\n");
+    // the strings the runtime makes need headers too
+    if(oil_sized_strings)
+        printOilFile("__attribute__ ((constructor))\n"
+            "static void __oc_sized_init (void) {\n"
+            "        oc_sized_strings = 1;\n"
+            "}\n\n");
+}
+
+void emit_declaration(astree* node){
+    if(!node) return;
+
+    if(strings_emitted < string_pool.size())
+        emit_stringcon();
+
+    // the header declares every struct ahead of the prototypes
+    FILE* oil = oilfile;
+    switch(node->tokenCode){
+    case TOK_STRUCT:
+        if(node->children.empty()) break;
+        oilfile = protofile;
+        printOilFile("struct " + *(node->children[0]->lexinfo) + ";\n");
+        oilfile = oil;
+        emit_struct(node);
+        break;
+    case TOK_VARDECL:
+        if(node->children.empty()) break;
+        emit_global_decl(node);
+        printOilFile("\n");
+        break;
+    case TOK_FUNCTION:
+    case TOK_PROTO:
+        oilfile = protofile;
+        emit_prototype(node);
+        oilfile = oil;
+        if(oil_gc)
+            note_gc_allocating(node);
+        emit_function(node);
+        break;
+    }
+}
+
+void emit_end(){
+    if(oil_gc && !gc_global_roots.empty())
+        emit_root_frame();
+    emit_profile_table();
 }
 
 void emit_il(astree* root){
     if(!root) return;
 
-    printOilFile("#include \"oclib.h\"\n\n");
+    emit_begin("");
     emit_find_struct(root);
     emit_stringcon();
     emit_global(root);
     emit_find_function(root);
-
-    global_map.clear();
-    paramMap.clear();
-    localMap.clear();
-    typeMap.clear();
+    emit_profile_table();
 }
 
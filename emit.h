@@ -1,5 +1,45 @@
 #include "astree.h"
 
+// --gc: allocate through the runtime's collector and emit the
+// pointer maps and root frames it needs
+extern bool oil_gc;
+
+// --instrument: count the runs of each function, branch and loop,
+// and have the program append the counts to this file at exit;
+// empty if not instrumenting
+extern string oil_profile;
+
+// --sized-strings: strings carry a header with their length and
+// capacity in front of their chars, and stores to their chars keep
+// the length current
+extern bool oil_sized_strings;
+
+// --module: the source is one module of a program.  Globals read
+// from other modules' interfaces are declared extern, and a module
+// without main roots its own globals for --gc itself.
+extern bool oil_module;
+
+// --stream: each declaration is emitted as soon as it is parsed.
+// The structs and prototypes go to a header the oil includes as
+// well, so calls may still precede definitions, and main leaves the
+// pointer globals to a root frame of their own.
+extern bool oil_stream;
+
+// Under --sized-strings, whether node stores to a char of a string.
+bool stores_char (astree* node);
+
+// The slot of the string constant pool holding literal, the text
+// of a TOK_STRINGCON as interned by string_set.  Each distinct
+// literal is declared once in the oil.
+const string& pool_string (const string* literal);
+
 void emit_il(astree*);
 
+// --stream: emit_begin writes the top of the oil, including header
+// if not empty, emit_declaration one checked declaration and
+// emit_end what follows the last.
+void emit_begin(const string& header);
+void emit_declaration(astree*);
+void emit_end();
+
 
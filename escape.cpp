@@ -0,0 +1,227 @@
+#include <unordered_set>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "emit.h"
+#include "escape.h"
+#include "opt.h"
+
+extern symbol_table type_symbol_table;
+
+// Arrays and strings of a constant size up to this many elements
+// may go on the stack.
+static const long stack_array_limit = 256;
+
+// Pointer variables (params and locals) whose value may outlive
+// the call: returned, stored into a field, element or global,
+// copied to another variable, or passed on to a callee that lets
+// its param escape.
+static unordered_set<symbol*> escaping;
+
+// Functions with a body, by oil name, for their params.
+static unordered_map<string, astree*> functions;
+
+static size_t stack_slots = 0;
+
+/********************* helpers **********************/
+
+static astree* declid(astree* decl){
+    if(decl->tokenCode == TOK_ARRAY)
+        return decl->children[1];
+    return decl->children[0];
+}
+
+static bool holds_pointer(const symbol& sym){
+    return has_attr(sym, attr::ARRAY)
+        || has_attr(sym, attr::STRING)
+        || has_attr(sym, attr::STRUCT);
+}
+
+// Library functions that only look at their arguments.
+static bool keeps_no_args(const string& name){
+    return name == "putstr";
+}
+
+/********************* escapes **********************/
+
+// Whether the variable used at ident lets its value escape, given
+// the node it is used in and its position there.
+static bool use_escapes(astree* parent, size_t index){
+    switch(parent->tokenCode){
+    case '.':
+    case '[':
+        return index != 0;
+    case '=':
+        return index != 0;
+    case TOK_EQ:
+    case TOK_NE:
+    case TOK_NOT:
+        return false;
+    case TOK_CALL: {
+        astree* callee = parent->children[0];
+        if(callee->symbl.decl == nullptr)
+            return not keeps_no_args(*callee->lexinfo);
+        auto function = functions.find(callee->symbl.decl->oil_name);
+        if(function == functions.end())
+            return true;
+        astree* params = function->second->children[1];
+        if(index - 1 >= params->children.size())
+            return true;
+        symbol* param = &declid(params->children[index - 1])->symbl;
+        return escaping.count(param) > 0;
+    }
+    default:
+        return true;
+    }
+}
+
+// Marks the escaping variables used under node.  Returns true if
+// anything new was marked.
+static bool mark_escapes(astree* node){
+    bool changed = false;
+    for(size_t index = 0; index < node->children.size(); ++index){
+        astree* child = node->children[index];
+        symbol* decl = child->symbl.decl;
+        if(child->tokenCode == TOK_IDENT && decl != nullptr
+        && (has_attr(*decl, attr::PARAM) || has_attr(*decl, attr::LOCAL))
+        && holds_pointer(*decl) && !escaping.count(decl)
+        && use_escapes(node, index)){
+            escaping.insert(decl);
+            changed = true;
+        }
+        changed |= mark_escapes(child);
+    }
+    return changed;
+}
+
+/********************* demotion *********************/
+
+// The element count of a constant-size allocation, or -1.
+static long constant_count(astree* size){
+    if(size->tokenCode != TOK_INTCON) return -1;
+    return strtol(size->lexinfo->c_str(), nullptr, 10);
+}
+
+static bool struct_has_pointers(const string* name){
+    auto type = type_symbol_table.find(name);
+    if(type == type_symbol_table.end() || type->second->fields == nullptr)
+        return true;
+    for(auto& field : *type->second->fields){
+        if(holds_pointer(*field.second))
+            return true;
+    }
+    return false;
+}
+
+// Whether this allocation could live in a stack slot.  Under --gc
+// only objects without pointers qualify: the collector does not
+// scan stack slots.
+static bool stack_allocatable(astree* alloc){
+    long count;
+    switch(alloc->tokenCode){
+    case TOK_NEW:
+        return !oil_gc
+            || !struct_has_pointers(alloc->children[0]->lexinfo);
+    case TOK_NEWSTR:
+        count = constant_count(alloc->children[0]);
+        return count > 0 && count <= stack_array_limit;
+    case TOK_NEWARRAY:
+        count = constant_count(alloc->children[1]);
+        if(oil_gc && alloc->children[0]->tokenCode != TOK_INT)
+            return false;
+        return count > 0 && count <= stack_array_limit;
+    default:
+        return false;
+    }
+}
+
+// The variable an allocation is stored straight into, by
+// declaration or by assignment, or null.
+static astree* allocated_into(astree* parent, size_t index){
+    if(parent->tokenCode == TOK_VARDECL && index == 1)
+        return declid(parent->children[0]);
+    if(parent->tokenCode == '=' && index == 1
+    && parent->children[0]->tokenCode == TOK_IDENT
+    && parent->children[0]->symbl.decl != nullptr)
+        return parent->children[0];
+    return nullptr;
+}
+
+// An assignment is a statement if its value is not used.
+static bool is_statement(astree* parent, size_t index){
+    return parent->tokenCode == TOK_BLOCK
+        || ((parent->tokenCode == TOK_WHILE
+            || parent->tokenCode == TOK_IF) && index > 0);
+}
+
+static void demote(astree* node, bool statement,
+                   const string& function, size_t& sites,
+                   size_t& demoted){
+    for(size_t index = 0; index < node->children.size(); ++index){
+        astree* child = node->children[index];
+        bool child_statement = is_statement(node, index);
+        switch(child->tokenCode){
+        case TOK_NEW:
+        case TOK_NEWSTR:
+        case TOK_NEWARRAY:
+        case TOK_NEWARRAY2: {
+            ++sites;
+            astree* var = allocated_into(node, index);
+            symbol* local = var == nullptr ? nullptr
+                : var->tokenCode == TOK_IDENT ? var->symbl.decl
+                : &var->symbl;
+            bool stored = local != nullptr
+                && has_attr(*local, attr::LOCAL)
+                && (node->tokenCode == TOK_VARDECL || statement);
+            if(stored && !escaping.count(local)
+            && stack_allocatable(child)){
+                child->symbl.stack_slot =
+                    "__stack" + to_string(++stack_slots);
+                ++demoted;
+                optprintf(child->lloc, "%s: %s kept on the stack",
+                          function.c_str(), var->lexinfo->c_str());
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        demote(child, child_statement, function, sites, demoted);
+    }
+}
+
+/********************* the pass *********************/
+
+void escape_analysis(astree* root){
+    escaping.clear();
+    functions.clear();
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_FUNCTION
+        && child->children.size() == 3){
+            functions[declid(child->children[0])->symbl.oil_name] = child;
+        }
+    }
+
+    // params start out not escaping, so recursion through a param
+    // that is only passed on keeps it local; iterate to a fixpoint
+    bool changed = true;
+    while(changed){
+        changed = false;
+        for(auto& function : functions){
+            changed |= mark_escapes(function.second->children[2]);
+        }
+    }
+
+    size_t sites = 0;
+    size_t demoted = 0;
+    for(auto child : root->children){
+        if(child->tokenCode != TOK_FUNCTION
+        || child->children.size() != 3) continue;
+        string name = *declid(child->children[0])->lexinfo;
+        demote(child->children[2], false, name, sites, demoted);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "escape: %zu of %zu allocations"
+                " moved to the stack\n", demoted, sites);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef __ESCAPE_H__
+#define __ESCAPE_H__
+
+#include "astree.h"
+
+// Finds allocations whose object never leaves the function that
+// makes it, and gives each a stack slot (symbl.stack_slot) for the
+// emitter to use instead of the heap.
+void escape_analysis (astree* root);
+
+#endif
@@ -0,0 +1,150 @@
+#include <unordered_set>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "flatten.h"
+#include "opt.h"
+
+// The struct arrays of the function being looked at, with the
+// allocations they are assigned.  An array leaves once one of its
+// uses could see an element as a value of its own.
+struct array_uses {
+    astree* declid;
+    vector<astree*> allocations;
+    bool flat = true;
+};
+
+static unordered_set<string> split_structs;
+static unordered_map<symbol*, array_uses> arrays;
+static size_t arrays_flattened = 0;
+
+/********************* helpers **********************/
+
+static astree* declid(astree* decl){
+    if(decl->tokenCode == TOK_ARRAY)
+        return decl->children[1];
+    return decl->children[0];
+}
+
+static bool struct_array(const symbol& sym){
+    return has_attr(sym, attr::ARRAY) && has_attr(sym, attr::STRUCT)
+        && sym.type_name != nullptr
+        && !split_structs.count(*sym.type_name);
+}
+
+// a statement of its own, so its value goes nowhere
+static bool statement(const vector<astree*>& path, size_t depth){
+    if(depth == 0)
+        return false;
+    astree* parent = path[depth - 1];
+    if(parent->tokenCode == TOK_BLOCK)
+        return true;
+    if(parent->tokenCode != TOK_IF && parent->tokenCode != TOK_WHILE)
+        return false;
+    return parent->children[0] != path[depth];
+}
+
+/********************* uses *********************/
+
+// Whether the use of an array at the end of path leaves its
+// elements unseen: the path runs up from the TOK_IDENT.
+static bool keeps_elements(const vector<astree*>& path,
+                           array_uses& array){
+    size_t depth = path.size() - 1;
+    astree* ident = path[depth];
+    astree* parent = depth > 0 ? path[depth - 1] : nullptr;
+    if(parent == nullptr)
+        return false;
+    switch(parent->tokenCode){
+    case TOK_EQ:
+    case TOK_NE:
+        return true;
+    case '=':
+        // a = new node[n], or a = null
+        if(parent->children[0] != ident)
+            return false;
+        if(parent->children[1]->tokenCode == TOK_NULL)
+            return true;
+        if(parent->children[1]->tokenCode != TOK_NEWARRAY)
+            return false;
+        array.allocations.push_back(parent->children[1]);
+        return true;
+    case '[': {
+        if(parent->children[0] != ident || depth < 2)
+            return false;
+        astree* user = path[depth - 2];
+        // a[i].f
+        if(user->tokenCode == '.' && user->children[0] == parent)
+            return true;
+        // a[i] = new node, on its own
+        return user->tokenCode == '=' && user->children[0] == parent
+            && user->children[1]->tokenCode == TOK_NEW
+            && statement(path, depth - 2);
+    }
+    default:
+        return false;
+    }
+}
+
+static void find_uses(vector<astree*>& path){
+    astree* node = path.back();
+    if(node->tokenCode == TOK_VARDECL && node->children.size() == 2){
+        astree* id = declid(node->children[0]);
+        if(has_attr(id->symbl, attr::LOCAL) && struct_array(id->symbl)){
+            array_uses& array = arrays[&id->symbl];
+            array.declid = id;
+            astree* init = node->children[1];
+            if(init->tokenCode == TOK_NEWARRAY)
+                array.allocations.push_back(init);
+            else if(init->tokenCode != TOK_NULL)
+                array.flat = false;
+        }
+    }
+    else if(node->tokenCode == TOK_IDENT && node->symbl.decl != nullptr){
+        auto found = arrays.find(node->symbl.decl);
+        if(found != arrays.end() && !keeps_elements(path, found->second))
+            found->second.flat = false;
+    }
+    for(auto child : node->children){
+        path.push_back(child);
+        find_uses(path);
+        path.pop_back();
+    }
+}
+
+/********************* the pass *********************/
+
+static void flatten(astree* function){
+    const string& name = *function->children[0]->children.back()->lexinfo;
+    arrays.clear();
+    vector<astree*> path{function->children[2]};
+    find_uses(path);
+    for(auto& entry : arrays){
+        array_uses& array = entry.second;
+        if(!array.flat)
+            continue;
+        entry.first->flat = true;
+        for(auto allocation : array.allocations)
+            allocation->symbl.flat = true;
+        ++arrays_flattened;
+        optprintf(array.declid->lloc, "%s: %s[] %s stored as one block",
+                  name.c_str(), entry.first->type_name->c_str(),
+                  array.declid->lexinfo->c_str());
+    }
+}
+
+void flatten_arrays(astree* root){
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_STRUCT && child->children.size() == 3)
+            split_structs.insert(*child->children[0]->lexinfo);
+    }
+    size_t before = arrays_flattened;
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_FUNCTION && child->children.size() == 3)
+            flatten(child);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "flatten: %zu struct arrays stored as blocks\n",
+                arrays_flattened - before);
+    }
+}
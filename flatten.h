@@ -0,0 +1,13 @@
+#ifndef __FLATTEN_H__
+#define __FLATTEN_H__
+
+#include "astree.h"
+
+// Finds local arrays of structs whose elements are only selected
+// from, a[i].f, or replaced by new structs, a[i] = new node, so
+// that no element is ever shared, compared or handed on.  Each is
+// marked (symbl.flat) to be stored as one block of structs, which
+// the emitter allocates in one piece and selects from in place.
+void flatten_arrays (astree* root);
+
+#endif
@@ -0,0 +1,719 @@
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "lyutils.h"
+#include "incremental.h"
+
+extern symbol_table global_symbol_table;
+extern symbol_table type_symbol_table;
+extern bool (*symbol_visible) (const symbol* sym);
+
+enum class region_kind { blank, decl, include, directive };
+
+struct region {
+   size_t start;                  // offset of its first byte
+   size_t end;                    // past its last
+   size_t line;                   // the line start is on
+   size_t order = 0;              // its index among the regions
+   region_kind kind;
+   astree* root = nullptr;        // a TOK_ROOT over its declarations
+   vector<astree*> globals;       // the declids of what it declares
+   vector<astree*> types;         // the typeids of its structs
+   vector<const string*> names;   // both, and the structs' fields
+   unordered_set<const string*> mentions;
+};
+
+static string text;
+static string source;
+static string cpp_command;
+static string defines_option;           // -D options to cpp
+static size_t source_filenr = 0;
+static vector<region*> regions;
+static bool uses_macros = false;        // a #define or #undef
+static bool has_conditionals = false;   // #if and the rest
+
+static unordered_map<const symbol*, region*> owners;
+static unordered_map<const string*, vector<symbol*>> global_declarers;
+static unordered_map<const string*, vector<symbol*>> type_declarers;
+static unordered_map<const string*, unordered_set<region*>> mentioned_by;
+static region* checking = nullptr;
+
+/*********************** regions ***********************/
+
+// Past the blanks and comments at at.
+static size_t skip_blanks (size_t at) {
+   while (at < text.size()) {
+      if (isspace (static_cast<unsigned char> (text[at]))) {
+         ++at;
+      }else if (text.compare (at, 2, "//") == 0) {
+         size_t end = text.find ('\n', at);
+         at = end == string::npos ? text.size() : end;
+      }else if (text.compare (at, 2, "/*") == 0) {
+         size_t end = text.find ("*/", at + 2);
+         at = end == string::npos ? text.size() : end + 2;
+      }else {
+         break;
+      }
+   }
+   return at;
+}
+
+// Past the string or char constant at at, or the rest of its line.
+static size_t skip_literal (size_t at) {
+   char quote = text[at++];
+   while (at < text.size() and text[at] != quote and text[at] != '\n') {
+      at += text[at] == '\\' ? 2 : 1;
+   }
+   if (at >= text.size()) return text.size();
+   return text[at] == quote ? at + 1 : at;
+}
+
+// The word after the '#' at hash in s.
+static string directive_word (const string& s, size_t hash) {
+   size_t at = hash + 1;
+   while (at < s.size() and (s[at] == ' ' or s[at] == '\t')) ++at;
+   size_t word = at;
+   while (at < s.size() and isalpha (static_cast<unsigned char> (s[at]))) {
+      ++at;
+   }
+   return s.substr (word, at - word);
+}
+
+// The directive lines of body but #include, which matters only to
+// the region it is in.
+static vector<string> macro_lines (const string& body) {
+   vector<string> lines;
+   for (size_t at = 0; at < body.size(); ) {
+      size_t end = body.find ('\n', at);
+      end = end == string::npos ? body.size() : end + 1;
+      size_t first = body.find_first_not_of (" \t", at);
+      if (first < end and body[first] == '#'
+          and directive_word (body, first) != "include") {
+         lines.push_back (body.substr (at, end - at));
+      }
+      at = end;
+   }
+   return lines;
+}
+
+static bool defines (const string& line) {
+   string word = directive_word (line, line.find ('#'));
+   return word == "define" or word == "undef";
+}
+
+// Where the region starting at start ends: past a directive line, or
+// past the ';' or the closing '}' that ends a declaration outside of
+// any braces.  The blanks and comments ahead of either belong to it.
+static size_t region_end (size_t start, region_kind& kind) {
+   size_t at = skip_blanks (start);
+   if (at == text.size()) {
+      kind = region_kind::blank;
+      return at;
+   }
+   if (text[at] == '#') {
+      size_t end = text.find ('\n', at);
+      end = end == string::npos ? text.size() : end + 1;
+      kind = directive_word (text, at) == "include" ? region_kind::include
+                                                     : region_kind::directive;
+      return end;
+   }
+   kind = region_kind::decl;
+   int depth = 0;
+   while (at < text.size()) {
+      char c = text[at];
+      if (text.compare (at, 2, "//") == 0 or text.compare (at, 2, "/*") == 0) {
+         at = skip_blanks (at);
+         continue;
+      }
+      if (c == '"' or c == '\'') {
+         at = skip_literal (at);
+         continue;
+      }
+      ++at;
+      if (c == '{') ++depth;
+      else if (c == '}' and --depth <= 0) return at;
+      else if (c == ';' and depth == 0) return at;
+   }
+   return at;
+}
+
+static size_t newlines (size_t start, size_t end) {
+   return count (text.begin() + start, text.begin() + end, '\n');
+}
+
+static region* make_region (size_t start, size_t line) {
+   region* r = new region();
+   r->start = start;
+   r->end = region_end (start, r->kind);
+   r->line = line;
+   return r;
+}
+
+// The index of the region holding offset.
+static size_t region_at (size_t offset) {
+   size_t low = 0;
+   size_t high = regions.size();
+   while (high - low > 1) {
+      size_t middle = (low + high) / 2;
+      if (regions[middle]->start <= offset) low = middle;
+      else high = middle;
+   }
+   return low;
+}
+
+/*********************** parsing ***********************/
+
+static astree* empty_root (const region* r) {
+   return new astree (TOK_ROOT, {source_filenr, r->line, 0, 0}, "");
+}
+
+static size_t column_of (size_t at) {
+   size_t newline = at == 0 ? string::npos : text.rfind ('\n', at - 1);
+   return newline == string::npos ? at : at - newline - 1;
+}
+
+// Parses yyin as the text of r.  A parse that fails outright takes
+// its tree with it.
+static astree* parse_input (const region* r) {
+   lexer::lloc = {source_filenr, r->line, column_of (r->start), 0};
+   lexer::last_yyleng = 0;
+   int parse_rc = yyparse();
+   yylex_destroy();
+   return parse_rc == 0 ? parser::root : empty_root (r);
+}
+
+// Sends body, the text of r, through cpp after prefix, from a file
+// of its own; includes are found next to the source.
+static astree* parse_cpp (const region* r, const string& prefix,
+                          const string& body) {
+   char path[] = "/tmp/ocXXXXXX";
+   int fd = mkstemp (path);
+   if (fd < 0) {
+      syserrprintf ("mkstemp");
+      return empty_root (r);
+   }
+   string input = prefix + "# " + to_string (r->line) + " \"" + source
+                + "\"\n" + string (column_of (r->start), ' ') + body
+                + "\n";
+   bool written = write (fd, input.data(), input.size())
+               == static_cast<ssize_t> (input.size());
+   close (fd);
+   astree* root = nullptr;
+   if (written) {
+      size_t slash = source.find_last_of ('/');
+      string dir = slash == string::npos ? "." : source.substr (0, slash);
+      string command = cpp_command + "-iquote " + dir + " " + path;
+      yyin = popen (command.c_str(), "r");
+      if (yyin != nullptr) {
+         root = parse_input (r);
+         int pclose_rc = pclose (yyin);
+         if (pclose_rc != 0) eprint_status (command.c_str(), pclose_rc);
+      }
+   }
+   unlink (path);
+   if (root == nullptr) {
+      syserrprintf (path);
+      root = empty_root (r);
+   }
+   return root;
+}
+
+// Whether a line of body is a directive cpp must see.
+static bool has_directive (const string& body) {
+   for (size_t at = 0; at < body.size(); ) {
+      size_t first = body.find_first_not_of (" \t", at);
+      if (first != string::npos and body[first] == '#') return true;
+      size_t end = body.find ('\n', at);
+      if (end == string::npos) break;
+      at = end + 1;
+   }
+   return false;
+}
+
+static astree* parse_region (const region* r) {
+   if (r->kind == region_kind::blank or r->kind == region_kind::directive) {
+      return empty_root (r);
+   }
+   string body = text.substr (r->start, r->end - r->start);
+   // __FILE__ and the like are cpp's own macros
+   if (r->kind == region_kind::include or uses_macros
+       or has_directive (body) or body.find ("__") != string::npos) {
+      // the macros in force are the ones defined above it
+      string prefix;
+      for (auto& line: macro_lines (text.substr (0, r->start))) {
+         if (not defines (line)) continue;
+         prefix += line;
+         if (prefix.back() != '\n') prefix += '\n';
+      }
+      return parse_cpp (r, prefix, body);
+   }
+   yyin = fmemopen (&body[0], body.size(), "r");
+   if (yyin == nullptr) {
+      syserrprintf ("fmemopen");
+      return empty_root (r);
+   }
+   astree* root = parse_input (r);
+   fclose (yyin);
+   return root;
+}
+
+/*********************** symbols ***********************/
+
+static astree* declid (astree* decl) {
+   return decl->children.back();
+}
+
+// The symbols of a name go in the tables as a check of the whole
+// file would leave them: the first global declared, the last struct.
+static void settle (symbol_table& table, const string* name,
+                    const vector<symbol*>& declarers, bool first) {
+   symbol* chosen = nullptr;
+   for (auto sym: declarers) {
+      if (chosen == nullptr
+          or (owners[sym]->order < owners[chosen]->order) == first) {
+         chosen = sym;
+      }
+   }
+   if (chosen == nullptr) table.erase (name);
+   else table[name] = chosen;
+}
+
+static void mention (region* r, astree* node) {
+   switch (node->tokenCode) {
+      case TOK_IDENT: case TOK_TYPEID: case TOK_FIELD: case TOK_DECLID:
+         r->mentions.insert (node->lexinfo);
+         break;
+   }
+   for (auto child: node->children) mention (r, child);
+}
+
+// Enters what r declares and mentions, once it is checked.
+static void enter (region* r) {
+   for (auto decl: r->root->children) {
+      switch (decl->tokenCode) {
+         case TOK_FUNCTION: case TOK_PROTO: case TOK_VARDECL:
+            if (decl->children.empty()
+                or decl->children[0]->children.empty()) break;
+            r->globals.push_back (declid (decl->children[0]));
+            r->names.push_back (declid (decl->children[0])->lexinfo);
+            break;
+         case TOK_STRUCT:
+            r->types.push_back (decl->children[0]);
+            r->names.push_back (decl->children[0]->lexinfo);
+            if (decl->children.size() < 2) break;
+            for (auto field: decl->children[1]->children) {
+               r->names.push_back (declid (field)->lexinfo);
+            }
+            break;
+      }
+   }
+   for (auto id: r->globals) {
+      owners[&id->symbl] = r;
+      global_declarers[id->lexinfo].push_back (&id->symbl);
+      settle (global_symbol_table, id->lexinfo,
+              global_declarers[id->lexinfo], true);
+   }
+   for (auto id: r->types) {
+      owners[&id->symbl] = r;
+      type_declarers[id->lexinfo].push_back (&id->symbl);
+      settle (type_symbol_table, id->lexinfo,
+              type_declarers[id->lexinfo], false);
+   }
+   mention (r, r->root);
+   for (auto name: r->mentions) mentioned_by[name].insert (r);
+}
+
+static void forget (vector<symbol*>& declarers, symbol* sym) {
+   declarers.erase (remove (declarers.begin(), declarers.end(), sym),
+                    declarers.end());
+}
+
+// Takes back what enter did, before r is parsed again or dropped.
+static void leave (region* r) {
+   for (auto id: r->globals) {
+      forget (global_declarers[id->lexinfo], &id->symbl);
+      owners.erase (&id->symbl);
+      settle (global_symbol_table, id->lexinfo,
+              global_declarers[id->lexinfo], true);
+   }
+   for (auto id: r->types) {
+      forget (type_declarers[id->lexinfo], &id->symbl);
+      owners.erase (&id->symbl);
+      settle (type_symbol_table, id->lexinfo,
+              type_declarers[id->lexinfo], false);
+   }
+   for (auto name: r->mentions) mentioned_by[name].erase (r);
+   r->globals.clear();
+   r->types.clear();
+   r->names.clear();
+   r->mentions.clear();
+}
+
+static bool declared_ahead (const symbol* sym) {
+   auto owner = owners.find (sym);
+   return checking == nullptr or owner == owners.end()
+       or owner->second->order < checking->order;
+}
+
+// Checks the declarations of r but those kept whole from before.
+static void check (region* r, const vector<bool>& kept) {
+   checking = r;
+   for (size_t index = 0; index < r->root->children.size(); ++index) {
+      if (index < kept.size() and kept[index]) continue;
+      type_check (r->root->children[index]);
+   }
+   checking = nullptr;
+   enter (r);
+}
+
+/*********************** signatures ***********************/
+
+static string type_text (astree* decl) {
+   if (decl->tokenCode == TOK_ARRAY) {
+      return *decl->children[0]->lexinfo + "[]";
+   }
+   return *decl->lexinfo;
+}
+
+// What other declarations can see of node: a function's type, name
+// and parameter types, a global's type and name, all of a struct.
+static string signature (astree* node) {
+   string sig;
+   switch (node->tokenCode) {
+      case TOK_FUNCTION: case TOK_PROTO:
+         if (node->children.size() < 2) break;
+         sig = (node->tokenCode == TOK_FUNCTION ? "function " : "proto ")
+             + type_text (node->children[0]) + " "
+             + *declid (node->children[0])->lexinfo + " (";
+         for (auto param: node->children[1]->children) {
+            sig += type_text (param) + ",";
+         }
+         sig += ")";
+         break;
+      case TOK_VARDECL:
+         if (node->children.empty()) break;
+         sig = "global " + type_text (node->children[0]) + " "
+             + *declid (node->children[0])->lexinfo;
+         break;
+      case TOK_STRUCT:
+         sig = "struct " + *node->children[0]->lexinfo + " {";
+         if (node->children.size() < 2) break;
+         for (auto field: node->children[1]->children) {
+            sig += type_text (field) + " " + *declid (field)->lexinfo
+                 + ";";
+         }
+         break;
+   }
+   return sig;
+}
+
+// Gives the declarations of root the symbols of those of before, if
+// every one has the same signature, so that what the rest of the
+// file bound to stays valid.  A struct is all signature, so its old
+// declaration is kept whole and marked in kept.
+static bool transplant (astree* root, astree* before,
+                        vector<bool>& kept) {
+   if (root->children.size() != before->children.size()) return false;
+   for (size_t index = 0; index < root->children.size(); ++index) {
+      string sig = signature (root->children[index]);
+      if (sig.empty() or sig != signature (before->children[index])) {
+         return false;
+      }
+   }
+   kept.assign (root->children.size(), false);
+   for (size_t index = 0; index < root->children.size(); ++index) {
+      astree*& node = root->children[index];
+      astree*& old = before->children[index];
+      if (node->tokenCode == TOK_STRUCT) {
+         swap (node, old);
+         kept[index] = true;
+      }else {
+         swap (node->children[0], old->children[0]);
+      }
+   }
+   return true;
+}
+
+/*********************** loads and edits ***********************/
+
+static void renumber() {
+   for (size_t index = 0; index < regions.size(); ++index) {
+      regions[index]->order = index;
+   }
+}
+
+// Segments, parses and checks the whole text afresh.
+static void reload() {
+   for (auto r: regions) {
+      delete r->root;
+      delete r;
+   }
+   regions.clear();
+   owners.clear();
+   global_declarers.clear();
+   type_declarers.clear();
+   mentioned_by.clear();
+   global_symbol_table.clear();
+   type_symbol_table.clear();
+
+   uses_macros = not defines_option.empty();
+   has_conditionals = false;
+   for (auto& line: macro_lines (text)) {
+      if (defines (line)) uses_macros = true;
+      else has_conditionals = true;
+   }
+   size_t at = 0;
+   size_t line = 1;
+   do {
+      region* r = make_region (at, line);
+      r->order = regions.size();
+      regions.push_back (r);
+      line += newlines (at, r->end);
+      at = r->end;
+   }while (at < text.size());
+
+   if (not has_conditionals and not uses_macros) {
+      for (auto r: regions) r->root = parse_region (r);
+   }else {
+      // one pass of cpp over it all, each declaration then going to
+      // the region its first token is in; included ones come from
+      // the include's own region instead
+      vector<size_t> line_starts {0};
+      for (size_t index = 0; index < text.size(); ++index) {
+         if (text[index] == '\n') line_starts.push_back (index + 1);
+      }
+      for (auto r: regions) {
+         r->root = r->kind == region_kind::include ? parse_region (r)
+                                                   : empty_root (r);
+      }
+      region whole;
+      whole.start = 0;
+      whole.line = 1;
+      astree* all = parse_cpp (&whole, "", text);
+      for (auto decl: all->children) {
+         size_t linenr = decl->lloc.linenr;
+         if (*lexer::filename (decl->lloc.filenr) != source or linenr == 0
+             or linenr > line_starts.size()) {
+            delete decl;
+            continue;
+         }
+         size_t offset = min (line_starts[linenr - 1] + decl->lloc.offset,
+                              text.size());
+         region* r = regions[region_at (offset)];
+         if (r->kind == region_kind::include) delete decl;
+         else r->root->adopt (decl);
+      }
+      all->children.clear();
+      delete all;
+   }
+   for (auto r: regions) check (r, {});
+}
+
+// Applies an edit and brings the tree and tables up to date with it.
+static void edit (size_t offset, size_t length, const string& insert,
+                  size_t& reparsed, size_t& rechecked) {
+   size_t first = region_at (offset);
+   size_t removed_end = offset + length;
+   ptrdiff_t delta = static_cast<ptrdiff_t> (insert.size())
+                   - static_cast<ptrdiff_t> (length);
+   ptrdiff_t line_delta = count (insert.begin(), insert.end(), '\n');
+   line_delta -= newlines (offset, removed_end);
+   string deleted = text.substr (offset, length);
+   text.replace (offset, length, insert);
+   size_t edit_end = offset + insert.size();
+
+   // rescan from the region the edit starts in until a region ends
+   // where an old one past the edit did
+   vector<region*> made;
+   size_t at = regions[first]->start;
+   size_t line = regions[first]->line;
+   size_t last = first;
+   for (;;) {
+      region* r = make_region (at, line);
+      made.push_back (r);
+      line += newlines (at, r->end);
+      at = r->end;
+      if (at >= text.size()) {
+         last = regions.size();
+         break;
+      }
+      while (last < regions.size()
+             and (regions[last]->end < removed_end
+                  or static_cast<ptrdiff_t> (regions[last]->end) + delta
+                     < static_cast<ptrdiff_t> (at))) ++last;
+      if (at >= edit_end and last < regions.size()
+          and static_cast<ptrdiff_t> (regions[last]->end) + delta
+              == static_cast<ptrdiff_t> (at)) {
+         ++last;
+         break;
+      }
+   }
+   vector<region*> removed (regions.begin() + first,
+                            regions.begin() + last);
+   for (size_t index = last; index < regions.size(); ++index) {
+      regions[index]->start += delta;
+      regions[index]->end += delta;
+      regions[index]->line += line_delta;
+   }
+   regions.erase (regions.begin() + first, regions.begin() + last);
+   regions.insert (regions.begin() + first, made.begin(), made.end());
+   renumber();
+
+   // a macro may change any declaration below it
+   size_t span_start = made.front()->start;
+   string now = text.substr (span_start, made.back()->end - span_start);
+   string before = now;
+   before.replace (offset - span_start, insert.size(), deleted);
+   if (has_conditionals or not macro_lines (before).empty()
+       or not macro_lines (now).empty()) {
+      for (auto r: removed) {
+         delete r->root;
+         delete r;
+      }
+      reload();
+      reparsed = regions.size();
+      return;
+   }
+
+   // leave forgets what a region declares, which changes if it goes
+   vector<vector<const string*>> removed_names;
+   for (auto r: removed) {
+      removed_names.push_back (r->names);
+      leave (r);
+   }
+   unordered_set<const string*> changed;
+   vector<bool> used (removed.size(), false);
+   for (auto r: made) {
+      r->root = parse_region (r);
+      ++reparsed;
+      vector<bool> kept;
+      bool same = false;
+      for (size_t index = 0; index < removed.size() and not same; ++index) {
+         if (used[index]) continue;
+         same = transplant (r->root, removed[index]->root, kept);
+         used[index] = same;
+      }
+      check (r, kept);
+      if (not same) changed.insert (r->names.begin(), r->names.end());
+   }
+   for (size_t index = 0; index < removed.size(); ++index) {
+      if (used[index]) continue;
+      changed.insert (removed_names[index].begin(),
+                      removed_names[index].end());
+   }
+
+   // what bound to a changed name binds again, from a fresh parse
+   vector<astree*> dropped;
+   while (not changed.empty()) {
+      vector<region*> stale;
+      for (auto name: changed) {
+         auto users = mentioned_by.find (name);
+         if (users == mentioned_by.end()) continue;
+         for (auto r: users->second) {
+            if (find (made.begin(), made.end(), r) == made.end()
+                and find (stale.begin(), stale.end(), r) == stale.end()) {
+               stale.push_back (r);
+            }
+         }
+      }
+      changed.clear();
+      sort (stale.begin(), stale.end(),
+            [](region* a, region* b) { return a->order < b->order; });
+      for (auto r: stale) {
+         leave (r);
+         astree* before = r->root;
+         r->root = parse_region (r);
+         vector<bool> kept;
+         bool same = transplant (r->root, before, kept);
+         check (r, kept);
+         if (not same) changed.insert (r->names.begin(), r->names.end());
+         dropped.push_back (before);
+         made.push_back (r);
+         ++rechecked;
+      }
+   }
+   for (auto root: dropped) delete root;
+   for (auto r: removed) {
+      delete r->root;
+      delete r;
+   }
+}
+
+/*********************** the session ***********************/
+
+static long microseconds_since (const struct timespec& start) {
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start.tv_sec) * 1000000L
+        + (now.tv_nsec - start.tv_nsec) / 1000L;
+}
+
+int incremental_session (const string& source_name, const string& cpp,
+                         const string& defines) {
+   source = source_name;
+   cpp_command = cpp;
+   defines_option = defines;
+   FILE* file = fopen (source.c_str(), "r");
+   if (file == nullptr) {
+      syserrprintf (source.c_str());
+      return exec::exit_status;
+   }
+   char buffer[4096];
+   size_t got;
+   while ((got = fread (buffer, 1, sizeof buffer, file)) > 0) {
+      text.append (buffer, got);
+   }
+   fclose (file);
+
+   tokenFile = fopen ("/dev/null", "w");
+   symbol_visible = declared_ahead;
+   lexer::newfilename (source);
+   source_filenr = lexer::lloc.filenr;
+
+   struct timespec start;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   reload();
+   printf ("load %zu %ld\n", regions.size(), microseconds_since (start));
+   fflush (stdout);
+
+   char command[256];
+   while (fgets (command, sizeof command, stdin) != nullptr) {
+      size_t offset, length, count;
+      if (strcmp (command, "quit\n") == 0) break;
+      if (sscanf (command, "edit %zu %zu %zu", &offset, &length, &count)
+          != 3) {
+         errprintf ("incremental: bad command: %s", command);
+         continue;
+      }
+      string insert (count, '\0');
+      if (count > 0 and fread (&insert[0], 1, count, stdin) != count) {
+         errprintf ("incremental: edit cut short\n");
+         break;
+      }
+      if (offset > text.size() or length > text.size() - offset) {
+         errprintf ("incremental: edit out of range\n");
+         continue;
+      }
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      size_t reparsed = 0;
+      size_t rechecked = 0;
+      edit (offset, length, insert, reparsed, rechecked);
+      printf ("edit %zu %zu %ld\n", reparsed, rechecked,
+              microseconds_since (start));
+      fflush (stdout);
+   }
+
+   fclose (tokenFile);
+   for (auto r: regions) {
+      delete r->root;
+      delete r;
+   }
+   return exec::exit_status;
+}
@@ -0,0 +1,36 @@
+#ifndef __INCREMENTAL_H__
+#define __INCREMENTAL_H__
+
+#include <string>
+using namespace std;
+
+//
+// oc --incremental: parse and check a source, then keep its tree and
+// symbol tables while an editor sends edits on stdin, one command a
+// line:
+//
+//    edit OFFSET LENGTH COUNT   replace LENGTH bytes at OFFSET with
+//                               the COUNT bytes that follow the line
+//    quit
+//
+// The source is kept as a run of regions, one per top-level
+// declaration or directive line.  An edit rescans only the regions
+// it touches, reparses and checks only the declarations in them,
+// and rechecks only the declarations that mention a name whose
+// signature changed.  Diagnostics go to stderr as usual; after the
+// load and after each edit one line goes to stdout:
+//
+//    load REGIONS MICROSECONDS
+//    edit REPARSED RECHECKED MICROSECONDS
+//
+// Files with #if and the like, or edits near a #define, are parsed
+// over whole each time.
+//
+
+int incremental_session (const string& source, const string& cpp,
+                         const string& defines);
+// Runs the session for source, with cpp the command to preprocess
+// with, up to the file name and with the -D options in defines, up
+// to a quit or the end of stdin.  Returns the exit status for oc.
+
+#endif
@@ -0,0 +1,561 @@
+#include "lyutils.h"
+#include "astree.h"
+#include "emit.h"
+#include "induction.h"
+#include "opt.h"
+
+static size_t temp_counter = 0;
+static size_t reduced = 0;
+static size_t eliminated = 0;
+
+// A basic induction variable: a local or param stepped once per
+// iteration, by one of the statements that end the loop body.
+struct basic_iv {
+    symbol* var;
+    astree* step;        // invariant
+    astree* increment;   // var = var + step
+};
+
+// A temporary kept equal to an expression of the counter.  It is
+// monotone if it rises and falls with the counter.
+struct reduction {
+    astree* temp;        // TOK_VARDECL, the expression as child 1
+    bool monotone;
+    bool guarded;
+};
+
+// Where a statement sits: parent->children[index].
+struct position {
+    astree* parent;
+    size_t index;
+};
+
+struct loop_info {
+    astree* loop;
+    effects writes;
+    astree* before;      // the loop's children[2]
+    astree* guarded;     // the loop's children[3]
+    vector<astree*> increments;
+    vector<astree*> updates;
+    vector<reduction> reductions;
+    const basic_iv* iv;
+    string function;
+};
+
+/********************* helpers **********************/
+
+static bool uses_var(astree* node, symbol* var){
+    if(node->tokenCode == TOK_IDENT && node->symbl.decl == var)
+        return true;
+    for(auto child : node->children){
+        if(uses_var(child, var))
+            return true;
+    }
+    return false;
+}
+
+static size_t count_uses(astree* node, symbol* var){
+    size_t uses = node->tokenCode == TOK_IDENT
+        && node->symbl.decl == var;
+    for(auto child : node->children)
+        uses += count_uses(child, var);
+    return uses;
+}
+
+static size_t count_stores(astree* node, symbol* var){
+    size_t stores = node->tokenCode == '='
+        && node->children.size() == 2
+        && node->children[0]->tokenCode == TOK_IDENT
+        && node->children[0]->symbl.decl == var;
+    for(auto child : node->children)
+        stores += count_stores(child, var);
+    return stores;
+}
+
+// invariant, and safe to compute before the loop
+static bool loop_constant(astree* node, const effects& loop){
+    return invariant(node, loop) && !may_trap(node);
+}
+
+static bool declared_in(astree* block, symbol* decl){
+    for(auto temp : block->children){
+        if(&temp->children[0]->children.back()->symbl == decl)
+            return true;
+    }
+    return false;
+}
+
+// true if node needs a temporary licm left for after the first test
+static bool uses_guarded(astree* node, astree* guarded){
+    if(node->tokenCode == TOK_IDENT && node->symbl.decl != nullptr
+    && declared_in(guarded, node->symbl.decl))
+        return true;
+    for(auto child : node->children){
+        if(uses_guarded(child, guarded))
+            return true;
+    }
+    return false;
+}
+
+static long constant_value(astree* node){
+    return strtol(node->lexinfo->c_str(), nullptr, 10);
+}
+
+static astree* make_constant(long value, const location& lloc){
+    astree* node = new astree(TOK_INTCON, lloc, to_string(value).c_str());
+    node->symbl.attributes[static_cast<size_t>(attr::INT)] = true;
+    return node;
+}
+
+static bool is_one(astree* node){
+    return node->tokenCode == TOK_INTCON && constant_value(node) == 1;
+}
+
+// step * scale, folded when both are constants; no scale is 1
+static astree* make_product(astree* step, astree* scale){
+    if(scale == nullptr || is_one(scale))
+        return copy_expr(step);
+    if(is_one(step))
+        return copy_expr(scale);
+    if(step->tokenCode == TOK_INTCON && scale->tokenCode == TOK_INTCON)
+        return make_constant(constant_value(step) * constant_value(scale),
+                             step->lloc);
+    astree* product = new astree('*', step->lloc, "*");
+    product->symbl.attributes[static_cast<size_t>(attr::INT)] = true;
+    return product->adopt(copy_expr(step), copy_expr(scale));
+}
+
+// replaces each use of var under node by a copy of value
+static void substitute(astree* node, symbol* var, astree* value){
+    for(auto& child : node->children){
+        if(child->tokenCode == TOK_IDENT && child->symbl.decl == var){
+            delete child;
+            child = copy_expr(value);
+        }
+        else
+            substitute(child, var, value);
+    }
+}
+
+/******************* induction **********************/
+
+// var = var + step, var = step + var, or var = var - constant,
+// the only store to var in the loop
+static bool is_increment(astree* stmt, loop_info& info, basic_iv& iv){
+    if(stmt->tokenCode != '=' || stmt->children.size() != 2)
+        return false;
+    astree* target = stmt->children[0];
+    symbol* var = target->tokenCode == TOK_IDENT
+        ? target->symbl.decl : nullptr;
+    if(var == nullptr || !has_attr(*var, attr::INT)
+    || has_attr(*var, attr::ARRAY)
+    || !(has_attr(*var, attr::LOCAL) || has_attr(*var, attr::PARAM)))
+        return false;
+
+    astree* sum = stmt->children[1];
+    if(sum->children.size() != 2)
+        return false;
+    astree* step = nullptr;
+    if(sum->tokenCode == '+'){
+        for(size_t side = 0; side < 2; ++side){
+            astree* other = sum->children[1 - side];
+            if(sum->children[side]->tokenCode == TOK_IDENT
+            && sum->children[side]->symbl.decl == var
+            && loop_constant(other, info.writes))
+                step = copy_expr(other);
+        }
+    }
+    else if(sum->tokenCode == '-'
+    && sum->children[0]->tokenCode == TOK_IDENT
+    && sum->children[0]->symbl.decl == var
+    && sum->children[1]->tokenCode == TOK_INTCON){
+        step = make_constant(-constant_value(sum->children[1]),
+                             sum->lloc);
+    }
+    if(step == nullptr)
+        return false;
+    if(count_stores(info.loop, var) != 1){
+        delete step;
+        return false;
+    }
+    iv = {var, step, stmt};
+    return true;
+}
+
+// Whether node is var * scale plus or minus invariants.  scale is
+// left null for 1.
+static bool is_linear(astree* node, symbol* var, const effects& loop,
+                      astree*& scale){
+    if(node->tokenCode == TOK_IDENT){
+        scale = nullptr;
+        return node->symbl.decl == var;
+    }
+    if(node->children.size() != 2)
+        return false;
+    astree* left = node->children[0];
+    astree* right = node->children[1];
+    switch(node->tokenCode){
+    case '*':
+        for(size_t side = 0; side < 2; ++side){
+            astree* factor = node->children[side];
+            astree* other = node->children[1 - side];
+            if(factor->tokenCode == TOK_IDENT
+            && factor->symbl.decl == var && loop_constant(other, loop)){
+                scale = other;
+                return true;
+            }
+        }
+        return false;
+    case '+':
+        if(loop_constant(right, loop))
+            return is_linear(left, var, loop, scale);
+        if(loop_constant(left, loop))
+            return is_linear(right, var, loop, scale);
+        return false;
+    case '-':
+        return loop_constant(right, loop)
+            && is_linear(left, var, loop, scale);
+    default:
+        return false;
+    }
+}
+
+/******************* reduction **********************/
+
+// The temporary that follows expr, made the first time.  expr is
+// taken over.
+static reduction& reduce(astree* expr, astree* scale, loop_info& info,
+                         const char* what){
+    for(auto& red : info.reductions){
+        if(same_expr(red.temp->children[1], expr)){
+            delete expr;
+            return red;
+        }
+    }
+
+    const location lloc = expr->lloc;
+    string name = "__iv" + to_string(++temp_counter);
+    astree* temp = make_temp(name, expr);
+    astree* step = make_product(info.iv->step, scale);
+    bool guarded = uses_guarded(expr, info.guarded)
+        || uses_guarded(step, info.guarded);
+    astree* block = guarded ? info.guarded : info.before;
+    block->adopt(temp);
+    if(step->tokenCode != TOK_INTCON && step->tokenCode != TOK_IDENT){
+        astree* stride = make_temp("__iv" + to_string(++temp_counter),
+                                   step);
+        block->adopt(stride);
+        step = temp_use(stride, lloc);
+    }
+
+    astree* sum = new astree('+', lloc, "+");
+    sum->symbl.attributes = expr->symbl.attributes;
+    sum->symbl.type_name = expr->symbl.type_name;
+    sum->adopt(temp_use(temp, lloc), step);
+    astree* update = new astree('=', lloc, "=");
+    info.updates.push_back(update->adopt(temp_use(temp, lloc), sum));
+
+    bool monotone = scale == nullptr
+        || (scale->tokenCode == TOK_INTCON && constant_value(scale) > 0);
+    info.reductions.push_back({temp, monotone, guarded});
+    ++reduced;
+    optprintf(lloc, "%s: %s of %s kept in %s", info.function.c_str(),
+              what, info.iv->increment->children[0]->lexinfo->c_str(),
+              name.c_str());
+    return info.reductions.back();
+}
+
+// Replaces the elements indexed and the products computed from the
+// counter under parent->children[index] by temporaries.  a[i]
+// becomes p[0] for a pointer p that steps along a.
+static void reduce_uses(astree* parent, size_t index, loop_info& info){
+    symbol* var = info.iv->var;
+    astree* node = parent->children[index];
+    for(auto stmt : info.increments){
+        if(node == stmt) return;
+    }
+
+    // a store to a sized string finds the header from its start, and
+    // the elements of a flattened array are not pointers
+    astree* scale = nullptr;
+    if(node->tokenCode == '[' && node->children.size() == 2
+    && !(index == 0 && stores_char(parent))
+    && node->children[0]->tokenCode == TOK_IDENT
+    && !(node->children[0]->symbl.decl != nullptr
+         && node->children[0]->symbl.decl->flat)
+    && invariant(node->children[0], info.writes)
+    && is_linear(node->children[1], var, info.writes, scale)){
+        astree* base = node->children[0];
+        astree* address = new astree('+', node->lloc, "+");
+        address->symbl.attributes = base->symbl.decl->attributes;
+        address->symbl.type_name = base->symbl.decl->type_name;
+        address->adopt(copy_expr(base), copy_expr(node->children[1]));
+        reduction& red = reduce(address, scale, info, "element address");
+        for(auto& child : node->children)
+            delete child;
+        node->children[0] = temp_use(red.temp, node->lloc);
+        node->children[1] = make_constant(0, node->lloc);
+        return;
+    }
+    if(node->tokenCode == '*' && is_linear(node, var, info.writes, scale)){
+        reduction& red = reduce(copy_expr(node), scale, info, "product");
+        parent->children[index] = temp_use(red.temp, node->lloc);
+        delete node;
+        return;
+    }
+    for(size_t child = 0; child < node->children.size(); ++child)
+        reduce_uses(node, child, info);
+}
+
+/********************* liveness *********************/
+
+enum class flow { passes, used, killed };
+
+// What a statement does with var before anything after it runs.
+static flow flow_of(astree* stmt, symbol* var){
+    switch(stmt->tokenCode){
+    case TOK_BLOCK:
+        for(auto child : stmt->children){
+            flow next = flow_of(child, var);
+            if(next != flow::passes)
+                return next;
+        }
+        return flow::passes;
+    case TOK_WHILE:
+        // the body may not run at all
+        for(size_t child = 2; child < stmt->children.size(); ++child){
+            if(uses_var(stmt->children[child], var))
+                return flow::used;
+        }
+        if(uses_var(stmt->children[0], var)
+        || flow_of(stmt->children[1], var) == flow::used)
+            return flow::used;
+        return flow::passes;
+    case TOK_IF: {
+        if(uses_var(stmt->children[0], var))
+            return flow::used;
+        flow then = flow_of(stmt->children[1], var);
+        flow other = stmt->children.size() == 3
+            ? flow_of(stmt->children[2], var) : flow::passes;
+        if(then == flow::used || other == flow::used)
+            return flow::used;
+        if(then == flow::killed && other == flow::killed)
+            return flow::killed;
+        return flow::passes;
+    }
+    case TOK_RETURN:
+        return uses_var(stmt, var) ? flow::used : flow::killed;
+    case TOK_VARDECL: {
+        if(uses_var(stmt->children[1], var))
+            return flow::used;
+        astree* typed = stmt->children[0];
+        return &typed->children.back()->symbl == var
+            ? flow::killed : flow::passes;
+    }
+    default:
+        if(stmt->tokenCode == '='
+        && stmt->children[0]->tokenCode == TOK_IDENT
+        && stmt->children[0]->symbl.decl == var){
+            return uses_var(stmt->children[1], var)
+                ? flow::used : flow::killed;
+        }
+        return uses_var(stmt, var) ? flow::used : flow::passes;
+    }
+}
+
+// Whether var may be read after the statement at path[level].
+static bool live_after(const vector<position>& path, size_t level,
+                       symbol* var){
+    astree* parent = path[level].parent;
+    if(parent->tokenCode == TOK_BLOCK){
+        for(size_t next = path[level].index + 1;
+            next < parent->children.size(); ++next){
+            flow after = flow_of(parent->children[next], var);
+            if(after != flow::passes)
+                return after == flow::used;
+        }
+    }
+    else if(parent->tokenCode == TOK_WHILE){
+        // back to the test, and around again or out
+        if(uses_var(parent->children[0], var)
+        || flow_of(parent->children[1], var) == flow::used)
+            return true;
+    }
+    if(level == 0)
+        return false;
+    return live_after(path, level - 1, var);
+}
+
+/************ linear function test replacement ************/
+
+// If the counter is left only to be compared with a loop constant,
+// compares a monotone temporary with its value at the bound instead,
+// and drops the counter.
+static bool replace_test(loop_info& info, const vector<position>& path){
+    symbol* var = info.iv->var;
+    astree* test = info.loop->children[0];
+    switch(test->tokenCode){
+    case TOK_EQ: case TOK_NE: case TOK_LT:
+    case TOK_LE: case TOK_GT: case TOK_GE:
+        break;
+    default:
+        return false;
+    }
+    if(test->children.size() != 2)
+        return false;
+    size_t side = 0;
+    while(side < 2 && !(test->children[side]->tokenCode == TOK_IDENT
+    && test->children[side]->symbl.decl == var))
+        ++side;
+    if(side == 2)
+        return false;
+    astree* bound = test->children[1 - side];
+    if(!loop_constant(bound, info.writes)
+    || uses_guarded(bound, info.guarded))
+        return false;
+
+    reduction* follower = nullptr;
+    for(auto& red : info.reductions){
+        if(red.monotone && !red.guarded){
+            follower = &red;
+            break;
+        }
+    }
+    if(follower == nullptr)
+        return false;
+    size_t uses = count_uses(test, var)
+        + count_uses(info.loop->children[1], var)
+        - count_uses(info.iv->increment, var);
+    if(uses != 1 || live_after(path, path.size() - 1, var))
+        return false;
+
+    astree* limit = copy_expr(follower->temp->children[1]);
+    substitute(limit, var, bound);
+    if(limit->tokenCode != TOK_INTCON){
+        astree* temp = make_temp("__iv" + to_string(++temp_counter), limit);
+        info.before->adopt(temp);
+        limit = temp_use(temp, bound->lloc);
+    }
+    astree* counter = test->children[side];
+    const char* name = follower->temp->children[0]->children.back()
+        ->lexinfo->c_str();
+    optprintf(counter->lloc, "%s: counter %s replaced by %s and removed",
+              info.function.c_str(), counter->lexinfo->c_str(), name);
+    test->children[side] = temp_use(follower->temp, counter->lloc);
+    test->children[1 - side] = limit;
+    delete counter;
+    delete bound;
+    ++eliminated;
+    return true;
+}
+
+/********************* the pass *********************/
+
+static void strength_reduce(astree* loop, const vector<position>& path,
+                            const string& function){
+    astree* body = loop->children[1];
+    if(body->tokenCode != TOK_BLOCK || body->children.empty())
+        return;
+    // a loop left for cc's vectorizer keeps its counter
+    if(!loop->simd_pragma.empty())
+        return;
+
+    loop_info info;
+    info.loop = loop;
+    info.function = function;
+    effects_of(loop, info.writes);
+
+    // the counters are stepped by the statements ending the body
+    vector<basic_iv> ivs;
+    size_t first = body->children.size();
+    while(first > 0){
+        basic_iv iv;
+        if(!is_increment(body->children[first - 1], info, iv))
+            break;
+        bool again = false;
+        for(auto& other : ivs)
+            again |= other.var == iv.var;
+        if(again){
+            delete iv.step;
+            break;
+        }
+        ivs.push_back(iv);
+        info.increments.push_back(iv.increment);
+        --first;
+    }
+    if(ivs.empty())
+        return;
+
+    bool made = loop->children.size() == 2;
+    if(made){
+        loop->adopt(new astree(TOK_BLOCK, loop->lloc, "{"),
+                    new astree(TOK_BLOCK, loop->lloc, "{"));
+    }
+    info.before = loop->children[2];
+    info.guarded = loop->children[3];
+
+    vector<astree*> removed;
+    for(auto& iv : ivs){
+        info.iv = &iv;
+        info.reductions.clear();
+        reduce_uses(loop, 0, info);
+        reduce_uses(loop, 1, info);
+        if(removed.empty() && replace_test(info, path))
+            removed.push_back(iv.increment);
+    }
+
+    // the temporaries step just ahead of the counters
+    body->children.insert(body->children.begin() + first,
+                          info.updates.begin(), info.updates.end());
+    for(auto stmt : removed){
+        for(auto it = body->children.begin();
+            it != body->children.end(); ++it){
+            if(*it == stmt){
+                body->children.erase(it);
+                break;
+            }
+        }
+        delete stmt;
+    }
+    for(auto& iv : ivs)
+        delete iv.step;
+
+    if(made && info.before->children.empty()
+    && info.guarded->children.empty()){
+        delete loop->children[3];
+        delete loop->children[2];
+        loop->children.resize(2);
+    }
+}
+
+// outer loops first, so their counters are settled before the
+// loops inside them are looked at
+static void walk(astree* node, vector<position>& path,
+                 const string& function){
+    for(size_t index = 0; index < node->children.size(); ++index){
+        astree* child = node->children[index];
+        path.push_back({node, index});
+        if(child->tokenCode == TOK_WHILE && child->children.size() >= 2)
+            strength_reduce(child, path, function);
+        walk(child, path, function);
+        path.pop_back();
+    }
+}
+
+void induction_variables(astree* root){
+    summarize_functions(root);
+    size_t reduced_before = reduced;
+    size_t eliminated_before = eliminated;
+    for(auto child : root->children){
+        if(child->tokenCode != TOK_FUNCTION
+        || child->children.size() != 3) continue;
+        string name = *child->children[0]->children.back()->lexinfo;
+        vector<position> path;
+        walk(child->children[2], path, name);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "iv: %zu expressions strength-reduced,"
+                " %zu counters removed\n", reduced - reduced_before,
+                eliminated - eliminated_before);
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef __INDUCTION_H__
+#define __INDUCTION_H__
+
+#include "astree.h"
+
+// Finds the counters of while loops and strength-reduces what is
+// computed from them: products become running sums, and array
+// elements are reached through pointers stepped with the counter.
+// A counter left with nothing to count but the loop test is
+// replaced in the test and removed.
+void induction_variables (astree* root);
+
+#endif
@@ -0,0 +1,634 @@
+#include <unordered_set>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "inliner.h"
+#include "opt.h"
+#include "profile.h"
+
+// Copies of bodies that call further are expanded this deep at most.
+static const size_t inline_depth_limit = 4;
+
+static size_t inline_counter = 0;
+static size_t inlined = 0;
+static size_t not_inlined = 0;
+
+// A function with a body, and what copying it takes.
+struct callee {
+    astree* function;
+    size_t size;          // nodes in the body
+    bool expression;      // the body is "return value;"
+    const char* problem;  // why the body cannot be expanded, or null
+};
+
+static unordered_map<string, callee> callees;
+
+// Calls already reported as left alone.
+static unordered_set<astree*> rejected;
+
+// The function being inlined into.
+struct context {
+    string caller;
+    vector<string> chain;   // functions being expanded, caller first
+    vector<astree*> decls;  // locals the copies add to the caller
+    size_t loops;           // while loops around the statement
+};
+
+// Where a node sits: parent->children[index].
+struct site {
+    astree* parent;
+    size_t index;
+};
+
+/********************* helpers **********************/
+
+static astree* declid(astree* decl){
+    if(decl->tokenCode == TOK_ARRAY)
+        return decl->children[1];
+    return decl->children[0];
+}
+
+static astree* temp_declid(astree* temp){
+    return temp->children[0]->children.back();
+}
+
+static size_t tree_size(astree* node){
+    size_t size = 1;
+    for(auto child : node->children)
+        size += tree_size(child);
+    return size;
+}
+
+static size_t count_tokens(astree* node, int token){
+    size_t count = node->tokenCode == token;
+    for(auto child : node->children)
+        count += count_tokens(child, token);
+    return count;
+}
+
+static bool contains(astree* node, int token){
+    return count_tokens(node, token) > 0;
+}
+
+static const callee* lookup(astree* call){
+    symbol* decl = call->children[0]->symbl.decl;
+    if(decl == nullptr)
+        return nullptr;
+    auto found = callees.find(decl->oil_name);
+    return found == callees.end() ? nullptr : &found->second;
+}
+
+static const char* callee_name(astree* call){
+    return call->children[0]->lexinfo->c_str();
+}
+
+static astree* assign(astree* temp, astree* value){
+    astree* store = new astree('=', value->lloc, "=");
+    return store->adopt(temp_use(temp, value->lloc), value);
+}
+
+// A new local of the caller, typed like type and zeroed at entry.
+static astree* make_local(const string& name, const symbol& type,
+                          const location& lloc, context& ctx){
+    astree* temp = make_temp(name, make_zero(type, lloc));
+    ctx.decls.push_back(temp);
+    return temp;
+}
+
+// An argument that may be copied to each use of its param.
+static bool trivial(astree* arg){
+    switch(arg->tokenCode){
+    case TOK_INTCON:
+    case TOK_CHARCON:
+    case TOK_STRINGCON:
+    case TOK_NULL:
+        return true;
+    case TOK_IDENT:
+        // the callee cannot change the caller's locals
+        return arg->symbl.decl != nullptr
+            && (has_attr(*arg->symbl.decl, attr::LOCAL)
+                || has_attr(*arg->symbl.decl, attr::PARAM));
+    default:
+        return false;
+    }
+}
+
+// A null argument whose param is selected from: copied to the
+// selector, it would leave the oil no struct type to select from.
+static bool null_selected(astree* arg, astree* node, symbol* var){
+    if(arg->tokenCode != TOK_NULL)
+        return false;
+    if((node->tokenCode == '.' || node->tokenCode == '[')
+    && node->children[0]->tokenCode == TOK_IDENT
+    && node->children[0]->symbl.decl == var)
+        return true;
+    for(auto child : node->children){
+        if(null_selected(arg, child, var))
+            return true;
+    }
+    return false;
+}
+
+static bool is_stored(astree* node, symbol* var){
+    if(node->tokenCode == '=' && node->children[0]->tokenCode == TOK_IDENT
+    && node->children[0]->symbl.decl == var)
+        return true;
+    for(auto child : node->children){
+        if(is_stored(child, var))
+            return true;
+    }
+    return false;
+}
+
+// replaces each use of a param in args by a copy of its argument
+static void substitute(astree* node,
+                       const unordered_map<symbol*, astree*>& args){
+    for(auto& child : node->children){
+        auto found = child->tokenCode == TOK_IDENT
+            ? args.find(child->symbl.decl) : args.end();
+        if(found != args.end()){
+            delete child;
+            child = copy_expr(found->second);
+        }
+        else
+            substitute(child, args);
+    }
+}
+
+/********************* returns **********************/
+
+// Whether lower() can rewrite the returns among stmts: none may be
+// in a loop, and the statements after an if that returns on one
+// side only must not have to be copied into both.
+static bool lowerable(const vector<astree*>& stmts){
+    for(size_t next = 0; next < stmts.size(); ++next){
+        astree* stmt = stmts[next];
+        if(!contains(stmt, TOK_RETURN))
+            continue;
+        vector<astree*> rest(stmts.begin() + next + 1, stmts.end());
+        switch(stmt->tokenCode){
+        case TOK_RETURN:
+            return true;
+        case TOK_BLOCK: {
+            vector<astree*> inner(stmt->children);
+            inner.insert(inner.end(), rest.begin(), rest.end());
+            return lowerable(inner);
+        }
+        case TOK_IF: {
+            astree* then_part = stmt->children[1];
+            astree* else_part = stmt->children.size() == 3
+                ? stmt->children[2] : nullptr;
+            bool then_returns = always_returns(then_part);
+            bool else_returns = else_part != nullptr
+                && always_returns(else_part);
+            if(!then_returns && !else_returns && !rest.empty())
+                return false;
+            vector<astree*> then_list{then_part};
+            vector<astree*> else_list;
+            if(else_part != nullptr)
+                else_list.push_back(else_part);
+            if(then_returns && !else_returns)
+                else_list.insert(else_list.end(), rest.begin(), rest.end());
+            if(!then_returns && else_returns)
+                then_list.insert(then_list.end(), rest.begin(), rest.end());
+            return lowerable(then_list) && lowerable(else_list);
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adopts stmts into out with each return turned into a store to
+// result (or just its value, with no result).  What follows an if
+// that returns on one side moves into the other side.
+static void lower(const vector<astree*>& stmts, astree* result,
+                  astree* out){
+    for(size_t next = 0; next < stmts.size(); ++next){
+        astree* stmt = stmts[next];
+        if(!contains(stmt, TOK_RETURN)){
+            out->adopt(stmt);
+            continue;
+        }
+        vector<astree*> rest(stmts.begin() + next + 1, stmts.end());
+        switch(stmt->tokenCode){
+        case TOK_RETURN:
+            if(!stmt->children.empty()){
+                astree* value = stmt->children[0];
+                stmt->children.clear();
+                out->adopt(result == nullptr ? value : assign(result, value));
+            }
+            delete stmt;
+            for(auto dead : rest)
+                delete dead;
+            return;
+        case TOK_BLOCK: {
+            vector<astree*> inner(stmt->children);
+            stmt->children.clear();
+            delete stmt;
+            inner.insert(inner.end(), rest.begin(), rest.end());
+            lower(inner, result, out);
+            return;
+        }
+        default: {
+            astree* then_part = stmt->children[1];
+            astree* else_part = stmt->children.size() == 3
+                ? stmt->children[2] : nullptr;
+            bool then_returns = always_returns(then_part);
+            bool else_returns = else_part != nullptr
+                && always_returns(else_part);
+            vector<astree*> then_list{then_part};
+            vector<astree*> else_list;
+            if(else_part != nullptr)
+                else_list.push_back(else_part);
+            if(then_returns && else_returns){
+                for(auto dead : rest)
+                    delete dead;
+            }
+            else if(then_returns)
+                else_list.insert(else_list.end(), rest.begin(), rest.end());
+            else
+                then_list.insert(then_list.end(), rest.begin(), rest.end());
+
+            astree* then_block = new astree(TOK_BLOCK, stmt->lloc, "{");
+            astree* else_block = new astree(TOK_BLOCK, stmt->lloc, "{");
+            lower(then_list, result, then_block);
+            lower(else_list, result, else_block);
+            stmt->children.resize(1);
+            stmt->adopt(then_block, else_block);
+            out->adopt(stmt);
+            return;
+        }
+        }
+    }
+}
+
+/********************* copying **********************/
+
+// Binds the names of a copied body to the caller's new locals.
+static void rebind(astree* node,
+                   const unordered_map<symbol*, astree*>& renamed){
+    if(node->tokenCode == TOK_IDENT){
+        auto found = renamed.find(node->symbl.decl);
+        if(found != renamed.end())
+            node->symbl.decl = &temp_declid(found->second)->symbl;
+    }
+    for(auto child : node->children)
+        rebind(child, renamed);
+}
+
+// The statements doing what call does: its arguments stored into
+// the callee's params, then the callee's body with returns stored
+// into *result, if the value is wanted.  Takes the arguments.
+static astree* expand(astree* call, const callee& info, context& ctx,
+                      astree** result){
+    astree* function = info.function;
+    string serial = to_string(++inline_counter);
+    string prefix = "__inl" + serial + "_";
+    unordered_map<symbol*, astree*> renamed;
+    astree* block = new astree(TOK_BLOCK, call->lloc, "{");
+
+    // a param the body only reads takes a trivial argument as is
+    astree* params = function->children[1];
+    astree* body = function->children[2];
+    unordered_map<symbol*, astree*> args;
+    for(size_t param = 0; param < params->children.size(); ++param){
+        astree* id = declid(params->children[param]);
+        astree* arg = call->children[param + 1];
+        if(trivial(arg) && !is_stored(body, &id->symbl)
+        && !null_selected(arg, body, &id->symbl)){
+            args[&id->symbl] = arg;
+            continue;
+        }
+        astree* local = make_local(prefix + id->symbl.oil_name,
+                                   id->symbl, call->lloc, ctx);
+        renamed[&id->symbl] = local;
+        block->adopt(assign(local, arg));
+        call->children[param + 1] = nullptr;
+    }
+
+    astree* copies = new astree(TOK_BLOCK, call->lloc, "{");
+    for(auto stmt : body->children){
+        if(stmt->tokenCode == TOK_VARDECL){
+            astree* id = declid(stmt->children[0]);
+            astree* local = make_local(prefix + id->symbl.oil_name,
+                                       id->symbl, stmt->lloc, ctx);
+            renamed[&id->symbl] = local;
+            copies->adopt(assign(local, copy_expr(stmt->children[1])));
+        }
+        else
+            copies->adopt(copy_expr(stmt));
+    }
+    rebind(copies, renamed);
+    substitute(copies, args);
+    vector<astree*> stmts(copies->children);
+    copies->children.clear();
+    delete copies;
+    for(size_t arg = 1; arg < call->children.size(); ++arg)
+        delete call->children[arg];
+    call->children.resize(1);
+
+    astree* value = nullptr;
+    if(result != nullptr){
+        value = make_local("__inl" + serial, call->symbl, call->lloc, ctx);
+        *result = value;
+    }
+    lower(stmts, value, block);
+    return block;
+}
+
+/********************* decisions **********************/
+
+// Why a call of info may not be inlined here, or empty.
+static string refuse(const callee& info, const context& ctx){
+    const string& name = temp_declid(info.function)->symbl.oil_name;
+    for(auto& outer : ctx.chain){
+        if(outer == name)
+            return "recursive";
+    }
+    if(ctx.chain.size() > inline_depth_limit)
+        return "nested too deep";
+    // a call in a loop is worth twice the code, and one of a
+    // function the profile found hot four times; a function it
+    // never saw called is not worth any
+    int heat = profile_heat(info.function);
+    if(heat < 0)
+        return "never called in the profile";
+    size_t budget = opt::inline_limit * (ctx.loops > 0 ? 2 : 1)
+        * (heat > 0 ? 4 : 1);
+    if(info.size > budget){
+        return "too big (" + to_string(info.size) + " > "
+            + to_string(budget) + ")";
+    }
+    return "";
+}
+
+static void reject(astree* call, const context& ctx, const string& why){
+    if(!rejected.insert(call).second)
+        return;
+    ++not_inlined;
+    optprintf(call->lloc, "%s: %s not inlined: %s", ctx.caller.c_str(),
+              callee_name(call), why.c_str());
+}
+
+static void report(astree* call, const callee& info, const context& ctx){
+    ++inlined;
+    optprintf(call->lloc, "%s: %s inlined (%zu nodes)", ctx.caller.c_str(),
+              callee_name(call), info.size);
+}
+
+// Reports the calls under parent->children[index] left alone.
+static void reject_rest(astree* parent, size_t index, const context& ctx,
+                        const char* why){
+    astree* node = parent->children[index];
+    for(size_t child = 0; child < node->children.size(); ++child)
+        reject_rest(node, child, ctx, why);
+    if(node->tokenCode == TOK_CALL && lookup(node) != nullptr)
+        reject(node, ctx, why);
+}
+
+/****************** expression bodies *******************/
+
+static size_t count_uses(astree* node, symbol* var){
+    size_t uses = node->tokenCode == TOK_IDENT && node->symbl.decl == var;
+    for(auto child : node->children)
+        uses += count_uses(child, var);
+    return uses;
+}
+
+// Whether substituting the arguments for the params keeps each
+// evaluated once and in an order C would allow.
+static bool substitutable(astree* call, const callee& info){
+    astree* value = info.function->children[2]->children[0]->children[0];
+    astree* params = info.function->children[1];
+    bool calls = contains(value, TOK_CALL);
+    for(size_t param = 0; param < params->children.size(); ++param){
+        astree* arg = call->children[param + 1];
+        symbol* var = &declid(params->children[param])->symbl;
+        if(null_selected(arg, value, var))
+            return false;
+        if(trivial(arg))
+            continue;
+        if(calls || !pure(arg) || count_uses(value, var) > 1)
+            return false;
+    }
+    return true;
+}
+
+// Replaces calls of functions whose body is one return by that
+// value with the arguments substituted, innermost first.
+static void inline_expressions(astree* parent, size_t index,
+                               context& ctx){
+    astree* node = parent->children[index];
+    for(size_t child = 0; child < node->children.size(); ++child)
+        inline_expressions(node, child, ctx);
+    if(node->tokenCode != TOK_CALL)
+        return;
+    const callee* info = lookup(node);
+    if(info == nullptr || !info->expression)
+        return;
+    string why = refuse(*info, ctx);
+    if(!why.empty()){
+        reject(node, ctx, why);
+        return;
+    }
+    if(!substitutable(node, *info))
+        return;
+
+    astree* params = info->function->children[1];
+    unordered_map<symbol*, astree*> args;
+    for(size_t param = 0; param < params->children.size(); ++param)
+        args[&declid(params->children[param])->symbl] = node->children[param + 1];
+    astree* body = info->function->children[2];
+    astree* wrapper = new astree(TOK_BLOCK, node->lloc, "{");
+    wrapper->adopt(copy_expr(body->children[0]->children[0]));
+    substitute(wrapper, args);
+    parent->children[index] = wrapper->children[0];
+    wrapper->children.clear();
+    delete wrapper;
+    report(node, *info, ctx);
+    delete node;
+
+    ctx.chain.push_back(temp_declid(info->function)->symbl.oil_name);
+    inline_expressions(parent, index, ctx);
+    ctx.chain.pop_back();
+}
+
+/****************** statement bodies *******************/
+
+// the calls under parent->children[index], in the order they run
+static void collect_calls(astree* parent, size_t index,
+                          vector<site>& calls){
+    astree* node = parent->children[index];
+    for(size_t child = 0; child < node->children.size(); ++child)
+        collect_calls(node, child, calls);
+    if(node->tokenCode == TOK_CALL)
+        calls.push_back({parent, index});
+}
+
+// The first call under parent->children[index] that may be expanded
+// ahead of its statement.  The calls run left to right, innermost
+// first; one may go ahead only if every call before it is among its
+// own arguments and goes along.
+static const callee* pick(astree* parent, size_t index, context& ctx,
+                          site& chosen){
+    vector<site> calls;
+    collect_calls(parent, index, calls);
+    for(size_t before = 0; before < calls.size(); ++before){
+        astree* call = calls[before].parent->children[calls[before].index];
+        if(count_tokens(call, TOK_CALL) != before + 1)
+            continue;
+        const callee* info = lookup(call);
+        if(info == nullptr || rejected.count(call))
+            continue;
+        string why = refuse(*info, ctx);
+        if(why.empty() && info->problem != nullptr)
+            why = info->problem;
+        if(!why.empty()){
+            reject(call, ctx, why);
+            continue;
+        }
+        chosen = calls[before];
+        return info;
+    }
+    return nullptr;
+}
+
+static size_t inline_statement(astree* parent, size_t index,
+                               context& ctx);
+
+// Inlines the calls in the expression at rparent->children[rindex]
+// of the statement at parent->children[index].  Expanded bodies go
+// just ahead of the statement; returns how many were put into
+// parent there.
+static size_t inline_site(astree* parent, size_t index,
+                          astree* rparent, size_t rindex, context& ctx){
+    bool whole = rparent == parent;
+    bool wrapped = false;
+    size_t inserted = 0;
+    inline_expressions(rparent, rindex, ctx);
+    for(;;){
+        site chosen;
+        const callee* info = pick(rparent, rindex, ctx, chosen);
+        if(info == nullptr)
+            break;
+        astree* call = chosen.parent->children[chosen.index];
+        string name = temp_declid(info->function)->symbl.oil_name;
+        report(call, *info, ctx);
+
+        // a call made for its effect is replaced outright
+        if(whole && chosen.parent == parent){
+            parent->children[index] = expand(call, *info, ctx, nullptr);
+            delete call;
+            ctx.chain.push_back(name);
+            inline_statement(parent, index, ctx);
+            ctx.chain.pop_back();
+            return inserted;
+        }
+
+        astree* result = nullptr;
+        astree* block = expand(call, *info, ctx, &result);
+        chosen.parent->children[chosen.index] = temp_use(result, call->lloc);
+        delete call;
+        if(parent->tokenCode != TOK_BLOCK){
+            astree* wrapper = new astree(TOK_BLOCK, block->lloc, "{");
+            wrapper->adopt(parent->children[index]);
+            parent->children[index] = wrapper;
+            parent = wrapper;
+            index = 0;
+            wrapped = true;
+        }
+        parent->children.insert(parent->children.begin() + index, block);
+        ctx.chain.push_back(name);
+        inline_statement(parent, index, ctx);
+        ctx.chain.pop_back();
+        ++index;
+        if(!wrapped)
+            ++inserted;
+        if(whole){
+            rparent = parent;
+            rindex = index;
+        }
+    }
+    reject_rest(rparent, rindex, ctx, "would run ahead of an earlier call");
+    return inserted;
+}
+
+// Inlines the calls made by the statement at parent->children[index].
+// Returns how many statements were put into parent ahead of it.
+static size_t inline_statement(astree* parent, size_t index,
+                               context& ctx){
+    astree* stmt = parent->children[index];
+    switch(stmt->tokenCode){
+    case TOK_BLOCK:
+        for(size_t child = 0; child < stmt->children.size(); ++child)
+            child += inline_statement(stmt, child, ctx);
+        return 0;
+    case TOK_WHILE:
+        // the test runs each time around, so only values substitute
+        inline_expressions(stmt, 0, ctx);
+        reject_rest(stmt, 0, ctx, "in a loop test");
+        ++ctx.loops;
+        inline_statement(stmt, 1, ctx);
+        --ctx.loops;
+        return 0;
+    case TOK_IF: {
+        size_t inserted = inline_site(parent, index, stmt, 0, ctx);
+        for(size_t child = 1; child < stmt->children.size(); ++child)
+            inline_statement(stmt, child, ctx);
+        return inserted;
+    }
+    case TOK_VARDECL:
+        return inline_site(parent, index, stmt, 1, ctx);
+    case TOK_RETURN:
+        if(stmt->children.empty())
+            return 0;
+        return inline_site(parent, index, stmt, 0, ctx);
+    default:
+        return inline_site(parent, index, parent, index, ctx);
+    }
+}
+
+/********************* the pass *********************/
+
+void inline_calls(astree* root){
+    callees.clear();
+    rejected.clear();
+    for(auto function : root->children){
+        if(function->tokenCode != TOK_FUNCTION
+        || function->children.size() != 3) continue;
+        astree* body = function->children[2];
+        callee info;
+        info.function = function;
+        info.size = tree_size(body);
+        info.expression = body->children.size() == 1
+            && body->children[0]->tokenCode == TOK_RETURN
+            && !body->children[0]->children.empty()
+            && !contains(body->children[0], '=');
+        info.problem = lowerable(body->children) ? nullptr
+            : "returns from a loop or from one side of an if";
+        callees[temp_declid(function)->symbl.oil_name] = info;
+    }
+
+    size_t inlined_before = inlined;
+    size_t not_inlined_before = not_inlined;
+    for(auto function : root->children){
+        if(function->tokenCode != TOK_FUNCTION
+        || function->children.size() != 3) continue;
+        context ctx;
+        ctx.caller = *temp_declid(function)->lexinfo;
+        ctx.chain.push_back(temp_declid(function)->symbl.oil_name);
+        ctx.loops = 0;
+        astree* body = function->children[2];
+        for(size_t index = 0; index < body->children.size(); ++index)
+            index += inline_statement(body, index, ctx);
+        body->children.insert(body->children.begin(),
+                              ctx.decls.begin(), ctx.decls.end());
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "inline: %zu of %zu calls inlined\n",
+                inlined - inlined_before,
+                inlined - inlined_before + not_inlined - not_inlined_before);
+    }
+}
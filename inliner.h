@@ -0,0 +1,12 @@
+#ifndef __INLINER_H__
+#define __INLINER_H__
+
+#include "astree.h"
+
+// Replaces calls of small oc functions by copies of their bodies.
+// A body that is one return is substituted into the expression;
+// others are expanded ahead of the statement making the call, with
+// their params and locals renamed into the caller.
+void inline_calls (astree* root);
+
+#endif
@@ -0,0 +1,161 @@
+#include <algorithm>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "layout.h"
+#include "opt.h"
+#include "profile.h"
+
+// The profile says nothing of a struct whose hottest field has
+// fewer uses than this.
+static const unsigned long least_uses = 16;
+
+// A field is cold if its uses are fewer than one in this many of
+// the hottest field's.
+static const unsigned long cold_ratio = 20;
+
+// The uses of a field estimated from the profile: the runs of the
+// counted site around each select, and whether every one of them
+// was in the profile.
+struct field_uses {
+    unsigned long count = 0;
+    bool known = true;
+};
+
+static unordered_map<symbol*, field_uses> uses;
+static size_t structs_smaller = 0;
+
+/********************* helpers **********************/
+
+static astree* declid(astree* decl){
+    if(decl->tokenCode == TOK_ARRAY)
+        return decl->children[1];
+    return decl->children[0];
+}
+
+// size and alignment of a field in the oil, on LP64
+static size_t field_size(astree* decl){
+    switch(decl->tokenCode){
+    case TOK_INT:
+        return 4;
+    case TOK_CHAR:
+        return 1;
+    default:
+        return 8;
+    }
+}
+
+static size_t padded(size_t offset, size_t align){
+    return (offset + align - 1) / align * align;
+}
+
+// sizeof the struct of fields, after links more pointers
+static size_t struct_size(const vector<astree*>& fields, size_t links){
+    size_t offset = links * 8;
+    size_t align = links > 0 ? 8 : 1;
+    for(auto field : fields){
+        size_t size = field_size(field);
+        offset = padded(offset, size) + size;
+        align = max(align, size);
+    }
+    return padded(offset, align);
+}
+
+// runs of the site at node, or -1 if the profile does not have it
+static long site_runs(const char* kind, astree* node){
+    unsigned long count;
+    if(!profile_count(kind, node->lloc, count))
+        return -1;
+    return count;
+}
+
+/********************* field uses *********************/
+
+// runs: of the innermost counted site around node, or -1
+static void count_uses(astree* node, long runs){
+    if(node->tokenCode == '.' && node->symbl.decl != nullptr){
+        field_uses& field = uses[node->symbl.decl];
+        if(runs < 0)
+            field.known = false;
+        else
+            field.count += runs;
+    }
+    for(size_t index = 0; index < node->children.size(); ++index){
+        long inner = runs;
+        if(node->tokenCode == TOK_WHILE && index == 1)
+            inner = site_runs("iterate", node);
+        else if(node->tokenCode == TOK_IF && index == 1)
+            inner = site_runs("then", node);
+        else if(node->tokenCode == TOK_IF && index == 2)
+            inner = site_runs("else", node);
+        count_uses(node->children[index], inner);
+    }
+}
+
+/********************* the pass *********************/
+
+static bool wider(astree* a, astree* b){
+    return field_size(a) > field_size(b);
+}
+
+static void lay_out(astree* node){
+    const string& name = *node->children[0]->lexinfo;
+    vector<astree*>& fields = node->children[1]->children;
+    size_t before = struct_size(fields, 0);
+    stable_sort(fields.begin(), fields.end(), wider);
+    size_t after = struct_size(fields, 0);
+
+    unsigned long hottest = 0;
+    for(auto field : fields){
+        field_uses& field_use = uses[&declid(field)->symbl];
+        if(field_use.known)
+            hottest = max(hottest, field_use.count);
+    }
+    vector<astree*> hot;
+    vector<astree*> cold;
+    string names;
+    for(auto field : fields){
+        field_uses& field_use = uses[&declid(field)->symbl];
+        if(hottest >= least_uses && field_use.known
+        && field_use.count * cold_ratio < hottest){
+            cold.push_back(field);
+            names += (names.empty() ? "" : ", ") + *declid(field)->lexinfo;
+        }
+        else
+            hot.push_back(field);
+    }
+
+    // the cold part has to make the hot one smaller, link and all
+    if(cold.empty() || hot.empty() || struct_size(hot, 1) >= after){
+        if(after < before)
+            ++structs_smaller;
+        optprintf(node->lloc, "struct %s: %zu -> %zu bytes", name.c_str(),
+                  before, after);
+        return;
+    }
+    fields = hot;
+    astree* side = new astree(TOK_FIELD, node->lloc, "{");
+    side->children = cold;
+    node->adopt(side);
+    ++structs_smaller;
+    optprintf(node->lloc, "struct %s: %zu -> %zu bytes, %zu cold in "
+              "struct %s__cold: %s", name.c_str(), before,
+              struct_size(hot, 1), struct_size(cold, 0), name.c_str(),
+              names.c_str());
+}
+
+void layout_structs(astree* root){
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_FUNCTION && child->children.size() == 3)
+            count_uses(child->children[2], site_runs("fn", child));
+    }
+    size_t before = structs_smaller;
+    for(auto child : root->children){
+        if(child->tokenCode == TOK_STRUCT && child->children.size() == 2)
+            lay_out(child);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "layout: %zu structs made smaller\n",
+                structs_smaller - before);
+    }
+}
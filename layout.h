@@ -0,0 +1,13 @@
+#ifndef __LAYOUT_H__
+#define __LAYOUT_H__
+
+#include "astree.h"
+
+// Orders the fields of each struct by alignment, widest first, so
+// that cc pads them as little as it can.  With a profile from
+// --profile-use, fields the hot paths rarely select move into a
+// second, cold struct (as a third child of the TOK_STRUCT) that the
+// emitter allocates alongside and reaches through a pointer.
+void layout_structs (astree* root);
+
+#endif
@@ -0,0 +1,149 @@
+#include "lyutils.h"
+#include "astree.h"
+#include "licm.h"
+#include "opt.h"
+
+static size_t temp_counter = 0;
+
+// An invariant expression found at parent->children[index].
+// Guarded ones may trap, and are computed only once the body is
+// known to run.
+struct candidate {
+    astree* parent;
+    size_t index;
+    bool guarded;
+};
+
+/********************* candidates *********************/
+
+static bool uses_variable(astree* node){
+    if(node->tokenCode == TOK_IDENT)
+        return true;
+    for(auto child : node->children){
+        if(uses_variable(child))
+            return true;
+    }
+    return false;
+}
+
+// statements after this one might not run
+static bool may_leave(astree* node){
+    if(node->tokenCode == TOK_RETURN)
+        return true;
+    if(node->tokenCode == TOK_CALL && !node->children.empty()
+    && *node->children[0]->lexinfo == "exit")
+        return true;
+    for(auto child : node->children){
+        if(may_leave(child))
+            return true;
+    }
+    return false;
+}
+
+// Finds the largest invariant subexpressions under
+// parent->children[index].  anticipated: the node is evaluated
+// whenever the loop body runs, so a load there may be hoisted.
+static void collect(astree* parent, size_t index, bool anticipated,
+                    bool in_body, const effects& loop,
+                    vector<candidate>& found){
+    astree* node = parent->children[index];
+    if(!node->children.empty() && invariant(node, loop)
+    && uses_variable(node)){
+        bool trap = may_trap(node);
+        if(!trap || anticipated){
+            found.push_back({parent, index, trap && in_body});
+            return;
+        }
+    }
+
+    switch(node->tokenCode){
+    case '=': {
+        // a stored-to field or element is not a load, its base is
+        astree* target = node->children[0];
+        if(target->tokenCode == '.' || target->tokenCode == '['){
+            for(size_t child = 0; child < target->children.size(); ++child)
+                collect(target, child, anticipated, in_body, loop, found);
+        }
+        collect(node, 1, anticipated, in_body, loop, found);
+        break;
+    }
+    case TOK_WHILE:
+    case TOK_IF:
+        collect(node, 0, anticipated, in_body, loop, found);
+        for(size_t child = 1; child < node->children.size(); ++child)
+            collect(node, child, false, in_body, loop, found);
+        break;
+    case TOK_BLOCK:
+        for(size_t child = 0; child < node->children.size(); ++child){
+            collect(node, child, anticipated, in_body, loop, found);
+            if(may_leave(node->children[child]))
+                anticipated = false;
+        }
+        break;
+    default:
+        for(size_t child = 0; child < node->children.size(); ++child)
+            collect(node, child, anticipated, in_body, loop, found);
+        break;
+    }
+}
+
+/********************* hoisting *********************/
+
+static void hoist(astree* loop, const string& function){
+    effects loop_effects;
+    effects_of(loop, loop_effects);
+
+    vector<candidate> found;
+    collect(loop, 0, true, false, loop_effects, found);
+    collect(loop, 1, true, true, loop_effects, found);
+    if(found.empty()) return;
+
+    astree* before = new astree(TOK_BLOCK, loop->lloc, "{");
+    astree* guarded = new astree(TOK_BLOCK, loop->lloc, "{");
+    for(auto& cand : found){
+        astree* expr = cand.parent->children[cand.index];
+        astree* temp = nullptr;
+        for(auto block : {before, guarded}){
+            for(auto decl : block->children){
+                if(same_expr(decl->children[1], expr))
+                    temp = decl;
+            }
+        }
+        if(temp != nullptr){
+            cand.parent->children[cand.index] = temp_use(temp, expr->lloc);
+            delete expr;
+            continue;
+        }
+        string name = "__licm" + to_string(++temp_counter);
+        temp = make_temp(name, expr);
+        (cand.guarded ? guarded : before)->adopt(temp);
+        cand.parent->children[cand.index] = temp_use(temp, expr->lloc);
+        optprintf(expr->lloc, "%s: hoisted out of the loop at %zu.%zu"
+                  " as %s", function.c_str(), loop->lloc.linenr,
+                  loop->lloc.offset, name.c_str());
+    }
+    loop->adopt(before, guarded);
+}
+
+// outer loops first, so an invariant goes out as far as it can
+static void walk(astree* node, const string& function){
+    if(node->tokenCode == TOK_WHILE && node->children.size() == 2)
+        hoist(node, function);
+    for(auto child : node->children)
+        walk(child, function);
+}
+
+void licm(astree* root){
+    summarize_functions(root);
+    size_t before = temp_counter;
+    for(auto child : root->children){
+        if(child->tokenCode != TOK_FUNCTION
+        || child->children.size() != 3) continue;
+        string name = *child->children[0]->children.back()->lexinfo;
+        walk(child->children[2], name);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "licm: %zu expressions hoisted\n",
+                temp_counter - before);
+    }
+}
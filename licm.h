@@ -0,0 +1,10 @@
+#ifndef __LICM_H__
+#define __LICM_H__
+
+#include "astree.h"
+
+// Hoists pure loop-invariant expressions out of while loops into
+// temporaries computed once before the loop.
+void licm (astree* root);
+
+#endif
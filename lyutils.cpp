@@ -10,17 +10,27 @@
 #include "lyutils.h"
 
 bool lexer::interactive = true;
-location lexer::lloc = {0, 1, 0, 0};
-size_t lexer::last_yyleng = 0;
+thread_local location lexer::lloc = {0, 1, 0, 0};
+thread_local size_t lexer::last_yyleng = 0;
 vector<string> lexer::filenames;
 
+// When set, the scanner's tokens, diagnostics and file names go to
+// it as text, for another thread to make into nodes and messages.
+// It sets lloc.filenr for a FILENAME.
+void (*lexer::pass) (int symbol, const char* text) = nullptr;
+
 astree* parser::root = nullptr;
+void (*parser::declaration) (astree* decl) = nullptr;
 
 const string* lexer::filename (int filenr) {
    return &lexer::filenames.at(filenr);
 }
 
 void lexer::newfilename (const string& filename) {
+   if (pass != nullptr) {
+      pass (FILENAME, filename.c_str());
+      return;
+   }
    lexer::lloc.filenr = lexer::filenames.size();
    lexer::filenames.push_back (filename);
 }
@@ -42,17 +52,26 @@ void lexer::newline() {
    lexer::lloc.offset = 0;
 }
 
+static void lexer_error (const char* format, const char* arg) {
+   if (lexer::pass == nullptr) {
+      errllocprintf (lexer::lloc, format, arg);
+      return;
+   }
+   char buffer[0x1000];
+   snprintf (buffer, sizeof buffer, format, arg);
+   lexer::pass (lexer::ERROR, buffer);
+}
+
 void lexer::badchar (unsigned char bad) {
    char buffer[16];
    snprintf (buffer, sizeof buffer,
              isgraph (bad) ? "%c" : "\\%03o", bad);
-   errllocprintf (lexer::lloc, "invalid source character (%s)\n",
-                  buffer);
+   lexer_error ("invalid source character (%s)\n", buffer);
 }
 
 
 void lexer::badtoken (char* lexeme) {
-   errllocprintf (lexer::lloc, "invalid token (%s)\n", lexeme);
+   lexer_error ("invalid token (%s)\n", lexeme);
 }
 
 void lexer::include() {
@@ -62,7 +81,13 @@ void lexer::include() {
    int scan_rc = sscanf (yytext
         , "# %zd \"%[^\"]\"", &linenr, filename);
    if (scan_rc != 2) {
-      errprintf ("%s: invalid directive, ignored\n", yytext);
+      if (pass == nullptr) {
+         errprintf ("%s: invalid directive, ignored\n", yytext);
+      }else {
+         string message = string (yytext) + ": invalid directive,"
+                        + " ignored\n";
+         pass (MESSAGE, message.c_str());
+      }
    }else {
       if (yy_flex_debug) {
          fprintf (stderr, "--included # %zd \"%s\"\n",
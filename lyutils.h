@@ -31,9 +31,11 @@ int yyparse();
 void yyerror (const char* message);
 
 struct lexer {
+   enum { ERROR = -1, MESSAGE = -2, FILENAME = -3 };
    static bool interactive;
-   static location lloc;
-   static size_t last_yyleng;
+   static thread_local location lloc;
+   static thread_local size_t last_yyleng;
+   static void (*pass) (int symbol, const char* text);
    static vector<string> filenames;
    static const string* filename (int filenr);
    static void newfilename (const string& filename);
@@ -42,11 +44,14 @@ struct lexer {
    static void badchar (unsigned char bad);
    static void badtoken (char* lexeme);
    static void include();
+   static int scan();
 };
 
 struct parser {
    static astree* root;
+   static void (*declaration) (astree* decl);
    static const char* get_tname (int symbol);
+   static astree* take (astree* program, astree* decl);
 };
 
 #define YYSTYPE_IS_DECLARED
@@ -7,18 +7,27 @@
 #include <vector>
 #include <assert.h>
 #include <errno.h>
+#include <getopt.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lyutils.h"
 #include "astree.h"
 #include "auxlib.h"
 #include "string_set.h"
+#include "build.h"
 #include "emit.h"
+#include "incremental.h"
+#include "module.h"
+#include "opt.h"
+#include "profile.h"
+#include "scan.h"
+#include "stream.h"
 
 using namespace std;
 
@@ -28,15 +37,49 @@ string cpp_command;
 FILE *tokenFile;
 FILE* symfile;
 FILE* oilfile;
+FILE* protofile;
+FILE* astfile;
 
 string Dstring{};
+string source{};
 string program{};
 
-void cpp_popen (const char* filename) {
-   cpp_command = CPP 
+// --module: the options it was given, for its manifest
+string module_flags{};
+
+// -t: print the wall time of each phase to stderr
+bool report_times = false;
+struct timespec phase_start;
+
+// -j: how many chunks to scan at once, or modules to build
+int jobs = 0;
+
+// --pipeline: scan on a thread of its own
+bool pipeline = false;
+
+void phase_begin() {
+   clock_gettime (CLOCK_MONOTONIC, &phase_start);
+}
+
+void phase_end (const char* phase) {
+   if (not report_times) return;
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   double seconds = (now.tv_sec - phase_start.tv_sec)
+                  + (now.tv_nsec - phase_start.tv_nsec) / 1e9;
+   fprintf (stderr, "time %s %.6f\n", phase, seconds);
+}
+
+// The cpp command up to the file name, the same for every compile.
+string cpp_prefix() {
+   return CPP 
     + " -D__OCLIB_H__ "
     + " -D__OCLIB_OH__ "
-     + filename;
+    + Dstring;
+}
+
+void cpp_popen (const char* filename) {
+   cpp_command = cpp_prefix() + filename;
    yyin = popen (cpp_command.c_str(), "r");
    if (yyin == nullptr) {
       syserrprintf (cpp_command.c_str());
@@ -57,77 +100,243 @@ void cpp_pclose() {
    if (pclose_rc != 0) exec::exit_status = EXIT_FAILURE;
 }
 
+// long options with no short form
+enum { OPT_GC = 256, OPT_INSTRUMENT, OPT_PROFILE_USE,
+       OPT_SIZED_STRINGS, OPT_MODULE, OPT_BUILD, OPT_INCREMENTAL,
+       OPT_STREAM, OPT_PIPELINE };
+
+static const struct option long_opts[] = {
+   {"gc", no_argument, nullptr, OPT_GC},
+   {"instrument", no_argument, nullptr, OPT_INSTRUMENT},
+   {"profile-use", required_argument, nullptr, OPT_PROFILE_USE},
+   {"sized-strings", no_argument, nullptr, OPT_SIZED_STRINGS},
+   {"module", no_argument, nullptr, OPT_MODULE},
+   {"build", no_argument, nullptr, OPT_BUILD},
+   {"incremental", no_argument, nullptr, OPT_INCREMENTAL},
+   {"stream", no_argument, nullptr, OPT_STREAM},
+   {"pipeline", no_argument, nullptr, OPT_PIPELINE},
+   {nullptr, 0, nullptr, 0},
+};
+
+// The options before the file names that a module's build depends
+// on, leaving out the ones that choose what oc does with them.
+vector<string> build_options (int argc, char** argv) {
+   vector<string> options;
+   for (int index = 1; index < optind and index < argc; ++index) {
+      string option = argv[index];
+      if (option == "--module" or option == "--build") continue;
+      if (option.compare (0, 2, "-j") == 0) {
+         if (option == "-j") ++index;
+         continue;
+      }
+      options.push_back (option);
+   }
+   return options;
+}
+
 void scan_opts (int argc, char** argv) {
    opterr = 0;
+   bool instrument = false;
+   bool build = false;
+   bool incremental = false;
 
    yy_flex_debug = 0;
    yydebug = 0;
 
    for(;;)
    {
-      int opt = getopt (argc, argv, "@:D:ly");
+      int opt = getopt_long (argc, argv, "@:D:Of:j:lty", long_opts,
+                             nullptr);
       if (opt == EOF) break;
       switch (opt)
       {
+         case OPT_GC: oil_gc = true;          break;
+         case OPT_INSTRUMENT: instrument = true; break;
+         case OPT_PROFILE_USE:
+            if (not profile_load (optarg)) syserrprintf (optarg);
+            break;
+         case OPT_SIZED_STRINGS: oil_sized_strings = true; break;
+         case OPT_MODULE: oil_module = true;  break;
+         case OPT_BUILD: build = true;        break;
+         case OPT_INCREMENTAL: incremental = true; break;
+         case OPT_STREAM: oil_stream = true;  break;
+         case OPT_PIPELINE: pipeline = true;  break;
          case '@': set_debugflags (optarg);   break;
-         case 'D': Dstring = "-D" + string(optarg);  break;
+         case 'D': Dstring += "-D" + string(optarg) + " "; break;
+         case 'O': opt::all (true);           break;
+         case 'f':
+            if (not opt::set (optarg)) {
+               errprintf ("unknown pass (-f%s)\n", optarg);
+            }
+            break;
+         case 'j': jobs = atoi (optarg);      break;
          case 'l': yy_flex_debug = 1;         break;
+         case 't': report_times = true;       break;
          case 'y': yydebug = 1;               break;
          default:  errprintf ("bad option (%c)\n", optopt); break;
       }
    }
    if (optind > argc) {
-      errprintf ("Usage: %s [-ly] [filename]\n"
-      , exec::execname.c_str());
+      errprintf ("Usage: %s [-Olty] [-j jobs] [-f[no-]pass] [--gc]"
+                 " [--instrument]"
+                 " [--profile-use=file] [--sized-strings] [--module]"
+                 " [--incremental] [--stream] [--pipeline] [filename]\n"
+                 "       %s --build [-j jobs] [options] module.oc...\n",
+                 exec::execname.c_str(), exec::execname.c_str());
       exit (exec::exit_status);
    }
 
+   if (build) {
+      vector<string> sources (argv + optind, argv + argc);
+      exit (build_modules (argv[0], sources, build_options (argc, argv),
+                           jobs));
+   }
+
    const char* filename = optind == argc ? "-" : argv[optind];
 
+   if (incremental) {
+      exit (incremental_session (filename, cpp_prefix(), Dstring));
+   }
+
+   source = string(filename);
    program = string(filename);
    program = program.substr(0, program.find_last_of('.'));
 
+   // the counts are per function, so calls must stay calls
+   if (instrument) {
+      oil_profile = program + ".prof";
+      opt::inliner = false;
+   }
+
+   // other modules see the structs as their sources declare them, so
+   // no module may lay them out its own way; a failed build must not
+   // leave a manifest that says it is current; its interface is
+   // written from the whole tree
+   if (oil_module) {
+      opt::layout = false;
+      oil_stream = false;
+      for (auto& option: build_options (argc, argv)) {
+         module_flags += (module_flags.empty() ? "" : " ") + option;
+      }
+      remove ((program + ".dep").c_str());
+   }
+
    cpp_popen (filename);
 }
 
+// --stream: every output file is open while the parse runs, and
+// each declaration goes through to the oil as it is reduced.
+int compile_stream() {
+   phase_begin();
+   string header = program.substr (program.find_last_of ('/') + 1)
+                 + ".oil.h";
+   tokenFile = fopen ((program + ".tok").c_str(), "w");
+   astfile = fopen ((program + ".ast").c_str(), "w");
+   symfile = fopen ((program + ".sym").c_str(), "w");
+   optfile = fopen ((program + ".opt").c_str(), "w");
+   oilfile = fopen ((program + ".oil").c_str(), "w");
+   protofile = fopen ((program + ".oil.h").c_str(), "w");
+   emit_begin (header);
+
+   parser::declaration = stream_declaration;
+   if (jobs > 1) scan_parallel (jobs);
+   else if (pipeline) scan_pipeline();
+   int parse_rc = yyparse();
+   scan_finish (report_times);
+   cpp_pclose();
+   yylex_destroy();
+   if (parse_rc) errprintf ("parse failed (%d)\n", parse_rc);
+   emit_end();
+   stream_finish();
+   if (parse_rc == 0) delete parser::root;
+
+   fclose (tokenFile);
+   fclose (astfile);
+   fclose (symfile);
+   fclose (optfile);
+   optfile = nullptr;
+   fclose (oilfile);
+   fclose (protofile);
+   FILE* stringSetFile = fopen ((program + ".str").c_str(), "w");
+   string_set::dump (stringSetFile);
+   fclose (stringSetFile);
+   phase_end ("stream");
+   return exec::exit_status;
+}
+
 int main(int argc, char** argv)
 {
     exec::execname = basename (argv[0]);
     scan_opts (argc, argv);
+    if (oil_stream)
+        return compile_stream();
 
     // tok file
+    phase_begin();
     tokenFile = fopen((program + ".tok").c_str(), "w");
+    if (jobs > 1)
+        scan_parallel (jobs);
+    else if (pipeline)
+        scan_pipeline();
     int parse_rc = yyparse();
+    scan_finish (report_times);
     cpp_pclose();
     fclose(tokenFile); 
 
     yylex_destroy();
+    phase_end ("parse");
 
     if (parse_rc)
         errprintf ("parse failed (%d)\n", parse_rc);
     else
     {
         // str file
+        phase_begin();
         FILE* stringSetFile = fopen((program + ".str").c_str(), "w");
         string_set::dump(stringSetFile);
         fclose(stringSetFile);
+        phase_end ("str");
 
         // ast file
+        phase_begin();
         FILE* astreeFile = fopen((program + ".ast").c_str(), "w");
         parser::root->dump_tree(astreeFile);
         fclose(astreeFile);
+        phase_end ("ast");
 
         // sym file
+        phase_begin();
         symfile = fopen((program + ".sym").c_str(), "w");
         type_check(parser::root);
         fclose(symfile);
+        phase_end ("check");
+
+        // oi file, ahead of the passes that rewrite the tree
+        if (oil_module and exec::exit_status == EXIT_SUCCESS)
+            write_interface(parser::root, source, program);
+
+        // opt file
+        phase_begin();
+        optfile = fopen((program + ".opt").c_str(), "w");
+        opt_passes(parser::root);
+        fclose(optfile);
+        optfile = nullptr;
+        phase_end ("opt");
 
         // oil file
+        phase_begin();
         oilfile = fopen((program + ".oil").c_str(), "w");
         emit_il(parser::root);
         fclose(oilfile);
+        phase_end ("emit");
+
+        // dep file
+        if (oil_module and exec::exit_status == EXIT_SUCCESS)
+            write_manifest(source, program, module_flags);
         
+        phase_begin();
         delete parser::root;
+        phase_end ("free");
     }
 
     return exec::exit_status;
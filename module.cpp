@@ -0,0 +1,225 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "lyutils.h"
+#include "module.h"
+
+static bool ends_with (const string& text, const string& suffix) {
+   return text.size() >= suffix.size()
+      and text.compare (text.size() - suffix.size(), suffix.size(),
+                        suffix) == 0;
+}
+
+static string dir_of (const string& path) {
+   size_t slash = path.find_last_of ('/');
+   return slash == string::npos ? "" : path.substr (0, slash + 1);
+}
+
+static string read_file (const string& filename, bool& found) {
+   string text;
+   FILE* file = fopen (filename.c_str(), "r");
+   found = file != nullptr;
+   if (file == nullptr) return text;
+   char buffer[4096];
+   size_t got;
+   while ((got = fread (buffer, 1, sizeof buffer, file)) > 0) {
+      text.append (buffer, got);
+   }
+   fclose (file);
+   return text;
+}
+
+string file_hash (const string& filename) {
+   bool found;
+   string text = read_file (filename, found);
+   if (not found) return "";
+   unsigned long long hash = 0xcbf29ce484222325ULL;
+   for (unsigned char c: text) {
+      hash ^= c;
+      hash *= 0x100000001b3ULL;
+   }
+   char buffer[32];
+   snprintf (buffer, sizeof buffer, "%016llx", hash);
+   return buffer;
+}
+
+// The files cpp read for the source, once each, from its line
+// markers.  The first name is the cpp command itself.
+static vector<string> files_read() {
+   vector<string> files;
+   for (size_t filenr = 1; filenr < lexer::filenames.size(); ++filenr) {
+      const string& name = lexer::filenames[filenr];
+      if (name.empty() or name[0] == '<') continue;
+      bool seen = false;
+      for (auto& file: files) seen = seen or file == name;
+      if (not seen) files.push_back (name);
+   }
+   return files;
+}
+
+bool from_interface (const location& lloc) {
+   return lloc.filenr < lexer::filenames.size()
+      and ends_with (lexer::filenames[lloc.filenr], ".oi");
+}
+
+/*********************** interface ***********************/
+
+// An identdecl, a field or a parameter as oc writes it.
+static string declaration (astree* decl) {
+   if (decl->tokenCode == TOK_ARRAY) {
+      return *decl->children[0]->lexinfo + "[] "
+           + *decl->children[1]->lexinfo;
+   }
+   return *decl->lexinfo + " " + *decl->children[0]->lexinfo;
+}
+
+// Importers only declare the global, so any constant of its type
+// will do, and one that does not follow the source's keeps
+// importers from rebuilding when only the value changes.
+static string any_value (astree* decl) {
+   if (decl->tokenCode == TOK_ARRAY) return "null";
+   switch (decl->tokenCode) {
+      case TOK_INT:  return "0";
+      case TOK_CHAR: return "'\\0'";
+      default:       return "null";
+   }
+}
+
+static string guard_macro (const string& program) {
+   size_t slash = program.find_last_of ('/');
+   string name = slash == string::npos ? program
+                                       : program.substr (slash + 1);
+   string macro = "__";
+   for (unsigned char c: name) {
+      macro += isalnum (c) ? static_cast<char> (toupper (c)) : '_';
+   }
+   return macro + "_OI__";
+}
+
+void write_interface (astree* root, const string& source,
+                      const string& program) {
+   string path = program + ".oi";
+   string macro = guard_macro (program);
+   string text = "// " + path + ": the interface of " + source
+               + ", written by oc --module\n"
+               + "#ifndef " + macro + "\n#define " + macro + "\n\n";
+
+   // an import's own path is relative to the source, as is ours
+   bool imports = false;
+   for (auto& file: files_read()) {
+      if (not ends_with (file, ".oi") or file == path) continue;
+      string name = dir_of (file) == dir_of (path)
+                  ? file.substr (dir_of (file).size()) : file;
+      text += "#include \"" + name + "\"\n";
+      imports = true;
+   }
+   if (imports) text += "\n";
+
+   for (auto child: root->children) {
+      if (child->tokenCode != TOK_STRUCT
+          or *lexer::filename (child->lloc.filenr) != source) continue;
+      text += "struct " + *child->children[0]->lexinfo + " {\n";
+      if (child->children.size() > 1) {
+         for (auto field: child->children[1]->children) {
+            text += "   " + declaration (field) + ";\n";
+         }
+      }
+      text += "}\n\n";
+   }
+   bool functions = false;
+   for (auto child: root->children) {
+      if (child->tokenCode != TOK_FUNCTION
+          or *lexer::filename (child->lloc.filenr) != source) continue;
+      astree* decl = child->children[0];
+      if (*decl->children.back()->lexinfo == "main") continue;
+      text += declaration (decl) + " (";
+      const char* separator = "";
+      for (auto param: child->children[1]->children) {
+         text += separator + declaration (param);
+         separator = ", ";
+      }
+      text += ");\n";
+      functions = true;
+   }
+   if (functions) text += "\n";
+   bool globals = false;
+   for (auto child: root->children) {
+      if (child->tokenCode != TOK_VARDECL
+          or *lexer::filename (child->lloc.filenr) != source) continue;
+      astree* decl = child->children[0];
+      text += declaration (decl) + " = " + any_value (decl) + ";\n";
+      globals = true;
+   }
+   if (globals) text += "\n";
+   text += "#endif\n";
+
+   // an unchanged interface keeps its time stamp for make and the like
+   bool found;
+   if (read_file (path, found) == text) return;
+   FILE* file = fopen (path.c_str(), "w");
+   if (file == nullptr) {
+      syserrprintf (path.c_str());
+      return;
+   }
+   fputs (text.c_str(), file);
+   fclose (file);
+}
+
+/*********************** manifest ***********************/
+
+void write_manifest (const string& source, const string& program,
+                     const string& flags) {
+   string path = program + ".dep";
+   FILE* file = fopen (path.c_str(), "w");
+   if (file == nullptr) {
+      syserrprintf (path.c_str());
+      return;
+   }
+   fprintf (file, "flags %s\n", flags.c_str());
+   fprintf (file, "source %s %s\n", file_hash (source).c_str(),
+            source.c_str());
+   // a new oc makes new oil
+   vector<string> reads = files_read();
+   char oc[4096];
+   ssize_t length = readlink ("/proc/self/exe", oc, sizeof oc - 1);
+   if (length > 0) reads.push_back (string (oc, length));
+   for (auto& read: reads) {
+      if (read == source) continue;
+      string hash = file_hash (read);
+      if (not hash.empty()) {
+         fprintf (file, "read %s %s\n", hash.c_str(), read.c_str());
+      }
+   }
+   fclose (file);
+}
+
+bool module_current (const string& program, const string& flags) {
+   if (access ((program + ".oil").c_str(), R_OK) != 0
+       or access ((program + ".oi").c_str(), R_OK) != 0) return false;
+   bool found;
+   string manifest = read_file (program + ".dep", found);
+   if (not found) return false;
+
+   size_t start = 0;
+   bool flags_seen = false;
+   while (start < manifest.size()) {
+      size_t end = manifest.find ('\n', start);
+      if (end == string::npos) return false;
+      string line = manifest.substr (start, end - start);
+      start = end + 1;
+      if (line.compare (0, 6, "flags ") == 0) {
+         if (line.substr (6) != flags) return false;
+         flags_seen = true;
+         continue;
+      }
+      // "source HASH FILE" or "read HASH FILE"
+      size_t hash_at = line.find (' ');
+      size_t file_at = hash_at == string::npos
+                     ? string::npos : line.find (' ', hash_at + 1);
+      if (file_at == string::npos) return false;
+      string hash = line.substr (hash_at + 1, file_at - hash_at - 1);
+      if (file_hash (line.substr (file_at + 1)) != hash) return false;
+   }
+   return flags_seen;
+}
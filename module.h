@@ -0,0 +1,46 @@
+#ifndef __MODULE_H__
+#define __MODULE_H__
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "astree.h"
+
+//
+// Separate compilation.  Under --module the source is one module of
+// a program.  Other modules import it with #include "NAME.oi", and
+// each build of it writes two files:
+//
+//    NAME.oi   its interface, an oc header with its structs, the
+//              prototypes of its functions and its globals, guarded
+//              and including the interfaces it imports itself;
+//    NAME.dep  its manifest, the flags it was built with and a hash
+//              of the source, of each file cpp read for it and of
+//              oc itself.
+//
+// oc --build compiles only the modules whose manifest no longer
+// matches, in the order their imports give.
+//
+
+bool from_interface (const location& lloc);
+// Whether the declaration at lloc was read from a module interface
+// rather than from the source being compiled.
+
+void write_interface (astree* root, const string& source,
+                      const string& program);
+// Writes program.oi for what source declares in root.  The file is
+// left alone when it would not change.
+
+void write_manifest (const string& source, const string& program,
+                     const string& flags);
+// Writes program.dep for the build just made of source.
+
+bool module_current (const string& program, const string& flags);
+// Whether program.dep matches what is on disk now and flags, and the
+// oil and the interface it was made with are still there.
+
+string file_hash (const string& filename);
+// The fnv1a64 hash of the file in hex, or "" if it cannot be read.
+
+#endif
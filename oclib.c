@@ -0,0 +1,540 @@
+// oclib.c
+// Runtime library for programs compiled by oc.  Link it with the
+// oil:  cc -x c program.oil -x none oclib.c
+//
+// Output goes through one large buffer, written when full, at exit,
+// and after each newline when stdout is a terminal.  Input is read
+// in bulk and scanned in place.  Nothing here uses stdio for the
+// program's own standard input and output.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "oclib.h"
+
+#define OUTSIZE (1 << 16)
+#define INSIZE  (1 << 16)
+
+static char outbuf[OUTSIZE];
+static size_t outlen = 0;
+static int out_is_tty = -1;
+
+static char inbuf[INSIZE + 1];
+static size_t inpos = 0;
+static size_t inlen = 0;
+static int in_eof = 0;
+
+void* xcalloc (int nelem, int size) {
+   void* result = calloc (nelem, size);
+   if (result == NULL) {
+      fprintf (stderr, "xcalloc: out of memory\n");
+      exit (EXIT_FAILURE);
+   }
+   return result;
+}
+
+/*** sized strings ***/
+
+int oc_sized_strings = 0;
+
+// A negative capacity fails like xcalloc's count would.
+static int str_bytes (int capacity) {
+   return capacity < 0 ? capacity
+                       : (int) sizeof (struct oc_string) + capacity;
+}
+
+static char* str_init (struct oc_string* head, int capacity) {
+   head->capacity = capacity;
+   return (char*) (head + 1);
+}
+
+char* oc_str_new (int capacity) {
+   return str_init (xcalloc (1, str_bytes (capacity)), capacity);
+}
+
+char* oc_gc_str_new (int capacity) {
+   return str_init (oc_gc_alloc (1, str_bytes (capacity), NULL),
+                    capacity);
+}
+
+// The length of s, from its header when it has one.
+static size_t str_length (char* s) {
+   if (! oc_sized_strings) return strlen (s);
+   struct oc_string* head = OC_STRING_HEAD (s);
+   if (head->length < 0) head->length = strlen (s);
+   return head->length;
+}
+
+/*** output ***/
+
+static void write_all (const char* data, size_t length) {
+   while (length > 0) {
+      ssize_t wrote = write (STDOUT_FILENO, data, length);
+      if (wrote < 0) {
+         if (errno == EINTR) continue;
+         // nowhere to report to: drop the output like stdio would
+         return;
+      }
+      data += wrote;
+      length -= wrote;
+   }
+}
+
+static void flush_output (void) {
+   write_all (outbuf, outlen);
+   outlen = 0;
+}
+
+static int interactive (void) {
+   if (out_is_tty < 0) out_is_tty = isatty (STDOUT_FILENO);
+   return out_is_tty;
+}
+
+// Called after anything that may have written a newline.
+static void line_done (void) {
+   if (interactive()) flush_output();
+}
+
+static void put_bytes (const char* data, size_t length) {
+   if (outlen + length > OUTSIZE) {
+      flush_output();
+      if (length > OUTSIZE) {
+         write_all (data, length);
+         return;
+      }
+   }
+   memcpy (outbuf + outlen, data, length);
+   outlen += length;
+}
+
+void __putchar (int c) {
+   if (outlen == OUTSIZE) flush_output();
+   outbuf[outlen++] = c;
+   if (c == '\n') line_done();
+}
+
+void __putint (int i) {
+   // digits are produced backwards, two at a time
+   static const char pairs[] =
+      "00010203040506070809101112131415161718192021222324"
+      "25262728293031323334353637383940414243444546474849"
+      "50515253545556575859606162636465666768697071727374"
+      "75767778798081828384858687888990919293949596979899";
+   char digits[12];
+   char* end = digits + sizeof digits;
+   char* start = end;
+   unsigned value = i < 0 ? 0u - (unsigned) i : (unsigned) i;
+   while (value >= 100) {
+      unsigned pair = (value % 100) * 2;
+      value /= 100;
+      *--start = pairs[pair + 1];
+      *--start = pairs[pair];
+   }
+   if (value >= 10) {
+      *--start = pairs[value * 2 + 1];
+      *--start = pairs[value * 2];
+   }else {
+      *--start = '0' + value;
+   }
+   if (i < 0) *--start = '-';
+   put_bytes (start, end - start);
+}
+
+void __putstr (char* s) {
+   size_t length = str_length (s);
+   put_bytes (s, length);
+   if (interactive() && memchr (s, '\n', length) != NULL) line_done();
+}
+
+/*** input ***/
+
+// Refills the input buffer, keeping nothing.  Returns 0 at end of
+// file.  On a terminal, pending output is written first so that
+// prompts are seen.
+static int fill_input (void) {
+   if (in_eof) return 0;
+   if (outlen > 0 && interactive()) flush_output();
+   for (;;) {
+      ssize_t got = read (STDIN_FILENO, inbuf, INSIZE);
+      if (got < 0 && errno == EINTR) continue;
+      inpos = 0;
+      inlen = got > 0 ? got : 0;
+      // a sentinel so word scans need no bounds check
+      inbuf[inlen] = '\n';
+      if (got <= 0) in_eof = 1;
+      return got > 0;
+   }
+}
+
+int __getchar (void) {
+   if (inpos == inlen && ! fill_input()) return EOF;
+   return (unsigned char) inbuf[inpos++];
+}
+
+static int is_space (char c) {
+   return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Grows the result string by the bytes [from, to).
+static char* append (char* result, size_t* length, size_t* size,
+                     const char* from, const char* to) {
+   size_t more = to - from;
+   if (*length + more + 1 > *size) {
+      while (*length + more + 1 > *size) *size *= 2;
+      result = realloc (result, *size);
+      if (result == NULL) {
+         fprintf (stderr, "oclib: out of memory\n");
+         exit (EXIT_FAILURE);
+      }
+   }
+   memcpy (result + *length, from, more);
+   *length += more;
+   return result;
+}
+
+// Reads up to the next delimiter into a fresh string.  A word ends
+// at white space, a line at a newline, which is consumed.  Scanning
+// works on the buffered bytes directly; memchr finds line ends.  A
+// sized string's header is kept at the front of the buffer.
+static char* read_string (int word) {
+   size_t size = 32;
+   size_t head = oc_sized_strings ? sizeof (struct oc_string) : 0;
+   size_t length = head;
+   char* result = xcalloc (size, 1);
+   int any = 0;
+   for (;;) {
+      if (inpos == inlen && ! fill_input()) break;
+      const char* start = inbuf + inpos;
+      const char* limit = inbuf + inlen;
+      const char* stop;
+      if (word) {
+         stop = start;
+         while (! is_space (*stop)) ++stop;
+      }else {
+         stop = memchr (start, '\n', limit - start);
+         if (stop == NULL) stop = limit;
+      }
+      any = 1;
+      if (stop > start) {
+         result = append (result, &length, &size, start, stop);
+      }
+      inpos = stop - inbuf;
+      if (stop < limit) {
+         if (! word) ++inpos;
+         break;
+      }
+   }
+   if (! any) {
+      free (result);
+      return NULL;
+   }
+   result[length] = '\0';
+   if (head == 0) return result;
+   struct oc_string* sized = (struct oc_string*) result;
+   sized->length = length - head;
+   sized->capacity = size - head;
+   return (char*) (sized + 1);
+}
+
+char* __getword (void) {
+   for (;;) {
+      if (inpos == inlen && ! fill_input()) return NULL;
+      while (inpos < inlen && is_space (inbuf[inpos])) ++inpos;
+      if (inpos < inlen) break;
+   }
+   return read_string (1);
+}
+
+char* __getln (void) {
+   return read_string (0);
+}
+
+/*** garbage collection ***/
+
+// Every collected object has a header in front of it, and all of
+// them are on one list for the sweep.  A pointer is only followed if
+// it is the address of a live object, found in the object table:
+// string fields may also point at literals or at getln's strings.
+// Sized strings are held by their chars, just past the object's
+// start.
+
+struct gc_header {
+   struct gc_header* next;
+   const int* map;
+   size_t nelem;
+   size_t size;
+   int marked;
+};
+
+#define GC_MIN_TRIGGER ((size_t) 1 << 20)
+
+struct oc_gc_frame* oc_gc_top = NULL;
+int oc_gc_recent = 0;
+
+static void** recent_stack = NULL;
+static int recent_size = 0;
+
+static struct gc_header* gc_objects = NULL;
+static void** gc_table = NULL;      // open addressing, NULL is empty
+static size_t gc_table_size = 0;
+static size_t gc_count = 0;
+
+static size_t gc_live_bytes = 0;     // allocated and not yet swept
+static size_t gc_peak_bytes = 0;
+static size_t gc_trigger = GC_MIN_TRIGGER;
+
+static struct gc_header** gc_gray = NULL;
+static size_t gc_gray_size = 0;
+
+static size_t gc_collections = 0;
+static size_t gc_freed_bytes = 0;
+static double gc_pause_total = 0;
+static double gc_pause_max = 0;
+
+static void* gc_check (void* pointer) {
+   if (pointer == NULL) {
+      fprintf (stderr, "oclib: out of memory\n");
+      exit (EXIT_FAILURE);
+   }
+   return pointer;
+}
+
+static size_t gc_hash (const void* pointer) {
+   return ((uintptr_t) pointer >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+static void gc_table_insert (void* pointer) {
+   size_t slot = gc_hash (pointer) & (gc_table_size - 1);
+   while (gc_table[slot] != NULL) slot = (slot + 1) & (gc_table_size - 1);
+   gc_table[slot] = pointer;
+}
+
+static int gc_table_contains (const void* pointer) {
+   if (gc_table_size == 0) return 0;
+   size_t slot = gc_hash (pointer) & (gc_table_size - 1);
+   while (gc_table[slot] != NULL) {
+      if (gc_table[slot] == pointer) return 1;
+      slot = (slot + 1) & (gc_table_size - 1);
+   }
+   return 0;
+}
+
+// Rebuilds the table from the object list, at half load at most.
+static void gc_table_rebuild (void) {
+   size_t size = 1024;
+   while (size < gc_count * 2) size *= 2;
+   if (size != gc_table_size) {
+      free (gc_table);
+      gc_table = gc_check (calloc (size, sizeof *gc_table));
+      gc_table_size = size;
+   }else {
+      memset (gc_table, 0, size * sizeof *gc_table);
+   }
+   for (struct gc_header* object = gc_objects; object != NULL;
+        object = object->next) {
+      gc_table_insert (object + 1);
+   }
+}
+
+static void gc_push_gray (struct gc_header* object, size_t* top) {
+   if (*top == gc_gray_size) {
+      gc_gray_size = gc_gray_size == 0 ? 256 : gc_gray_size * 2;
+      gc_gray = gc_check (realloc (gc_gray,
+                                   gc_gray_size * sizeof *gc_gray));
+   }
+   gc_gray[(*top)++] = object;
+}
+
+static void gc_mark (void* pointer, size_t* top) {
+   if (pointer == NULL) return;
+   if (! gc_table_contains (pointer)) {
+      if (! oc_sized_strings) return;
+      pointer = OC_STRING_HEAD (pointer);
+      if (! gc_table_contains (pointer)) return;
+   }
+   struct gc_header* object = (struct gc_header*) pointer - 1;
+   if (object->marked) return;
+   object->marked = 1;
+   if (object->map != NULL) gc_push_gray (object, top);
+}
+
+static void gc_trace (size_t* top) {
+   while (*top > 0) {
+      struct gc_header* object = gc_gray[--*top];
+      char* data = (char*) (object + 1);
+      if (object->map == OC_GC_REFS) {
+         void** slots = (void**) data;
+         for (size_t i = 0; i < object->nelem; ++i) {
+            gc_mark (slots[i], top);
+         }
+      }else {
+         // one struct, or a block of them from a flattened array
+         for (size_t i = 0; i < object->nelem; ++i) {
+            char* base = data + i * object->size;
+            for (int field = 1; field <= object->map[0]; ++field) {
+               gc_mark (*(void**) (base + object->map[field]), top);
+            }
+         }
+      }
+   }
+}
+
+static double gc_now (void) {
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void gc_collect (void) {
+   double start = gc_now();
+   size_t top = 0;
+   for (struct oc_gc_frame* frame = oc_gc_top; frame != NULL;
+        frame = frame->prev) {
+      for (int root = 0; root < frame->count; ++root) {
+         gc_mark (*frame->roots[root], &top);
+      }
+   }
+   for (int recent = 0; recent < oc_gc_recent; ++recent) {
+      gc_mark (recent_stack[recent], &top);
+   }
+   gc_trace (&top);
+
+   struct gc_header** link = &gc_objects;
+   while (*link != NULL) {
+      struct gc_header* object = *link;
+      if (object->marked) {
+         object->marked = 0;
+         link = &object->next;
+      }else {
+         size_t bytes = object->nelem * object->size;
+         gc_live_bytes -= bytes;
+         gc_freed_bytes += bytes;
+         --gc_count;
+         *link = object->next;
+         free (object);
+      }
+   }
+   gc_table_rebuild();
+   gc_trigger = gc_live_bytes * 2;
+   if (gc_trigger < GC_MIN_TRIGGER) gc_trigger = GC_MIN_TRIGGER;
+
+   double pause = gc_now() - start;
+   ++gc_collections;
+   gc_pause_total += pause;
+   if (pause > gc_pause_max) gc_pause_max = pause;
+}
+
+void* oc_gc_alloc (int nelem, int size, const int* map) {
+   size_t bytes = (size_t) nelem * size;
+   if (gc_live_bytes + bytes > gc_trigger) gc_collect();
+   struct gc_header* object = gc_check (
+      calloc (1, sizeof (struct gc_header) + bytes));
+   object->next = gc_objects;
+   object->map = map;
+   object->nelem = nelem;
+   object->size = size;
+   gc_objects = object;
+   gc_live_bytes += bytes;
+   if (gc_live_bytes > gc_peak_bytes) gc_peak_bytes = gc_live_bytes;
+
+   if (++gc_count * 2 > gc_table_size) gc_table_rebuild();
+   else gc_table_insert (object + 1);
+   return oc_gc_keep (object + 1);
+}
+
+void oc_gc_enter (struct oc_gc_frame* frame, void** const* roots,
+                  int count) {
+   frame->prev = oc_gc_top;
+   frame->roots = roots;
+   frame->count = count;
+   frame->mark = oc_gc_recent;
+   oc_gc_top = frame;
+}
+
+void oc_gc_leave (struct oc_gc_frame* frame) {
+   oc_gc_recent = frame->mark;
+   oc_gc_top = frame->prev;
+}
+
+void* oc_gc_keep (void* pointer) {
+   if (oc_gc_recent == recent_size) {
+      recent_size = recent_size == 0 ? 256 : recent_size * 2;
+      recent_stack = gc_check (realloc (recent_stack,
+                                        recent_size * sizeof (void*)));
+   }
+   recent_stack[oc_gc_recent++] = pointer;
+   return pointer;
+}
+
+static void gc_report (void) {
+   if (gc_peak_bytes == 0) return;
+   fprintf (stderr, "gc: %zu collections, pause %.3f ms total,"
+            " %.3f ms max, heap %zu bytes live, %zu peak,"
+            " %zu freed\n", gc_collections, gc_pause_total * 1e3,
+            gc_pause_max * 1e3, gc_live_bytes, gc_peak_bytes,
+            gc_freed_bytes);
+}
+
+/*** profile ***/
+
+static struct oc_profile* profile = NULL;
+
+void oc_profile_register (struct oc_profile* table) {
+   profile = table;
+}
+
+static void profile_report (void) {
+   if (profile == NULL) return;
+   FILE* file = fopen (profile->file, "a");
+   if (file == NULL) {
+      fprintf (stderr, "%s: %s\n", profile->file, strerror (errno));
+      return;
+   }
+   for (int site = 0; site < profile->count; ++site) {
+      fprintf (file, "%s %lu\n", profile->sites[site],
+               profile->counts[site]);
+   }
+   fclose (file);
+}
+
+/*** exit ***/
+
+void __exit (int status) {
+   flush_output();
+   profile_report();
+   gc_report();
+   exit (status);
+}
+
+void __assert_fail (char* expr, char* file, int line, char* func) {
+   flush_output();
+   fprintf (stderr, "%s:%d: %s: assertion (%s) failed.\n",
+            file, line, func, expr);
+   abort();
+}
+
+// The oc program's main is "__main" in the oil.  It may be declared
+// with or without (argc, argv); passing them is harmless either way.
+int __main (int argc, char** argv);
+
+int main (int argc, char** argv) {
+   if (oc_sized_strings) {
+      for (int arg = 0; arg < argc; ++arg) {
+         size_t length = strlen (argv[arg]);
+         char* copy = oc_str_new (length + 1);
+         memcpy (copy, argv[arg], length);
+         OC_STRING_HEAD (copy)->length = length;
+         argv[arg] = copy;
+      }
+   }
+   __main (argc, argv);
+   flush_output();
+   profile_report();
+   gc_report();
+   return EXIT_SUCCESS;
+}
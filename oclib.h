@@ -1,5 +1,105 @@
 #ifndef __OCLIB_H__
 #define __OCLIB_H__
 
-#endif
+// Runtime interface for oil programs, implemented by oclib.c.
+// oc functions are named "__name" in the oil, and so are the
+// library functions declared in oclib.oh.
+
+void* xcalloc (int nelem, int size);
+
+// A string constant of the oil's pool: each distinct literal once,
+// in an array of its size that cc does not pad for alignment.
+
+#define OC_STRING(name, size, text) \
+   static const char name[size] __attribute__ ((aligned (1))) = text
+
+// Sized strings, for oil compiled with oc --sized-strings.  A string
+// is still a char* to its chars, but a header in front of them holds
+// its length, or -1 while that is unknown, and the chars it has room
+// for, so printing one needs no scan.  Stores to the chars go through
+// oc_str_store.  The oil sets oc_sized_strings before __main runs, so
+// that the strings the runtime makes have headers too.
+
+struct oc_string {
+   int length;
+   int capacity;
+};
+
+#define OC_STRING_HEAD(s) ((struct oc_string*) (s) - 1)
+
+#define OC_SIZED_STRING(name, length, size, text) \
+   static const struct { struct oc_string head; char chars[size]; } \
+   name __attribute__ ((aligned (4))) = {{length, size}, text}
+
+#define OC_STACK_STRING(name, size) \
+   struct { struct oc_string head; char chars[size]; } name
+
+extern int oc_sized_strings;
+
+char* oc_str_new (int capacity);
+char* oc_gc_str_new (int capacity);
 
+// s[i] = c:  a NUL inside the string cuts it short, and a char over
+// its NUL makes it run on to the next one.
+static inline char oc_str_store (char* s, int i, char c) {
+   struct oc_string* head = OC_STRING_HEAD (s);
+   if (c == '\0') {
+      if (i < head->length) head->length = i;
+   }else if (i == head->length) {
+      head->length = i + 1 < head->capacity && s[i + 1] == '\0'
+                   ? i + 1 : -1;
+   }
+   return s[i] = c;
+}
+
+void __putchar (int c);
+void __putint (int i);
+void __putstr (char* s);
+int __getchar (void);
+char* __getword (void);
+char* __getln (void);
+void __exit (int status);
+void __assert_fail (char* expr, char* file, int line, char* func);
+
+// Garbage collection, for oil compiled with oc --gc.  Allocations
+// go through oc_gc_alloc with a pointer map:  NULL for objects with
+// no pointers, OC_GC_REFS for arrays of pointers, else a struct's
+// map {count, offset...} of its pointer fields.  Each function with
+// pointer variables links a frame of their addresses onto
+// oc_gc_top.  Pointers that live only in expression temporaries are
+// kept on the recent stack until the frame that made them reaches a
+// loop back edge or returns.
+
+#define OC_GC_REFS ((const int*) 1)
+
+struct oc_gc_frame {
+   struct oc_gc_frame* prev;
+   void** const* roots;
+   int count;
+   int mark;
+};
+
+extern struct oc_gc_frame* oc_gc_top;
+extern int oc_gc_recent;
+
+void* oc_gc_alloc (int nelem, int size, const int* map);
+void oc_gc_enter (struct oc_gc_frame* frame, void** const* roots,
+                  int count);
+void oc_gc_leave (struct oc_gc_frame* frame);
+void* oc_gc_keep (void* pointer);
+
+// Profiling, for oil compiled with oc --instrument.  The oil counts
+// the runs of its functions, branches and loops in one table, which
+// it registers before __main runs.  At exit the counts are appended
+// to the table's file, one "site count" line each.
+
+struct oc_profile {
+   const char* file;
+   const char* const* sites;
+   unsigned long* counts;
+   int count;
+};
+
+void oc_profile_register (struct oc_profile* profile);
+
+#endif
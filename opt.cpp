@@ -0,0 +1,423 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "opt.h"
+#include "layout.h"
+#include "flatten.h"
+#include "tailrec.h"
+#include "inliner.h"
+#include "escape.h"
+#include "licm.h"
+#include "cse.h"
+#include "simd.h"
+#include "induction.h"
+#include "lyutils.h"
+
+bool opt::layout = false;
+bool opt::flatten = false;
+bool opt::tailrec = false;
+bool opt::inliner = false;
+size_t opt::inline_limit = 40;
+bool opt::escape = false;
+bool opt::licm = false;
+bool opt::cse = false;
+bool opt::simd = false;
+bool opt::iv = false;
+
+FILE* optfile = nullptr;
+
+struct opt_flag {
+   const char* name;
+   bool* flag;
+};
+
+static const opt_flag opt_flags[] = {
+   {"layout", &opt::layout},
+   {"flatten", &opt::flatten},
+   {"tailrec", &opt::tailrec},
+   {"inline", &opt::inliner},
+   {"escape", &opt::escape},
+   {"licm", &opt::licm},
+   {"cse", &opt::cse},
+   {"simd", &opt::simd},
+   {"iv", &opt::iv},
+};
+
+void opt::all (bool on) {
+   for (const opt_flag& flag: opt_flags) *flag.flag = on;
+}
+
+bool opt::set (const string& name) {
+   static const string limit = "inline-limit=";
+   if (name.compare (0, limit.size(), limit) == 0) {
+      char* end = nullptr;
+      long nodes = strtol (name.c_str() + limit.size(), &end, 10);
+      if (*end != '\0' or nodes < 0) return false;
+      opt::inline_limit = nodes;
+      return true;
+   }
+   bool on = name.compare (0, 3, "no-") != 0;
+   string pass = on ? name : name.substr (3);
+   for (const opt_flag& flag: opt_flags) {
+      if (pass == flag.name) {
+         *flag.flag = on;
+         return true;
+      }
+   }
+   return false;
+}
+
+void optprintf (const location& lloc, const char* format, ...) {
+   if (optfile == nullptr) return;
+   fprintf (optfile, "%s:%zd.%zd: ",
+            lexer::filename (lloc.filenr)->c_str(),
+            lloc.linenr, lloc.offset);
+   va_list args;
+   va_start (args, format);
+   vfprintf (optfile, format, args);
+   va_end (args);
+   fprintf (optfile, "\n");
+}
+
+void opt_passes (astree* root) {
+   if (opt::layout) layout_structs (root);
+   if (opt::flatten) flatten_arrays (root);
+   if (opt::tailrec) tail_recursion (root);
+   if (opt::inliner) inline_calls (root);
+   if (opt::escape) escape_analysis (root);
+   if (opt::licm) licm (root);
+   if (opt::cse) value_numbering (root);
+   if (opt::simd) vectorize_loops (root);
+   if (opt::iv) induction_variables (root);
+}
+
+bool has_attr (const symbol& sym, attr a) {
+   return sym.attributes[static_cast<size_t> (a)];
+}
+
+// Effects of each function body on globals, fields and arrays.
+static unordered_map<string, effects> function_effects;
+
+static void merge (effects& into, const effects& from) {
+   into.vars.insert (from.vars.begin(), from.vars.end());
+   into.fields.insert (from.fields.begin(), from.fields.end());
+   into.arrays |= from.arrays;
+   into.elements.insert (from.elements.begin(), from.elements.end());
+   into.unknown |= from.unknown;
+}
+
+string element_type (astree* index) {
+   const symbol& base = index->children[0]->symbl;
+   if (not has_attr (base, attr::ARRAY)) {
+      return has_attr (base, attr::STRING) ? "char" : "?";
+   }
+   if (has_attr (base, attr::INT)) return "int";
+   if (has_attr (base, attr::STRING)) return "string";
+   if (has_attr (base, attr::STRUCT) and base.type_name != nullptr) {
+      return *base.type_name;
+   }
+   return "?";
+}
+
+bool loads_stored (astree* index, const effects& by) {
+   if (by.unknown) return true;
+   if (not by.arrays) return false;
+   string type = element_type (index);
+   return type == "?" or by.elements.count ("?")
+       or by.elements.count (type);
+}
+
+bool var_stored (symbol* var, const effects& by) {
+   if (by.vars.count (var)) return true;
+   // another module's function sees only the globals
+   return by.unknown and not has_attr (*var, attr::PARAM)
+       and not has_attr (*var, attr::LOCAL);
+}
+
+bool field_stored (symbol* field, const effects& by) {
+   return by.unknown or by.fields.count (field);
+}
+
+void node_effects (astree* node, effects& into) {
+   if (node->tokenCode == '=' and node->children.size() == 2) {
+      astree* target = node->children[0];
+      switch (target->tokenCode) {
+         case TOK_IDENT:
+            if (target->symbl.decl != nullptr) {
+               into.vars.insert (target->symbl.decl);
+            }
+            break;
+         case '.':
+            if (target->symbl.decl != nullptr) {
+               into.fields.insert (target->symbl.decl);
+            }
+            break;
+         case '[':
+            into.arrays = true;
+            into.elements.insert (element_type (target));
+            break;
+      }
+   }else if (node->tokenCode == TOK_CALL and not node->children.empty()) {
+      // calls of functions defined later, or of the caller itself,
+      // are left unbound by the checker and go by name
+      astree* name = node->children[0];
+      auto callee = function_effects.find (name->symbl.decl != nullptr
+                    ? name->symbl.decl->oil_name : "__" + *name->lexinfo);
+      if (callee != function_effects.end()) {
+         merge (into, callee->second);
+      }else if (name->symbl.decl != nullptr) {
+         // declared by a prototype, its body in another module
+         into.unknown = true;
+      }
+   }
+}
+
+void effects_of (astree* node, effects& into) {
+   node_effects (node, into);
+   for (astree* child: node->children) effects_of (child, into);
+}
+
+void summarize_functions (astree* root) {
+   function_effects.clear();
+   for (astree* function: root->children) {
+      if (function->tokenCode != TOK_FUNCTION
+          or function->children.size() != 3) continue;
+      astree* type = function->children[0];
+      function_effects[type->children.back()->symbl.oil_name];
+   }
+   // iterate to a fixpoint for recursive calls
+   bool changed = true;
+   while (changed) {
+      changed = false;
+      for (astree* function: root->children) {
+         if (function->tokenCode != TOK_FUNCTION
+             or function->children.size() != 3) continue;
+         astree* type = function->children[0];
+         const string& name = type->children.back()->symbl.oil_name;
+         effects body;
+         effects_of (function->children[2], body);
+         effects& summary = function_effects[name];
+         size_t before = summary.vars.size() + summary.fields.size()
+                       + summary.elements.size() + summary.unknown;
+         for (symbol* var: body.vars) {
+            // the caller cannot see our params and locals
+            if (not has_attr (*var, attr::PARAM)
+                and not has_attr (*var, attr::LOCAL)) {
+               summary.vars.insert (var);
+            }
+         }
+         summary.fields.insert (body.fields.begin(), body.fields.end());
+         summary.arrays |= body.arrays;
+         summary.elements.insert (body.elements.begin(),
+                                  body.elements.end());
+         summary.unknown |= body.unknown;
+         if (summary.vars.size() + summary.fields.size()
+             + summary.elements.size() + summary.unknown != before) {
+            changed = true;
+         }
+      }
+   }
+}
+
+static bool is_constant (astree* node) {
+   return node->tokenCode == TOK_INTCON
+       or node->tokenCode == TOK_CHARCON;
+}
+
+// The value of a constant as cc reads it: an int in octal, decimal
+// or hex, or a char's code.
+static long constant_value (astree* node) {
+   const string& text = *node->lexinfo;
+   if (node->tokenCode == TOK_INTCON) {
+      return strtol (text.c_str(), nullptr, 0);
+   }
+   if (text.size() < 3) return 0;
+   if (text[1] != '\\') return static_cast<unsigned char> (text[1]);
+   switch (text[2]) {
+      case '0': return '\0';
+      case 'n': return '\n';
+      case 't': return '\t';
+      default:  return text[2];
+   }
+}
+
+bool invariant (astree* node, const effects& loop) {
+   switch (node->tokenCode) {
+      case TOK_INTCON:
+      case TOK_CHARCON:
+      case TOK_NULL:
+         return true;
+      case TOK_IDENT:
+         return node->symbl.decl != nullptr
+            and not var_stored (node->symbl.decl, loop);
+      case '.':
+         return node->children.size() == 2
+            and node->symbl.decl != nullptr
+            and not field_stored (node->symbl.decl, loop)
+            and invariant (node->children[0], loop);
+      case '[':
+         return node->children.size() == 2
+            and not loads_stored (node, loop)
+            and invariant (node->children[0], loop)
+            and invariant (node->children[1], loop);
+      case '/':
+      case '%':
+         // only a constant divisor cannot trap
+         return node->children.size() == 2
+            and is_constant (node->children[1])
+            and constant_value (node->children[1]) != 0
+            and invariant (node->children[0], loop);
+      case TOK_EQ: case TOK_NE: case TOK_LT:
+      case TOK_LE: case TOK_GT: case TOK_GE:
+      case '+': case '-': case '*':
+         return node->children.size() == 2
+            and invariant (node->children[0], loop)
+            and invariant (node->children[1], loop);
+      case TOK_POS:
+      case TOK_NEG:
+      case TOK_NOT:
+         return node->children.size() == 1
+            and invariant (node->children[0], loop);
+      default:
+         return false;
+   }
+}
+
+bool pure (astree* node) {
+   switch (node->tokenCode) {
+      case TOK_CALL:
+      case '=':
+      case TOK_NEW:
+      case TOK_NEWSTR:
+      case TOK_NEWARRAY:
+      case TOK_NEWARRAY2:
+         return false;
+   }
+   for (astree* child: node->children) {
+      if (not pure (child)) return false;
+   }
+   return true;
+}
+
+bool may_trap (astree* node) {
+   if (node->tokenCode == '.' or node->tokenCode == '[') return true;
+   for (astree* child: node->children) {
+      if (may_trap (child)) return true;
+   }
+   return false;
+}
+
+bool same_expr (astree* a, astree* b) {
+   if (a->tokenCode != b->tokenCode
+       or a->children.size() != b->children.size()) return false;
+   switch (a->tokenCode) {
+      case TOK_IDENT:
+         if (a->symbl.decl == nullptr or a->symbl.decl != b->symbl.decl) {
+            return false;
+         }
+         break;
+      case TOK_FIELD:
+      case TOK_STRINGCON:
+      case TOK_INTCON:
+      case TOK_CHARCON:
+      case TOK_TYPEID:
+         if (a->lexinfo != b->lexinfo) return false;
+         break;
+   }
+   for (size_t child = 0; child < a->children.size(); ++child) {
+      if (not same_expr (a->children[child], b->children[child])) {
+         return false;
+      }
+   }
+   return true;
+}
+
+astree* copy_expr (astree* expr) {
+   astree* copy = new astree (expr->tokenCode, expr->lloc,
+                              expr->lexinfo->c_str());
+   copy->symbl.attributes = expr->symbl.attributes;
+   copy->symbl.type_name = expr->symbl.type_name;
+   copy->symbl.oil_name = expr->symbl.oil_name;
+   copy->symbl.decl = expr->symbl.decl;
+   for (astree* child: expr->children) copy->adopt (copy_expr (child));
+   return copy;
+}
+
+static const int type_attrs[] = {
+   static_cast<int> (attr::INT), static_cast<int> (attr::STRING),
+   static_cast<int> (attr::STRUCT), static_cast<int> (attr::ARRAY),
+};
+
+astree* make_temp (const string& oil_name, astree* expr) {
+   const location& lloc = expr->lloc;
+   const symbol& type = expr->symbl;
+   astree* declid = new astree (TOK_DECLID, lloc, oil_name.c_str());
+   for (int attr_nr: type_attrs) {
+      declid->symbl.attributes[attr_nr] = type.attributes[attr_nr];
+   }
+   declid->symbl.attributes[static_cast<size_t> (attr::VARIABLE)] = true;
+   declid->symbl.attributes[static_cast<size_t> (attr::LOCAL)] = true;
+   declid->symbl.type_name = type.type_name;
+   declid->symbl.oil_name = oil_name;
+
+   astree* base;
+   if (has_attr (type, attr::STRUCT) and type.type_name != nullptr) {
+      base = new astree (TOK_TYPEID, lloc, type.type_name->c_str());
+   }else if (has_attr (type, attr::STRING)) {
+      base = new astree (TOK_STRING, lloc, "string");
+   }else {
+      // arithmetic and comparisons are untyped in the checker
+      base = new astree (TOK_INT, lloc, "int");
+   }
+   astree* typed;
+   if (has_attr (type, attr::ARRAY)) {
+      typed = new astree (TOK_ARRAY, lloc, "[]");
+      typed->adopt (base, declid);
+   }else {
+      typed = base->adopt (declid);
+   }
+   astree* vardecl = new astree (TOK_VARDECL, lloc, "=");
+   return vardecl->adopt (typed, expr);
+}
+
+astree* make_zero (const symbol& type, const location& lloc) {
+   bool pointer = has_attr (type, attr::ARRAY)
+               or has_attr (type, attr::STRING)
+               or has_attr (type, attr::STRUCT);
+   astree* zero = pointer ? new astree (TOK_NULL, lloc, "null")
+                          : new astree (TOK_INTCON, lloc, "0");
+   zero->symbl.attributes = type.attributes;
+   zero->symbl.type_name = type.type_name;
+   return zero;
+}
+
+astree* temp_use (astree* temp, const location& lloc) {
+   astree* typed = temp->children[0];
+   astree* declid = typed->children.back();
+   astree* ident = new astree (TOK_IDENT, lloc, declid->lexinfo->c_str());
+   ident->symbl.decl = &declid->symbl;
+   for (int attr_nr: type_attrs) {
+      ident->symbl.attributes[attr_nr] = declid->symbl.attributes[attr_nr];
+   }
+   ident->symbl.type_name = declid->symbl.type_name;
+   return ident;
+}
+
+bool always_returns (astree* stmt) {
+   switch (stmt->tokenCode) {
+      case TOK_RETURN:
+         return true;
+      case TOK_BLOCK:
+         for (astree* child: stmt->children) {
+            if (always_returns (child)) return true;
+         }
+         return false;
+      case TOK_IF:
+         return stmt->children.size() == 3
+            and always_returns (stmt->children[1])
+            and always_returns (stmt->children[2]);
+      default:
+         return false;
+   }
+}
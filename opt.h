@@ -0,0 +1,119 @@
+#ifndef __OPT_H__
+#define __OPT_H__
+
+#include <string>
+#include <unordered_set>
+using namespace std;
+
+#include "astree.h"
+
+//
+// Optimization switches and the .opt report.
+// -O turns on every pass; -f<pass> and -fno-<pass> set one.
+//
+
+struct opt {
+   static bool layout;        // order struct fields, split off cold ones
+   static bool flatten;       // store struct arrays as blocks of structs
+   static bool tailrec;       // turn self tail calls into loops
+   static bool inliner;       // inline small functions
+   static size_t inline_limit;   // largest body inlined, in nodes
+   static bool escape;        // stack-allocate non-escaping new
+   static bool licm;          // hoist loop-invariant expressions
+   static bool cse;           // reuse values already computed
+   static bool simd;          // mark independent loops for cc to vectorize
+   static bool iv;            // strength-reduce induction variables
+
+   static void all (bool on);
+   static bool set (const string& flag);
+   // Sets the pass named by a -f argument, "pass" or "no-pass",
+   // or the inliner's budget, "inline-limit=N".  Returns false if
+   // there is no such pass.
+};
+
+extern FILE* optfile;
+
+void optprintf (const location& lloc, const char* format, ...);
+// Appends one line to the .opt report, prefixed by the source
+// location it is about.
+
+void opt_passes (astree* root);
+// Runs the enabled passes over the checked tree, in order.
+
+//
+// Helpers shared by the passes.
+//
+
+//
+// What a store may overwrite follows oc's types: a variable only
+// by assigning it, a field only through a store to the same field
+// of the same struct, and an element only through a store into an
+// array with the same element type.  The chars of strings are a
+// type of their own.  Distinct fields, and elements of different
+// types, never alias.
+//
+
+struct effects {
+   unordered_set<symbol*> vars;    // variables assigned
+   unordered_set<symbol*> fields;  // fields stored into
+   bool arrays = false;            // any array or string element stored
+   unordered_set<string> elements; // element types stored, by element_type
+   bool unknown = false;           // any global, field or element stored
+};
+
+string element_type (astree* index);
+// The type of what the '[' node index loads, as effects name it.
+
+bool loads_stored (astree* index, const effects& by);
+// True if the element index loads may be among those stored by.
+
+bool var_stored (symbol* var, const effects& by);
+// True if by may assign the variable var.
+
+bool field_stored (symbol* field, const effects& by);
+// True if by may store into the field.
+
+void node_effects (astree* node, effects& into);
+// Adds what node itself may write, not counting its operands.
+
+void effects_of (astree* node, effects& into);
+// Adds what running node may write, including through the oc
+// functions it calls.  Library functions write nothing visible, and
+// one only declared here, as another module's, may write anything.
+
+void summarize_functions (astree* root);
+// Computes the effects of every function, as effects_of uses them.
+
+bool invariant (astree* expr, const effects& loop);
+// True if expr is pure and computes the same value on every
+// iteration of a loop with these effects.
+
+bool pure (astree* expr);
+// True if evaluating expr calls, stores and allocates nothing.
+
+bool may_trap (astree* expr);
+// True if evaluating expr loads through a pointer, which may fault
+// on null or out of bounds.
+
+bool same_expr (astree* a, astree* b);
+// True if a and b compute the same value from the same names.
+
+astree* copy_expr (astree* expr);
+// A deep copy of expr, bound to the same declarations.
+
+astree* make_temp (const string& oil_name, astree* expr);
+// A TOK_VARDECL of a new compiler temporary initialized by expr
+// and typed like it.
+
+astree* make_zero (const symbol& type, const location& lloc);
+// A null or 0 typed like type, to initialize a temporary with.
+
+astree* temp_use (astree* temp, const location& lloc);
+// A TOK_IDENT bound to the temporary declared by temp.
+
+bool always_returns (astree* stmt);
+// True if every path through stmt ends in a return.
+
+bool has_attr (const symbol& sym, attr a);
+
+#endif
@@ -53,7 +53,7 @@
 %left  TOK_EQ TOK_NE TOK_LT TOK_LE TOK_GT TOK_GE
 %left  '+' '-'
 %left  '*' '/' '%'
-%right TOK_POS TOK_NEG '!' TOK_NEW
+%right TOK_POS TOK_NEG '!' TOK_NOT TOK_NEW
 %left  TOK_ARRAY TOK_FIELD TOK_FUNCTION 
 %left  '[' '.'
 
@@ -66,9 +66,9 @@
 start: program                  { $$ = $1 = nullptr; }
         ;
 
-program: program structdef      { $$ = $1->adopt ($2); }
-        | program function      { $$ = $1->adopt ($2); }
-        | program globaldecl    { $$ = $1->adopt ($2); }
+program: program structdef      { $$ = parser::take ($1, $2); }
+        | program function      { $$ = parser::take ($1, $2); }
+        | program globaldecl    { $$ = parser::take ($1, $2); }
         | program error '}'     { $$ = $1; destroy($3); }
         | program error ';'     { $$ = $1; destroy($3); }
         |                       { $$ = parser::root; }
@@ -281,8 +281,24 @@ return: TOK_RETURN ';'
                         }
         ;
 
-expr: expr binop expr           { $$ = $2->adopt ($1, $3); }
-        | unop expr             { $$ = $1->adopt ($2); }
+expr: expr '=' expr            { $$ = $2->adopt ($1, $3); }
+        | expr TOK_EQ expr      { $$ = $2->adopt ($1, $3); }
+        | expr TOK_NE expr      { $$ = $2->adopt ($1, $3); }
+        | expr TOK_LT expr      { $$ = $2->adopt ($1, $3); }
+        | expr TOK_LE expr      { $$ = $2->adopt ($1, $3); }
+        | expr TOK_GT expr      { $$ = $2->adopt ($1, $3); }
+        | expr TOK_GE expr      { $$ = $2->adopt ($1, $3); }
+        | expr '+' expr         { $$ = $2->adopt ($1, $3); }
+        | expr '-' expr         { $$ = $2->adopt ($1, $3); }
+        | expr '*' expr         { $$ = $2->adopt ($1, $3); }
+        | expr '/' expr         { $$ = $2->adopt ($1, $3); }
+        | expr '%' expr         { $$ = $2->adopt ($1, $3); }
+        | '+' expr %prec TOK_POS
+                        { $$ = $1->sym(TOK_POS)->adopt ($2); }
+        | '-' expr %prec TOK_NEG
+                        { $$ = $1->sym(TOK_NEG)->adopt ($2); }
+        | '!' expr      { $$ = $1->sym(TOK_NOT)->adopt ($2); }
+        | TOK_NOT expr  { $$ = $1->adopt ($2); }
         | allocation            { $$ = $1; }
         | call                  { $$ = $1; }
         | variable              { $$ = $1; }
@@ -359,27 +375,16 @@ constant: TOK_INTCON            { $$ = $1; }
         | TOK_NULL              { $$ = $1; }
         ;
 
-binop:    TOK_EQ                { $$ = $1; }
-        | TOK_NE                { $$ = $1; }
-        | TOK_LT                { $$ = $1; }
-        | TOK_LE                { $$ = $1; }
-        | TOK_GT                { $$ = $1; }
-        | TOK_GE                { $$ = $1; }
-        | '+'                   { $$ = $1; }
-        | '-'                   { $$ = $1; }
-        | '*'                   { $$ = $1; }
-        | '/'                   { $$ = $1; }
-        | '='                   { $$ = $1; }
-        ;
-
-unop:     '+'                   { $$ = $1->sym(TOK_POS); }
-        | '-'                   { $$ = $1->sym(TOK_NEG); }
-        | '!'                   { $$ = $1->sym(TOK_NOT); }
-        ;
-
 %%
 
 const char* parser::get_tname (int _symbol) {
    return yytname [YYTRANSLATE (_symbol)];
 }
 
+// Each top-level declaration as it is reduced: to the program, or
+// under --stream on to the rest of the compiler.
+astree* parser::take (astree* program, astree* decl) {
+   if (declaration == nullptr) return program->adopt (decl);
+   declaration (decl);
+   return program;
+}
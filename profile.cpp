@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <unordered_map>
+
+#include "profile.h"
+
+// Runs below this are too few to lay out a branch for.
+static const unsigned long least_runs = 16;
+
+static unordered_map<string, unsigned long> counts;
+static unsigned long most_calls = 0;
+
+string profile_key (const location& lloc) {
+   return "_" + to_string (lloc.filenr) + "_" + to_string (lloc.linenr)
+        + "_" + to_string (lloc.offset);
+}
+
+bool profile_load (const string& filename) {
+   FILE* file = fopen (filename.c_str(), "r");
+   if (file == nullptr) return false;
+   char kind[16];
+   char key[64];
+   unsigned long count;
+   while (fscanf (file, "%15s %63s %lu", kind, key, &count) == 3) {
+      unsigned long& total = counts[string (kind) + " " + key];
+      total += count;
+      if (string (kind) == "fn" and total > most_calls) {
+         most_calls = total;
+      }
+   }
+   fclose (file);
+   return true;
+}
+
+bool profile_count (const char* kind, const location& lloc,
+                    unsigned long& count) {
+   auto found = counts.find (string (kind) + " " + profile_key (lloc));
+   if (found == counts.end()) return false;
+   count = found->second;
+   return true;
+}
+
+int profile_expect (const char* taken, const char* other,
+                    const location& lloc) {
+   unsigned long yes = 0;
+   unsigned long no = 0;
+   if (not profile_count (taken, lloc, yes)
+       or not profile_count (other, lloc, no)) return -1;
+   unsigned long runs = yes + no;
+   if (runs < least_runs) return -1;
+   if (yes * 10 >= runs * 9) return 1;
+   if (yes * 10 <= runs) return 0;
+   return -1;
+}
+
+int profile_heat (astree* function) {
+   unsigned long calls = 0;
+   if (not profile_count ("fn", function->lloc, calls)) return 0;
+   if (calls == 0) return -1;
+   if (calls > 1 and calls * 10 >= most_calls) return 1;
+   return 0;
+}
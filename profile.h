@@ -0,0 +1,39 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <string>
+using namespace std;
+
+#include "astree.h"
+
+//
+// Execution counts of an oil program built with oc --instrument.
+// Each run appends one line per site, "kind key count", where kind
+// is fn, then, else, enter or iterate and key is the site's source
+// location, _filenr_linenr_offset, so the counts still apply after
+// edits elsewhere in the file.  Lines for the same site add up.
+//
+
+string profile_key (const location& lloc);
+// The key of the site at lloc.
+
+bool profile_load (const string& filename);
+// Reads the counts for --profile-use.  Returns false if the file
+// cannot be read.
+
+bool profile_count (const char* kind, const location& lloc,
+                    unsigned long& count);
+// Sets count if the profile has the site, and returns whether it
+// does.
+
+int profile_expect (const char* taken, const char* other,
+                    const location& lloc);
+// 1 if the branch to taken ran at least nine times in ten of the
+// runs of the site at lloc, 0 if at most one in ten, else -1, as
+// for a site the profile saw too few times to tell.
+
+int profile_heat (astree* function);
+// 1 for a function called at least a tenth as often as the most
+// called one, -1 for one the profile never saw called, else 0.
+
+#endif
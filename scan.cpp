@@ -0,0 +1,382 @@
+#include <atomic>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lyutils.h"
+#include "scan.h"
+
+// A token as a chunk passes it back, its text and a \0 following.
+// One with symbol YYEOF ends the chunk: its lloc is where the lexer
+// stopped, and length counts the file names the chunk's markers
+// added, each following as its length and its text.
+struct record {
+   int symbol;
+   location lloc;
+   size_t length;
+};
+
+struct chunk {
+   size_t start;              // in the source
+   size_t end;
+   location lloc;             // the lexer's state at start
+   size_t last_yyleng;
+   size_t files;              // how many file names it knows of
+   FILE* tokens = nullptr;    // its records
+   FILE* tok = nullptr;       // its lines of the .tok file
+   FILE* errors = nullptr;    // what it wrote to stderr
+   pid_t pid = -1;
+};
+
+static bool parallel = false;
+static vector<string> marked_files;     // lexer::filenames, to come
+static string scanned;                  // the records, in order
+static size_t next_token = 0;
+static location end_lloc;
+
+// Whether the text at hash, up to end, is a line marker as
+// lexer::include reads one.
+static bool line_marker (const string& source, size_t hash, size_t end,
+                         size_t& linenr, string& filename) {
+   string line = source.substr (hash, end - hash);
+   vector<char> name (line.size() + 1);
+   if (sscanf (line.c_str(), "# %zd \"%[^\"]\"", &linenr, name.data())
+       != 2) return false;
+   filename = name.data();
+   return true;
+}
+
+// Cuts source into up to jobs chunks at line starts, each with the
+// lexer's state there, or into one if that state is not certain.
+static vector<chunk> cut (const string& source, size_t jobs) {
+   chunk whole;
+   whole.start = 0;
+   whole.end = source.size();
+   whole.lloc = lexer::lloc;
+   whole.last_yyleng = lexer::last_yyleng;
+   whole.files = lexer::filenames.size();
+   vector<chunk> chunks {whole};
+   marked_files = lexer::filenames;
+   if (jobs < 2 or yy_flex_debug or source.find ("/*") != string::npos) {
+      return chunks;
+   }
+
+   size_t step = source.size() / jobs + 1;
+   location lloc = lexer::lloc;
+   for (size_t at = 0; at < source.size(); ) {
+      size_t end = source.find ('\n', at);
+      if (end == string::npos) end = source.size();
+      size_t linenr;
+      string filename;
+      size_t first = source.find_first_not_of (" \t", at);
+      if (first < end and source[first] == '#') {
+         // a directive takes the rest of its line
+         if (line_marker (source, first, end, linenr, filename)) {
+            lloc.linenr = linenr - 1;
+            lloc.filenr = marked_files.size();
+            marked_files.push_back (filename);
+         }
+      }else {
+         for (size_t hash = at; hash < end; ++hash) {
+            const void* found = memchr (source.data() + hash, '#',
+                                        end - hash);
+            if (found == nullptr) break;
+            hash = static_cast<const char*> (found) - source.data();
+            if (line_marker (source, hash, end, linenr, filename)) {
+               chunks.resize (1);
+               marked_files = lexer::filenames;
+               return chunks;
+            }
+         }
+      }
+      if (end == source.size()) break;
+      ++lloc.linenr;
+      lloc.offset = 0;
+      at = end + 1;
+      if (at - chunks.back().start >= step and at < source.size()) {
+         chunks.back().end = at;
+         chunk next;
+         next.start = at;
+         next.end = source.size();
+         next.lloc = lloc;
+         next.last_yyleng = 1;   // the newline's
+         next.files = marked_files.size();
+         chunks.push_back (next);
+      }
+   }
+   return chunks;
+}
+
+// In the child: scans part and exits.
+static void scan_chunk (const string& source, const chunk& part) {
+   dup2 (fileno (part.errors), STDERR_FILENO);
+   tokenFile = part.tok;
+   lexer::filenames.assign (marked_files.begin(),
+                            marked_files.begin() + part.files);
+   lexer::lloc = part.lloc;
+   lexer::last_yyleng = part.last_yyleng;
+   yyin = fmemopen (const_cast<char*> (source.data() + part.start),
+                    part.end - part.start, "r");
+   if (yyin == nullptr) {
+      syserrprintf ("fmemopen");
+      _exit (EXIT_FAILURE);
+   }
+
+   record token;
+   while ((token.symbol = lexer::scan()) != YYEOF) {
+      token.lloc = yylval->lloc;
+      token.length = yylval->lexinfo->size();
+      fwrite (&token, sizeof token, 1, part.tokens);
+      fwrite (yylval->lexinfo->c_str(), 1, token.length + 1, part.tokens);
+      delete yylval;
+   }
+   token.lloc = lexer::lloc;
+   token.length = lexer::filenames.size() - part.files;
+   fwrite (&token, sizeof token, 1, part.tokens);
+   for (size_t index = part.files; index < lexer::filenames.size();
+        ++index) {
+      const string& name = lexer::filenames[index];
+      size_t length = name.size();
+      fwrite (&length, sizeof length, 1, part.tokens);
+      fwrite (name.data(), 1, length, part.tokens);
+   }
+   fflush (part.tokens);
+   fflush (part.tok);
+   _exit (exec::exit_status);
+}
+
+static void copy (FILE* from, FILE* to) {
+   rewind (from);
+   char buffer[0x10000];
+   size_t got;
+   while ((got = fread (buffer, 1, sizeof buffer, from)) > 0) {
+      fwrite (buffer, 1, got, to);
+   }
+}
+
+// Takes the records and file names part scanned.  The nodes are
+// made as the parser asks for them, so the strings are interned in
+// the order a serial scan interns them.
+static void collect (const chunk& part) {
+   fseek (part.tokens, 0, SEEK_END);
+   size_t start = scanned.size();
+   scanned.resize (start + ftell (part.tokens));
+   rewind (part.tokens);
+   size_t got = fread (&scanned[start], 1, scanned.size() - start,
+                       part.tokens);
+   scanned.resize (start + got);
+
+   record token;
+   for (size_t at = start; at + sizeof token <= scanned.size(); ) {
+      memcpy (&token, &scanned[at], sizeof token);
+      if (token.symbol != YYEOF) {
+         at += sizeof token + token.length + 1;
+         continue;
+      }
+      end_lloc = token.lloc;
+      size_t name = at + sizeof token;
+      for (size_t count = token.length; count > 0; --count) {
+         size_t length;
+         if (name + sizeof length > scanned.size()) break;
+         memcpy (&length, &scanned[name], sizeof length);
+         name += sizeof length;
+         lexer::filenames.push_back (scanned.substr (name, length));
+         name += length;
+      }
+      scanned.resize (at);
+      return;
+   }
+   scanned.resize (start);   // no trailer: the chunk died
+}
+
+void scan_parallel (size_t jobs) {
+   string source;
+   char buffer[0x10000];
+   size_t got;
+   while ((got = fread (buffer, 1, sizeof buffer, yyin)) > 0) {
+      source.append (buffer, got);
+   }
+   end_lloc = lexer::lloc;
+   parallel = true;
+
+   vector<chunk> chunks = cut (source, jobs);
+   for (auto& part: chunks) {
+      part.tokens = tmpfile();
+      part.tok = tmpfile();
+      part.errors = tmpfile();
+      if (part.tokens == nullptr or part.tok == nullptr
+          or part.errors == nullptr) {
+         syserrprintf ("tmpfile");
+         continue;
+      }
+      part.pid = fork();
+      if (part.pid == 0) scan_chunk (source, part);
+      if (part.pid < 0) syserrprintf ("fork");
+   }
+
+   // in order, as a serial scan would have left them
+   for (auto& part: chunks) {
+      int status;
+      if (part.pid > 0 and waitpid (part.pid, &status, 0) == part.pid) {
+         if (status != 0) exec::exit_status = EXIT_FAILURE;
+         if (not WIFEXITED (status)) eprint_status ("scan", status);
+         copy (part.errors, stderr);
+         copy (part.tok, tokenFile);
+         collect (part);
+      }
+      for (FILE* file: {part.tokens, part.tok, part.errors}) {
+         if (file != nullptr) fclose (file);
+      }
+   }
+}
+
+// --pipeline: the scanner thread's records, in order.  It alone
+// moves ring_tail and the parser alone moves ring_head.
+struct slot {
+   int symbol;
+   location lloc;
+   string text;
+};
+
+static const size_t ring_size = 4096;
+static slot ring[ring_size];
+static atomic<size_t> ring_head {0};
+static atomic<size_t> ring_tail {0};
+static atomic<bool> stopping {false};
+static thread scanner;
+static bool piped = false;
+static bool piped_end = false;
+static size_t piped_files;              // as the scanner counts them
+static struct timespec piped_start;
+
+// for -t
+static size_t piped_tokens = 0;
+static size_t occupancy_sum = 0;
+static size_t occupancy_max = 0;
+static size_t parser_waits = 0;
+static size_t scanner_waits = 0;
+
+// On the scanner thread: waits for a free slot and fills it.
+static void put (int symbol, const char* text) {
+   if (symbol == lexer::FILENAME) lexer::lloc.filenr = piped_files++;
+   size_t tail = ring_tail.load (memory_order_relaxed);
+   if (tail - ring_head.load (memory_order_acquire) == ring_size) {
+      ++scanner_waits;
+      do {
+         if (stopping.load (memory_order_relaxed)) return;
+         this_thread::yield();
+      }while (tail - ring_head.load (memory_order_acquire) == ring_size);
+   }
+   slot& entry = ring[tail % ring_size];
+   entry.symbol = symbol;
+   entry.lloc = lexer::lloc;
+   entry.text = text;
+   ring_tail.store (tail + 1, memory_order_release);
+}
+
+static void scan_thread (location lloc, size_t last_yyleng) {
+   lexer::lloc = lloc;
+   lexer::last_yyleng = last_yyleng;
+   while (not stopping.load (memory_order_relaxed)) {
+      if (lexer::scan() == YYEOF) {
+         put (YYEOF, "");
+         break;
+      }
+   }
+}
+
+// On the parser's thread: takes records up to the next token, doing
+// what the scanner would have done with the others.
+static int take() {
+   for (;;) {
+      size_t head = ring_head.load (memory_order_relaxed);
+      size_t tail = ring_tail.load (memory_order_acquire);
+      if (head == tail) {
+         ++parser_waits;
+         do {
+            this_thread::yield();
+            tail = ring_tail.load (memory_order_acquire);
+         }while (head == tail);
+      }
+      occupancy_sum += tail - head;
+      occupancy_max = max (occupancy_max, tail - head);
+
+      slot& entry = ring[head % ring_size];
+      int symbol = entry.symbol;
+      lexer::lloc = entry.lloc;
+      switch (symbol) {
+         case lexer::ERROR:
+            errllocprintf (entry.lloc, "%s", entry.text.c_str());
+            break;
+         case lexer::MESSAGE:
+            errprintf ("%s", entry.text.c_str());
+            break;
+         case lexer::FILENAME:
+            lexer::filenames.push_back (entry.text);
+            break;
+         case YYEOF:
+            piped_end = true;
+            break;
+         default:
+            yylval = new astree (symbol, entry.lloc, entry.text.c_str());
+            ++piped_tokens;
+            break;
+      }
+      ring_head.store (head + 1, memory_order_release);
+      if (symbol >= 0) return symbol;
+   }
+}
+
+void scan_pipeline() {
+   if (yy_flex_debug) return;
+   clock_gettime (CLOCK_MONOTONIC, &piped_start);
+   piped = true;
+   piped_end = false;
+   piped_files = lexer::filenames.size();
+   ring_head = ring_tail = 0;
+   stopping = false;
+   lexer::pass = put;
+   scanner = thread (scan_thread, lexer::lloc, lexer::last_yyleng);
+}
+
+void scan_finish (bool report) {
+   if (not piped) return;
+   stopping = true;
+   scanner.join();
+   lexer::pass = nullptr;
+   piped = false;
+   if (not report) return;
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   double seconds = now.tv_sec - piped_start.tv_sec
+                  + (now.tv_nsec - piped_start.tv_nsec) / 1e9;
+   size_t records = ring_head.load();
+   eprintf ("pipeline tokens %zu rate %.0f/s ring %zu"
+            " mean %.1f max %zu parser-waits %zu scanner-waits %zu\n",
+            piped_tokens, piped_tokens / seconds, ring_size,
+            records == 0 ? 0.0
+                         : static_cast<double> (occupancy_sum) / records,
+            occupancy_max, parser_waits, scanner_waits);
+}
+
+int yylex() {
+   if (piped) return piped_end ? YYEOF : take();
+   if (not parallel) return lexer::scan();
+   record token;
+   if (next_token == scanned.size()) {
+      string().swap (scanned);
+      next_token = 0;
+      lexer::lloc = end_lloc;
+      return YYEOF;
+   }
+   memcpy (&token, &scanned[next_token], sizeof token);
+   next_token += sizeof token;
+   yylval = new astree (token.symbol, token.lloc, &scanned[next_token]);
+   next_token += token.length + 1;
+   lexer::lloc = token.lloc;
+   return token.symbol;
+}
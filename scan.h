@@ -0,0 +1,40 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stddef.h>
+
+//
+// oc -j N scans the preprocessed source in up to N chunks at once.
+// The source is read whole and cut at line starts, where the lexer
+// is always in the same state: a newline is a token of its own and
+// strings and chars end on their line.  Only the line markers cpp
+// writes change the file and line numbers, so one pass over the
+// lines gives each chunk its starting state.  The flex scanner is
+// not reentrant, so each chunk is scanned by a process of its own;
+// the tokens, the .tok lines and the diagnostics come back in
+// order, the same as a serial scan gives.
+//
+// A source with /* in it is scanned in one chunk, since a comment
+// may span lines, as is one with a line marker after other text
+// on its line.
+//
+// oc --pipeline instead scans on a thread of its own while the
+// parser runs, passing the tokens through a ring with one producer
+// and one consumer.  The string set, the file names and the exit
+// status belong to the parser's thread, so the scanner passes its
+// tokens, diagnostics and line markers as text and the parser's
+// side makes the nodes and prints the messages, in scan order.
+//
+
+void scan_parallel (size_t jobs);
+// Scans all of yyin, up to jobs chunks at once, for yylex to hand
+// to the parser.
+
+void scan_pipeline();
+// Starts the scanner thread, for yylex to take from.
+
+void scan_finish (bool report);
+// Stops and joins the scanner thread, the parser done with it.  If
+// report, prints the token rate and how full the ring ran.
+
+#endif
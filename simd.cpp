@@ -0,0 +1,254 @@
+#include <algorithm>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "simd.h"
+#include "opt.h"
+
+static size_t start_counter = 0;
+static size_t loops_marked = 0;
+
+// The scalars a candidate loop writes, by what the pragma says of
+// them.  Sums and products are only updated in place; temporaries
+// are assigned before each iteration reads them.
+struct loop_vars {
+    symbol* counter = nullptr;
+    vector<symbol*> sums;
+    vector<symbol*> products;
+    vector<symbol*> temps;
+};
+
+/********************* helpers **********************/
+
+static bool is_var(astree* node, symbol* var){
+    return node->tokenCode == TOK_IDENT && node->symbl.decl == var;
+}
+
+static bool uses_var(astree* node, symbol* var){
+    if(is_var(node, var))
+        return true;
+    for(auto child : node->children){
+        if(uses_var(child, var))
+            return true;
+    }
+    return false;
+}
+
+// an int variable, the only kind a lane may keep a copy of
+static bool scalar(symbol* var){
+    return var != nullptr && !var->oil_name.empty()
+        && !has_attr(*var, attr::ARRAY) && !has_attr(*var, attr::STRING)
+        && !has_attr(*var, attr::STRUCT) && !has_attr(*var, attr::NULLX);
+}
+
+static bool written(symbol* var, const vector<symbol*>& vars){
+    return find(vars.begin(), vars.end(), var) != vars.end();
+}
+
+// '+' or '*' if stmt is var = var op E or var = E op var, E not
+// reading var, else 0
+static int update_op(astree* stmt, symbol* var){
+    astree* expr = stmt->children[1];
+    if(expr->tokenCode != '+' && expr->tokenCode != '*')
+        return 0;
+    if(expr->children.size() != 2)
+        return 0;
+    astree* other;
+    if(is_var(expr->children[0], var))
+        other = expr->children[1];
+    else if(is_var(expr->children[1], var))
+        other = expr->children[0];
+    else
+        return 0;
+    return uses_var(other, var) ? 0 : expr->tokenCode;
+}
+
+// " head a, b)"
+static string clause(const string& head, const vector<symbol*>& vars){
+    string text;
+    for(auto var : vars)
+        text += (text.empty() ? "" : ", ") + var->oil_name;
+    return " " + head + text + ")";
+}
+
+/********************* candidates *********************/
+
+// i = i + step, i an int local or param and step a positive
+// constant or an invariant variable
+static bool is_step(astree* stmt, const effects& loop, loop_vars& vars){
+    if(stmt->tokenCode != '=' || stmt->children.size() != 2)
+        return false;
+    astree* target = stmt->children[0];
+    if(target->tokenCode != TOK_IDENT || !scalar(target->symbl.decl))
+        return false;
+    symbol* var = target->symbl.decl;
+    if(!has_attr(*var, attr::LOCAL) && !has_attr(*var, attr::PARAM))
+        return false;
+    if(update_op(stmt, var) != '+')
+        return false;
+    astree* sum = stmt->children[1];
+    astree* step = sum->children[is_var(sum->children[0], var) ? 1 : 0];
+    if(step->tokenCode == TOK_INTCON){
+        if(strtol(step->lexinfo->c_str(), nullptr, 10) <= 0)
+            return false;
+    }
+    else if(step->tokenCode != TOK_IDENT || !invariant(step, loop))
+        return false;
+    vars.counter = var;
+    return true;
+}
+
+// i < bound or i <= bound, the bound invariant
+static bool is_counted(astree* test, const effects& loop,
+                       const loop_vars& vars){
+    if(test->tokenCode != TOK_LT && test->tokenCode != TOK_LE)
+        return false;
+    return test->children.size() == 2
+        && is_var(test->children[0], vars.counter)
+        && invariant(test->children[1], loop);
+}
+
+// Sorts the scalars the statements ahead of the step store to.
+static bool sort_scalars(astree* body, astree* test, loop_vars& vars){
+    size_t last = body->children.size() - 1;
+    vector<symbol*> stored;
+    for(size_t index = 0; index < last; ++index){
+        astree* stmt = body->children[index];
+        if(stmt->tokenCode != '=' || stmt->children.size() != 2
+        || !pure(stmt->children[1]))
+            return false;
+        astree* target = stmt->children[0];
+        if(target->tokenCode == '['){
+            if(!pure(target))
+                return false;
+            continue;
+        }
+        // a field store may land anywhere
+        if(target->tokenCode != TOK_IDENT)
+            return false;
+        symbol* var = target->symbl.decl;
+        if(!scalar(var) || var == vars.counter || uses_var(test, var))
+            return false;
+        if(!written(var, stored))
+            stored.push_back(var);
+    }
+
+    for(auto var : stored){
+        vector<astree*> touching;
+        for(size_t index = 0; index < last; ++index){
+            if(uses_var(body->children[index], var))
+                touching.push_back(body->children[index]);
+        }
+        int op = touching.size() == 1 ? update_op(touching[0], var) : 0;
+        if(op == '+')
+            vars.sums.push_back(var);
+        else if(op == '*')
+            vars.products.push_back(var);
+        else if(is_var(touching[0]->children[0], var)
+             && !uses_var(touching[0]->children[1], var))
+            vars.temps.push_back(var);
+        else
+            return false;
+    }
+    return true;
+}
+
+// Each element loaded or stored under node comes from an array the
+// loop leaves in place, and one of a type the loop stores is indexed
+// by the counter itself, so iterations touch disjoint elements.
+static bool independent(astree* node, const effects& loop,
+                        const loop_vars& vars){
+    if(node->tokenCode == '['){
+        if(node->children.size() != 2
+        || !invariant(node->children[0], loop))
+            return false;
+        if(!is_var(node->children[1], vars.counter)
+        && loads_stored(node, loop))
+            return false;
+    }
+    for(auto child : node->children){
+        if(!independent(child, loop, vars))
+            return false;
+    }
+    return true;
+}
+
+// the counter picks some element, so a step that is not positive
+// could not have left the loop running forever
+static bool indexes(astree* node, const loop_vars& vars){
+    if(node->tokenCode == '[' && is_var(node->children[1], vars.counter))
+        return true;
+    for(auto child : node->children){
+        if(indexes(child, vars))
+            return true;
+    }
+    return false;
+}
+
+/********************* the pass *********************/
+
+static void vectorize(astree* loop, const string& function){
+    astree* body = loop->children[1];
+    if(body->tokenCode != TOK_BLOCK || body->children.size() < 2)
+        return;
+    effects writes;
+    effects_of(loop, writes);
+
+    loop_vars vars;
+    astree* step = body->children.back();
+    if(!is_step(step, writes, vars)
+    || !is_counted(loop->children[0], writes, vars)
+    || !sort_scalars(body, loop->children[0], vars)
+    || !independent(loop->children[0], writes, vars)
+    || !independent(body, writes, vars))
+        return;
+    astree* by = step->children[1];
+    by = by->children[is_var(by->children[0], vars.counter) ? 1 : 0];
+    if(by->tokenCode != TOK_INTCON && !indexes(body, vars))
+        return;
+
+    string pragma = "omp simd";
+    if(!vars.sums.empty())
+        pragma += clause("reduction(+:", vars.sums);
+    if(!vars.products.empty())
+        pragma += clause("reduction(*:", vars.products);
+    if(!vars.temps.empty())
+        pragma += clause("lastprivate(", vars.temps);
+    loop->simd_pragma = pragma;
+
+    // a canonical loop may not start its counter from itself, so it
+    // starts from a copy made with the invariants
+    if(loop->children.size() == 2){
+        loop->adopt(new astree(TOK_BLOCK, loop->lloc, "{"),
+                    new astree(TOK_BLOCK, loop->lloc, "{"));
+    }
+    string name = "__simd" + to_string(++start_counter);
+    loop->children[2]->adopt(make_temp(name,
+                                       copy_expr(step->children[0])));
+    ++loops_marked;
+    optprintf(loop->lloc, "%s: loop emitted as %s", function.c_str(),
+              pragma.c_str());
+}
+
+static void walk(astree* node, const string& function){
+    for(auto child : node->children){
+        if(child->tokenCode == TOK_WHILE && child->children.size() >= 2)
+            vectorize(child, function);
+        walk(child, function);
+    }
+}
+
+void vectorize_loops(astree* root){
+    summarize_functions(root);
+    size_t before = loops_marked;
+    for(auto child : root->children){
+        if(child->tokenCode != TOK_FUNCTION
+        || child->children.size() != 3) continue;
+        string name = *child->children[0]->children.back()->lexinfo;
+        walk(child->children[2], name);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "simd: %zu loops marked for the vectorizer\n",
+                loops_marked - before);
+    }
+}
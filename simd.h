@@ -0,0 +1,13 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "astree.h"
+
+// Finds counted while loops over arrays whose iterations are
+// independent: each reads and writes only element i of the arrays
+// it stores to, and its other stores are sums or temporaries.
+// They are marked to be emitted as canonical for loops under an
+// omp simd pragma, which cc's vectorizer takes as a promise.
+void vectorize_loops (astree* root);
+
+#endif
@@ -0,0 +1,40 @@
+#include "lyutils.h"
+#include "emit.h"
+#include "escape.h"
+#include "opt.h"
+#include "stream.h"
+#include "tailrec.h"
+
+extern FILE* astfile;
+
+static vector<astree*> kept;
+static bool begun = false;
+
+void stream_declaration (astree* decl) {
+   if (not begun) parser::root->dump_node (astfile);
+   begun = true;
+   decl->dump_tree (astfile, 1);
+   type_check (decl);
+
+   if (decl->tokenCode == TOK_FUNCTION) {
+      astree unit (TOK_ROOT, decl->lloc, "");
+      unit.children.push_back (decl);
+      if (opt::tailrec) tail_recursion (&unit);
+      if (opt::escape) escape_analysis (&unit);
+      unit.children.clear();
+   }
+   emit_declaration (decl);
+
+   if (decl->tokenCode == TOK_STRUCT or decl->children.empty()) {
+      kept.push_back (decl);
+      return;
+   }
+   kept.push_back (decl->children[0]);
+   decl->children.erase (decl->children.begin());
+   delete decl;
+}
+
+void stream_finish() {
+   for (auto decl: kept) delete decl;
+   kept.clear();
+}
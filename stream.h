@@ -0,0 +1,27 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "astree.h"
+
+//
+// oc --stream compiles a declaration at a time.  The parser hands
+// on each top-level declaration as soon as it reduces it, and it is
+// checked, run through the passes that need no other function's
+// body, emitted and freed.  What later declarations may still refer
+// to is kept: all of a struct, only the title of a function,
+// prototype or global.  Memory then follows the largest function,
+// not the whole source, and the oil is written while cpp and the
+// parser are still reading.
+//
+// Of the passes only tailrec and escape run, one function at a
+// time, the callees unknown to escape taken to let everything
+// escape.  The rest need every function at once.
+//
+
+void stream_declaration (astree* decl);
+// Compiles decl, the declaration the parser just reduced.
+
+void stream_finish();
+// Frees what stream_declaration kept, once the parse is done.
+
+#endif
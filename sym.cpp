@@ -1,15 +1,27 @@
 #include "lyutils.h"
 #include "astree.h"
+#include "emit.h"
 
 extern FILE* symfile;
 
 size_t next_block = 1;
 symbol_table global_symbol_table;
 symbol_table local_symbol_table;
+symbol_table type_symbol_table;
 vector<symbol*> local_parameters;
 string struct_name;
+bool in_function = false;
+
+// oc --incremental keeps every declaration's symbols in the tables
+// at once.  This hides the ones declared after the declaration being
+// checked, which a check of the whole file in order would not have
+// seen yet.  Null for such a check.
+bool (*symbol_visible)(const symbol* sym) = nullptr;
+
+static bool visible(const symbol* sym){
+    return symbol_visible == nullptr || symbol_visible(sym);
+}
 
-extern vector<string> stringcon_queue;
 
 void print_attr(symbol& sym)
 {
@@ -25,7 +37,8 @@ void print_attr(symbol& sym)
     if(sym.attributes.test(static_cast<size_t>(attr::ARRAY))) 
         fprintf (symfile," array");
     if(sym.attributes.test(static_cast<size_t>(attr::STRUCT))) 
-        fprintf (symfile," struct %s", struct_name.c_str());
+        fprintf (symfile," struct %s", sym.type_name != nullptr
+            ? sym.type_name->c_str() : struct_name.c_str());
 
     // attr
     if(sym.attributes.test(static_cast<size_t>(attr::FUNCTION))) 
@@ -53,6 +66,7 @@ void print_attr(symbol& sym)
 }
 
 void print_symbol (astree* node, const string indent = "    ") {
+    if(symfile == nullptr) return;
     symbol &sym = node->symbl;
 
     // indent
@@ -114,9 +128,8 @@ bool isPrimitiveType(attr at){
 }
 
 bool checkTypeValid(astree* node){
-    if(global_symbol_table.find(
-        node->lexinfo)
-        != global_symbol_table.end()){
+    auto type = type_symbol_table.find(node->lexinfo);
+    if(type != type_symbol_table.end() && visible(type->second)){
             return true;
         }
     else{
@@ -145,6 +158,8 @@ void typeHandler(astree* node
             setAttr(node->children[1], attr::STRUCT);
             struct_name = *(node
                 ->children[0]->lexinfo);
+            node->children[1]->symbl.type_name 
+                = node->children[0]->lexinfo;
             handler(node->children[1]);
         }
     }
@@ -153,7 +168,9 @@ void typeHandler(astree* node
         &&!node->children.empty()){
         checkTypeValid(node);
         setAttr(node, attr::STRUCT);
+        setAttr(node->children[0], attr::STRUCT);
         struct_name = *(node->lexinfo);
+        node->children[0]->symbl.type_name = node->lexinfo;
         handler(node->children[0]);
     } 
     // "int xxx;"
@@ -169,6 +186,67 @@ void insertToGlobalTable(astree* node){
         , &(node->symbl)));
 }
 
+// oil names for locals are prefixed by their kind of storage
+string localOilName(astree* node){
+    const attr_bitset& attrs = node->symbl.attributes;
+    string prefix;
+    if(attrs.test(static_cast<size_t>(attr::ARRAY))
+    || attrs.test(static_cast<size_t>(attr::STRING))
+    || attrs.test(static_cast<size_t>(attr::STRUCT)))
+        prefix = "p";
+    else if(attrs.test(static_cast<size_t>(attr::INT)))
+        prefix = "i";
+    return prefix + *(node->lexinfo);
+}
+
+void insertToLocalTable(astree* node){
+    local_symbol_table[node->lexinfo] = &(node->symbl);
+}
+
+symbol* lookupIdent(const string* name){
+    auto local = local_symbol_table.find(name);
+    if(local != local_symbol_table.end())
+        return local->second;
+    auto global = global_symbol_table.find(name);
+    if(global != global_symbol_table.end() && visible(global->second))
+        return global->second;
+    return nullptr;
+}
+
+// copy the type part of a symbol onto an expression node
+void setType(astree* node, const symbol& type){
+    for(attr at : {attr::VOID, attr::INT, attr::NULLX
+                 , attr::STRING, attr::STRUCT, attr::ARRAY}){
+        if(type.attributes.test(static_cast<size_t>(at)))
+            setAttr(node, at);
+    }
+    node->symbl.type_name = type.type_name;
+}
+
+// "a.b": resolve b in the field table of a's struct
+void resolveField(astree* node){
+    symbol& base = node->children[0]->symbl;
+    if(base.type_name == nullptr
+    || !base.attributes.test(static_cast<size_t>(attr::STRUCT))
+    || base.attributes.test(static_cast<size_t>(attr::ARRAY)))
+        return;
+
+    auto type = type_symbol_table.find(base.type_name);
+    if(type == type_symbol_table.end()
+    || type->second->fields == nullptr || !visible(type->second))
+        return;
+
+    astree* field = node->children[1];
+    auto found = type->second->fields->find(field->lexinfo);
+    if(found == type->second->fields->end()){
+        errllocprintf (field->lloc, "no field %s in struct\n"
+            , field->lexinfo->c_str());
+        return;
+    }
+    node->symbl.decl = found->second;
+    setType(node, *found->second);
+}
+
 #define PRIMITIVE_CASE_TEST(__TOK_CASE__, __ATTR__) \
 case __TOK_CASE__: \
     if(!node->children.empty()) \
@@ -211,9 +289,12 @@ switch(node->tokenCode)
 
         // struct name
         struct_name = *(node->children[0]->lexinfo);
+        node->children[0]->symbl.type_name 
+            = node->children[0]->lexinfo;
 
-        // new global sym
-        insertToGlobalTable(node->children[0]);
+        // new type sym
+        type_symbol_table[node->children[0]->lexinfo] 
+            = &(node->children[0]->symbl);
 
         // print
         print_symbol (node->children[0], "\n");
@@ -221,6 +302,7 @@ switch(node->tokenCode)
         // fields
         // eg: foo (0.2.7) int field 0
         //     link (0.3.8) struct node field 1
+        const string* structName = node->children[0]->lexinfo;
         size_t sqs = 0;
         for (auto child : node->children[1]->children){
             if(!child) continue;
@@ -230,6 +312,8 @@ switch(node->tokenCode)
                 setAttr(node
                     , attr::FIELD
                     , sqs++);
+                node->symbl.oil_name = *structName 
+                    + "_" + *(node->lexinfo);
                 // collect fields symbols
                 local_symbol_table.insert(
                     symbol_entry(
@@ -241,8 +325,8 @@ switch(node->tokenCode)
         }
 
         // save fields symbols
-        //setField(node->children[0]
-        //    , new symbol_table(local_symbol_table));
+        setField(node->children[0]
+            , new symbol_table(local_symbol_table));
 
         // leave struct
         local_symbol_table.clear();
@@ -261,6 +345,7 @@ switch(node->tokenCode)
         typeHandler(node->children[0], [&](astree* node){
             // attr function
             setAttr(node, attr::FUNCTION);
+            node->symbl.oil_name = "__" + *(node->lexinfo);
 
             // all the params
             //setParams(node
@@ -315,10 +400,102 @@ switch(node->tokenCode)
         local_symbol_table.clear();
         local_parameters.clear();
         next_block++;
+        in_function = false;
 
         return attr::FUNCTION;
     }
 
+    // prototype
+    case TOK_PROTO: {
+        if(node->children.size() != 2
+        || node->children[0]->children.empty())
+            break;
+
+        typeHandler(node->children[0], [&](astree* node){
+            setAttr(node, attr::FUNCTION);
+            node->symbl.oil_name = "__" + *(node->lexinfo);
+            if(global_symbol_table.find(node->lexinfo)
+                == global_symbol_table.end())
+                insertToGlobalTable(node);
+        });
+
+        local_symbol_table.clear();
+        local_parameters.clear();
+
+        return attr::FUNCTION;
+    }
+
+    case TOK_VARDECL: {
+        if(node->children.empty()
+        || node->children[0]->children.empty())
+            break;
+
+        typeHandler(node->children[0], [&](astree* node){
+            if(in_function){
+                node->symbl.oil_name = localOilName(node);
+                insertToLocalTable(node);
+            }
+            else{
+                node->symbl.oil_name = *(node->lexinfo);
+                insertToGlobalTable(node);
+            }
+        });
+        return attr::VARIABLE;
+    }
+
+    /********* expressions *********/
+
+    case TOK_IDENT: {
+        if(!in_function)
+            break;
+
+        // bind the use to its declaration
+        symbol* sym = lookupIdent(node->lexinfo);
+        if(sym != nullptr){
+            node->symbl.decl = sym;
+            setType(node, *sym);
+        }
+        return attr::VARIABLE;
+    }
+
+    case '[': {
+        if(node->children.size() != 2)
+            break;
+
+        // "a[i]": element of an array, or a char of a string
+        symbol& base = node->children[0]->symbl;
+        if(base.attributes.test(static_cast<size_t>(attr::ARRAY))){
+            setType(node, base);
+            node->symbl.attributes.reset(
+                static_cast<size_t>(attr::ARRAY));
+        }
+        else if(base.attributes.test(
+                static_cast<size_t>(attr::STRING))){
+            setAttr(node, attr::INT);
+        }
+        return attr::VARIABLE;
+    }
+
+    case '.': {
+        if(node->children.size() != 2)
+            break;
+
+        resolveField(node);
+        return attr::VARIABLE;
+    }
+
+    case TOK_CALL: {
+        if(node->children.empty())
+            break;
+
+        // the type of a call is the return type of the function
+        auto func = global_symbol_table.find(
+            node->children[0]->lexinfo);
+        if(func != global_symbol_table.end() && visible(func->second))
+            setType(node, *func->second);
+        return attr::FUNCTION;
+    }
+
     case TOK_PARAM:{
         size_t sqs = 0;
         for(auto child : node->children)
@@ -331,7 +508,10 @@ switch(node->tokenCode)
                 setAttr(node, attr::LVAL);
                 setAttr(node, attr::PARAM, sqs++);
 
+                node->symbl.oil_name = "_" + to_string(next_block)
+                    + "_" + *(node->lexinfo);
                 local_parameters.push_back(&(node->symbl));
+                insertToLocalTable(node);
             });
         }
         return attr::PARAM;
@@ -359,7 +539,8 @@ switch(node->tokenCode)
     }
 
     case TOK_STRINGCON:{
-        stringcon_queue.push_back(*(node->lexinfo));
+        // bound here, so later passes may move or copy the literal
+        node->symbl.oil_name = pool_string(node->lexinfo);
     }
 
     default:
@@ -369,6 +550,9 @@ switch(node->tokenCode)
 }
 
 void post_order_traversal (astree* node) {
+    if(node->tokenCode == TOK_FUNCTION)
+        in_function = true;
+
     for (auto child : node->children) {
         post_order_traversal (child);
     }
@@ -2,6 +2,7 @@
 #define __SYM_H__
 
 #include <bitset>
+#include <string>
 #include <vector>
 #include <unordered_map>
 
@@ -27,6 +28,11 @@ struct symbol {
     ,sequence{0}
     ,fields{nullptr}
     ,parameters{nullptr}
+    ,type_name{nullptr}
+    ,oil_name()
+    ,decl{nullptr}
+    ,stack_slot()
+    ,flat{false}
     {}
     ~symbol(){
         if(fields != nullptr) delete fields;
@@ -49,6 +55,28 @@ struct symbol {
     // list. For a function, points at a vector of parameters.
     // Else null.
     vector<symbol*>* parameters;
+
+    // For struct typed names, the interned name of the struct.
+    // For a typeid, its own name. Else null.
+    const string* type_name;
+
+    // The name given to this symbol in the oil file: "__name" for
+    // functions, "_blocknr_name" for parameters, "iname" or "pname"
+    // for locals, "structname_fieldname" for fields.
+    string oil_name;
+
+    // For an identifier, the symbol of its declaration. For a
+    // field selector, the field symbol it resolves to. Else null.
+    symbol* decl;
+
+    // For an allocation the escape analysis keeps in the function
+    // that makes it, the oil array holding the object. Else empty.
+    string stack_slot;
+
+    // For a local array of structs the flatten pass stores in one
+    // block, and for the allocations it is made from, true: the
+    // oil holds the structs themselves, not pointers to them.
+    bool flat;
 };
 
 using symbol_table = unordered_map<const string*,symbol*>;
@@ -0,0 +1,402 @@
+#include <unordered_set>
+
+#include "lyutils.h"
+#include "astree.h"
+#include "tailrec.h"
+#include "opt.h"
+
+static size_t tail_counter = 0;
+static size_t loops_made = 0;
+
+// The function being turned into a loop.
+struct tail_context {
+    astree* function;
+    const string* name;              // of the function, to know its calls
+    bool value;                      // returns something
+    bool scalar;                     // returns an int, and may accumulate
+    int op;                          // '+' or '*' once it accumulates
+    astree* acc;                     // the accumulator, once made
+    vector<astree*> decls;           // temporaries added to the function
+    unordered_map<size_t, astree*> param_temps;
+};
+
+// A call in tail position: parent->children[index] is the return or
+// the statement making it.  With an accumulator, call says which
+// operand of the returned sum or product is the call; else it is -1.
+struct tail_site {
+    astree* parent;
+    size_t index;
+    int call;
+};
+
+/********************* helpers **********************/
+
+static astree* declid(astree* decl){
+    if(decl->tokenCode == TOK_ARRAY)
+        return decl->children[1];
+    return decl->children[0];
+}
+
+// The checker binds a function's name only after its body, so a
+// call of itself is known by name.
+static bool self_call(astree* node, const tail_context& ctx){
+    return node->tokenCode == TOK_CALL
+        && node->children[0]->lexinfo == ctx.name;
+}
+
+static bool calls_self(astree* node, const tail_context& ctx){
+    if(self_call(node, ctx))
+        return true;
+    for(auto child : node->children){
+        if(calls_self(child, ctx))
+            return true;
+    }
+    return false;
+}
+
+static bool uses(astree* node, symbol* var){
+    if(node->tokenCode == TOK_IDENT && node->symbl.decl == var)
+        return true;
+    for(auto child : node->children){
+        if(uses(child, var))
+            return true;
+    }
+    return false;
+}
+
+// A TOK_IDENT bound to the param or local declared by id.
+static astree* use_of(astree* id, const location& lloc){
+    astree* ident = new astree(TOK_IDENT, lloc, id->lexinfo->c_str());
+    ident->symbl.decl = &id->symbl;
+    ident->symbl.attributes = id->symbl.attributes;
+    ident->symbl.type_name = id->symbl.type_name;
+    return ident;
+}
+
+static astree* store(astree* target, astree* value){
+    astree* node = new astree('=', value->lloc, "=");
+    return node->adopt(target, value);
+}
+
+static astree* combine(int op, astree* acc, astree* value){
+    astree* node = new astree(op, value->lloc, op == '+' ? "+" : "*");
+    node->symbl.attributes[static_cast<size_t>(attr::INT)] = true;
+    return node->adopt(temp_use(acc, value->lloc), value);
+}
+
+/******************** tail position *********************/
+
+// Moves what follows an if that returns on one side into the other
+// side, so that the if ends its block and each of its sides may end
+// in a call to go around with.
+static void restructure(astree* block){
+    auto& stmts = block->children;
+    for(size_t next = 0; next < stmts.size(); ++next){
+        astree* stmt = stmts[next];
+        if(stmt->tokenCode == TOK_BLOCK){
+            restructure(stmt);
+            continue;
+        }
+        if(stmt->tokenCode != TOK_IF)
+            continue;
+        for(size_t branch = 1; branch < stmt->children.size(); ++branch){
+            astree* part = stmt->children[branch];
+            if(part->tokenCode != TOK_BLOCK){
+                astree* wrapper = new astree(TOK_BLOCK, part->lloc, "{");
+                stmt->children[branch] = wrapper->adopt(part);
+            }
+        }
+        bool then_returns = always_returns(stmt->children[1]);
+        bool else_returns = stmt->children.size() == 3
+            && always_returns(stmt->children[2]);
+        if(next + 1 < stmts.size() && (then_returns || else_returns)){
+            vector<astree*> rest(stmts.begin() + next + 1, stmts.end());
+            stmts.resize(next + 1);
+            if(then_returns && else_returns){
+                for(auto dead : rest)
+                    delete dead;
+            }
+            else{
+                if(stmt->children.size() == 2)
+                    stmt->adopt(new astree(TOK_BLOCK, stmt->lloc, "{"));
+                auto& other = stmt->children[then_returns ? 2 : 1]->children;
+                other.insert(other.end(), rest.begin(), rest.end());
+            }
+        }
+        for(size_t branch = 1; branch < stmt->children.size(); ++branch)
+            restructure(stmt->children[branch]);
+    }
+}
+
+// Which operand of the sum or product value is a call to go around
+// with, keeping the other in the accumulator; -1 if neither.  The
+// other operand is computed before the call instead of after, so
+// it must not have effects if it came second.
+static int accumulated_call(astree* value, tail_context& ctx){
+    if(!ctx.scalar || value->children.size() != 2
+    || (value->tokenCode != '+' && value->tokenCode != '*'))
+        return -1;
+    if(ctx.op != 0 && ctx.op != value->tokenCode)
+        return -1;
+    int call = -1;
+    if(self_call(value->children[1], ctx))
+        call = 1;
+    else if(self_call(value->children[0], ctx) && pure(value->children[1]))
+        call = 0;
+    if(call >= 0)
+        ctx.op = value->tokenCode;
+    return call;
+}
+
+// Finds the calls of the function itself that are the last thing
+// done on their path through parent->children[index].
+static void find_tails(astree* parent, size_t index, tail_context& ctx,
+                       vector<tail_site>& tails){
+    astree* stmt = parent->children[index];
+    switch(stmt->tokenCode){
+    case TOK_BLOCK:
+        if(!stmt->children.empty())
+            find_tails(stmt, stmt->children.size() - 1, ctx, tails);
+        return;
+    case TOK_IF:
+        for(size_t branch = 1; branch < stmt->children.size(); ++branch)
+            find_tails(stmt, branch, ctx, tails);
+        return;
+    case TOK_RETURN: {
+        if(stmt->children.empty())
+            return;
+        astree* value = stmt->children[0];
+        if(self_call(value, ctx)){
+            tails.push_back({parent, index, -1});
+            return;
+        }
+        int call = accumulated_call(value, ctx);
+        if(call >= 0)
+            tails.push_back({parent, index, call});
+        return;
+    }
+    default:
+        if(!ctx.value && self_call(stmt, ctx))
+            tails.push_back({parent, index, -1});
+        return;
+    }
+}
+
+static astree* make_return(const tail_context& ctx, const location& lloc){
+    astree* ret = new astree(TOK_RETURN, lloc, "return");
+    if(ctx.value){
+        astree* type = ctx.function->children[0];
+        ret->adopt(make_zero(type->children.back()->symbl, lloc));
+    }
+    return ret;
+}
+
+// Ends each path through parent->children[index] that would fall
+// off the end of the function with a return, since in the loop it
+// would go around instead.  A value function falling off the end
+// returned garbage; it now returns zero.
+static void finish(astree* parent, size_t index, const tail_context& ctx,
+                   const unordered_set<astree*>& tails){
+    astree* stmt = parent->children[index];
+    if(tails.count(stmt) || stmt->tokenCode == TOK_RETURN)
+        return;
+    switch(stmt->tokenCode){
+    case TOK_BLOCK:
+        if(stmt->children.empty())
+            stmt->adopt(make_return(ctx, stmt->lloc));
+        else
+            finish(stmt, stmt->children.size() - 1, ctx, tails);
+        return;
+    case TOK_IF:
+        if(stmt->children.size() == 2)
+            stmt->adopt(new astree(TOK_BLOCK, stmt->lloc, "{"));
+        for(size_t branch = 1; branch < stmt->children.size(); ++branch)
+            finish(stmt, branch, ctx, tails);
+        return;
+    default:
+        parent->adopt(make_return(ctx, stmt->lloc));
+        return;
+    }
+}
+
+/********************* going around *********************/
+
+static astree* param_temp(size_t param, tail_context& ctx){
+    astree*& temp = ctx.param_temps[param];
+    if(temp == nullptr){
+        astree* id = declid(ctx.function->children[1]->children[param]);
+        string name = "__tail" + to_string(++tail_counter)
+            + "_" + id->symbl.oil_name;
+        temp = make_temp(name, make_zero(id->symbl, id->lloc));
+        ctx.decls.push_back(temp);
+    }
+    return temp;
+}
+
+// The statements replacing a tail call: the accumulated operand is
+// folded in, then the arguments are stored into the params.  A param
+// another argument still reads is stored last, through a temporary.
+static astree* go_around(const tail_site& tail, tail_context& ctx){
+    astree* stmt = tail.parent->children[tail.index];
+    astree* block = new astree(TOK_BLOCK, stmt->lloc, "{");
+    astree* call = stmt;
+    if(stmt->tokenCode == TOK_RETURN){
+        astree* value = stmt->children[0];
+        call = value;
+        if(tail.call >= 0){
+            call = value->children[tail.call];
+            astree* other = value->children[1 - tail.call];
+            value->children.clear();
+            delete value;
+            stmt->children[0] = call;
+            block->adopt(store(temp_use(ctx.acc, other->lloc),
+                               combine(ctx.op, ctx.acc, other)));
+        }
+    }
+
+    astree* params = ctx.function->children[1];
+    size_t count = params->children.size();
+    vector<astree*> args(call->children.begin() + 1, call->children.end());
+    call->children.resize(1);
+    vector<bool> changes(count);
+    for(size_t param = 0; param < count; ++param){
+        astree* id = declid(params->children[param]);
+        changes[param] = args[param]->tokenCode != TOK_IDENT
+            || args[param]->symbl.decl != &id->symbl;
+    }
+    vector<bool> through_temp(count);
+    for(size_t param = 0; param < count; ++param){
+        symbol* var = &declid(params->children[param])->symbl;
+        for(size_t other = 0; other < count; ++other){
+            if(other != param && changes[param] && changes[other]
+            && uses(args[other], var))
+                through_temp[param] = true;
+        }
+    }
+    for(size_t param = 0; param < count; ++param){
+        if(through_temp[param]){
+            astree* temp = param_temp(param, ctx);
+            block->adopt(store(temp_use(temp, args[param]->lloc),
+                               args[param]));
+        }
+    }
+    for(size_t param = 0; param < count; ++param){
+        astree* id = declid(params->children[param]);
+        if(!changes[param])
+            delete args[param];
+        else if(!through_temp[param])
+            block->adopt(store(use_of(id, args[param]->lloc), args[param]));
+    }
+    for(size_t param = 0; param < count; ++param){
+        if(!through_temp[param])
+            continue;
+        astree* id = declid(params->children[param]);
+        astree* temp = param_temp(param, ctx);
+        block->adopt(store(use_of(id, stmt->lloc),
+                           temp_use(temp, stmt->lloc)));
+    }
+    delete stmt;
+    return block;
+}
+
+// Folds the accumulator into every value still returned.
+static void accumulate_returns(astree* node, const tail_context& ctx){
+    if(node->tokenCode == TOK_RETURN && !node->children.empty()){
+        node->children[0] = combine(ctx.op, ctx.acc, node->children[0]);
+        return;
+    }
+    for(auto child : node->children)
+        accumulate_returns(child, ctx);
+}
+
+/********************* the pass *********************/
+
+static void tail_function(astree* function){
+    astree* type = function->children[0];
+    astree* id = type->children.back();
+    astree* body = function->children[2];
+    tail_context ctx;
+    ctx.function = function;
+    ctx.name = id->lexinfo;
+    ctx.value = !has_attr(id->symbl, attr::VOID);
+    ctx.scalar = has_attr(id->symbl, attr::INT)
+        && !has_attr(id->symbl, attr::ARRAY);
+    ctx.op = 0;
+    ctx.acc = nullptr;
+    if(!calls_self(body, ctx))
+        return;
+
+    // tried on a copy first, so that a function with no call to go
+    // around with keeps its statements as they were
+    astree* trial = copy_expr(body);
+    restructure(trial);
+    vector<tail_site> tails;
+    if(!trial->children.empty())
+        find_tails(trial, trial->children.size() - 1, ctx, tails);
+    delete trial;
+    if(tails.empty())
+        return;
+    tails.clear();
+    ctx.op = 0;
+
+    // the locals are declared once, ahead of the loop; each time
+    // around, a local's initializer is stored where it was declared
+    vector<astree*> locals;
+    astree* loop_body = new astree(TOK_BLOCK, body->lloc, "{");
+    for(auto stmt : body->children){
+        if(stmt->tokenCode != TOK_VARDECL){
+            loop_body->adopt(stmt);
+            continue;
+        }
+        astree* local_id = declid(stmt->children[0]);
+        loop_body->adopt(store(use_of(local_id, stmt->lloc),
+                               stmt->children[1]));
+        stmt->children[1] = make_zero(local_id->symbl, stmt->lloc);
+        locals.push_back(stmt);
+    }
+    body->children = locals;
+    restructure(loop_body);
+    find_tails(loop_body, loop_body->children.size() - 1, ctx, tails);
+
+    unordered_set<astree*> tail_stmts;
+    for(auto& tail : tails)
+        tail_stmts.insert(tail.parent->children[tail.index]);
+    finish(loop_body, loop_body->children.size() - 1, ctx, tail_stmts);
+    if(ctx.op != 0){
+        astree* identity = new astree(TOK_INTCON, body->lloc,
+                                      ctx.op == '+' ? "0" : "1");
+        identity->symbl.attributes[static_cast<size_t>(attr::INT)] = true;
+        ctx.acc = make_temp("__tail" + to_string(++tail_counter), identity);
+        ctx.decls.push_back(ctx.acc);
+    }
+    for(auto& tail : tails){
+        optprintf(tail.parent->children[tail.index]->lloc,
+                  "%s: %s", id->lexinfo->c_str(), tail.call < 0
+                  ? "tail call turned into a loop"
+                  : "recursion accumulated into a loop");
+        tail.parent->children[tail.index] = go_around(tail, ctx);
+    }
+    if(ctx.op != 0)
+        accumulate_returns(loop_body, ctx);
+
+    astree* forever = new astree(TOK_INTCON, body->lloc, "1");
+    forever->symbl.attributes[static_cast<size_t>(attr::INT)] = true;
+    astree* loop = new astree(TOK_WHILE, body->lloc, "while");
+    body->children.insert(body->children.end(),
+                          ctx.decls.begin(), ctx.decls.end());
+    body->adopt(loop->adopt(forever, loop_body));
+    ++loops_made;
+}
+
+void tail_recursion(astree* root){
+    size_t before = loops_made;
+    for(auto function : root->children){
+        if(function->tokenCode == TOK_FUNCTION
+        && function->children.size() == 3)
+            tail_function(function);
+    }
+    if(optfile != nullptr){
+        fprintf(optfile, "tailrec: %zu functions turned into loops\n",
+                loops_made - before);
+    }
+}
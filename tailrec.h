@@ -0,0 +1,12 @@
+#ifndef __TAILREC_H__
+#define __TAILREC_H__
+
+#include "astree.h"
+
+// Turns functions that call themselves last into loops: the call
+// stores its arguments into the params and goes around again.  A
+// return of a sum or product with the call keeps the other operand
+// in an accumulator, so it need not wait for the call.
+void tail_recursion (astree* root);
+
+#endif